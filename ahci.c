@@ -0,0 +1,447 @@
+#include "pos_system.h"
+
+// AHCI SATA (QEMU ich9-ahci), first port with an ATA drive attached
+#define AHCI_CAP 0x00
+#define AHCI_GHC 0x04
+#define AHCI_IS 0x08
+#define AHCI_PI 0x0C
+
+#define AHCI_GHC_IE 0x00000002
+#define AHCI_GHC_AE 0x80000000
+#define AHCI_CAP_SNCQ 0x40000000
+
+#define AHCI_PORT_BASE 0x100
+#define AHCI_PORT_SIZE 0x80
+#define PORT_CLB 0x00
+#define PORT_CLBU 0x04
+#define PORT_FB 0x08
+#define PORT_FBU 0x0C
+#define PORT_IS 0x10
+#define PORT_IE 0x14
+#define PORT_CMD 0x18
+#define PORT_TFD 0x20
+#define PORT_SIG 0x24
+#define PORT_SSTS 0x28
+#define PORT_SERR 0x30
+#define PORT_SACT 0x34
+#define PORT_CI 0x38
+
+#define PORT_CMD_ST 0x0001
+#define PORT_CMD_FRE 0x0010
+#define PORT_CMD_FR 0x4000
+#define PORT_CMD_CR 0x8000
+#define PORT_IS_TFES 0x40000000
+#define PORT_IE_DEFAULT 0x7D40003F // Completions and all error causes
+
+#define SATA_SIG_ATA 0x00000101
+#define SSTS_DET_PRESENT 0x3
+
+#define FIS_TYPE_REG_H2D 0x27
+#define ATA_CMD_READ_DMA_EXT 0x25
+#define ATA_CMD_WRITE_DMA_EXT 0x35
+#define ATA_CMD_READ_FPDMA 0x60
+#define ATA_CMD_WRITE_FPDMA 0x61
+#define ATA_CMD_FLUSH_EXT 0xEA
+
+// Command structures in the driver part of the Device I/O Buffer
+#define AHCI_CMD_LIST 0x3C4000  // 32 headers, 1KB aligned
+#define AHCI_FIS_AREA 0x3C4400  // Received FIS, 256 byte aligned
+#define AHCI_CMD_TABLES 0x3C5000 // 32 tables of 256 bytes
+#define AHCI_CMD_TABLE_SIZE 256
+#define AHCI_BOUNCE_BUFFER 0x3E0000
+#define AHCI_BOUNCE_SECTORS 128
+
+#define AHCI_MAX_SLOTS 32
+#define AHCI_MAX_SECTORS 8192 // One 4MB PRD per command
+
+typedef struct {
+    uint32_t flags;        // CFL, W, PRDTL
+    volatile uint32_t prdbc;
+    uint32_t ctba;
+    uint32_t ctbau;
+    uint32_t reserved[4];
+} __attribute__((packed)) ahci_cmd_header_t;
+
+typedef struct {
+    uint32_t dba;
+    uint32_t dbau;
+    uint32_t reserved;
+    uint32_t dbc; // Byte count - 1, bit 31 interrupt on completion
+} __attribute__((packed)) ahci_prd_t;
+
+typedef struct {
+    uint8_t cfis[64];
+    uint8_t acmd[16];
+    uint8_t reserved[48];
+    ahci_prd_t prdt[1];
+} __attribute__((packed)) ahci_cmd_table_t;
+
+typedef struct {
+    volatile uint8_t* abar;
+    volatile uint8_t* port;
+    uint8_t irq;
+    uint8_t ncq;
+    uint8_t slots;
+    volatile uint32_t active;    // Slots issued and not yet completed
+    volatile uint32_t waiters;   // Task ids (bitmask) sleeping on completions
+    disk_request_t* requests[AHCI_MAX_SLOTS];
+    uint8_t error_pending;       // Task file error not yet logged
+    uint32_t error_tfd;
+    uint32_t error_active;
+} ahci_t;
+
+ahci_t ahci;
+
+static inline uint32_t port_read(uint32_t reg) {
+    return *(volatile uint32_t*)(ahci.port + reg);
+}
+
+static inline void port_write(uint32_t reg, uint32_t value) {
+    *(volatile uint32_t*)(ahci.port + reg) = value;
+}
+
+static inline uint32_t hba_read(uint32_t reg) {
+    return *(volatile uint32_t*)(ahci.abar + reg);
+}
+
+static inline void hba_write(uint32_t reg, uint32_t value) {
+    *(volatile uint32_t*)(ahci.abar + reg) = value;
+}
+
+static void ahci_stop_port() {
+    port_write(PORT_CMD, port_read(PORT_CMD) & ~(PORT_CMD_ST | PORT_CMD_FRE));
+    while(port_read(PORT_CMD) & (PORT_CMD_CR | PORT_CMD_FR));
+}
+
+static void ahci_start_port() {
+    while(port_read(PORT_CMD) & PORT_CMD_CR);
+    port_write(PORT_CMD, port_read(PORT_CMD) | PORT_CMD_FRE | PORT_CMD_ST);
+}
+
+// Complete every slot the drive has retired; on a task file error NCQ
+// aborts all outstanding commands, so fail them and restart the port.
+// Runs in the ISR, so the error is only recorded for ahci_report_error().
+static void ahci_complete() {
+    uint32_t port_status = port_read(PORT_IS);
+    port_write(PORT_IS, port_status);
+    
+    uint32_t still_busy = port_read(PORT_SACT) | port_read(PORT_CI);
+    uint8_t failed = (port_status & PORT_IS_TFES) != 0;
+    if(failed) {
+        ahci.error_pending = 1;
+        ahci.error_tfd = port_read(PORT_TFD);
+        ahci.error_active = ahci.active;
+        ahci_stop_port();
+        port_write(PORT_SERR, 0xFFFFFFFF);
+        ahci_start_port();
+        still_busy = 0;
+    }
+    
+    uint32_t done = ahci.active & ~still_busy;
+    for(uint8_t slot = 0; slot < AHCI_MAX_SLOTS; slot++) {
+        if(!(done & (1 << slot))) continue;
+        
+        disk_request_t* request = ahci.requests[slot];
+        ahci.requests[slot] = NULL;
+        if(request) {
+            request->status = !failed;
+            request->pending = 0;
+            if(failed) disk_stats.errors++;
+        }
+    }
+    ahci.active &= ~done;
+}
+
+void isr_ahci(interrupt_frame_t* frame) {
+    (void)frame;
+    ahci_complete();
+    hba_write(AHCI_IS, hba_read(AHCI_IS));
+    
+    if(ahci.irq >= 8) outb(0xA0, 0x20);
+    outb(0x20, 0x20);
+    
+    uint32_t waiters = ahci.waiters;
+    ahci.waiters = 0;
+    for(uint32_t task = 0; waiters; task++, waiters >>= 1) {
+        if(waiters & 1) task_wake(task);
+    }
+}
+
+// Called with interrupts off; sleep until the ISR retires something and
+// let the caller re-check its condition. Before the scheduler starts
+// there is nothing to switch to, so retire completions by polling.
+static void ahci_sleep() {
+    if(!scheduler_started) {
+        ahci_complete();
+        hba_write(AHCI_IS, hba_read(AHCI_IS));
+        return;
+    }
+    ahci.waiters |= 1 << current_task;
+    task_block();
+}
+
+// Halt until the next interrupt, only once interrupts belong to tasks
+static void ahci_idle() {
+    if(scheduler_started) asm volatile("sti; hlt");
+}
+
+// log_error() runs the SSE2 string kernels, whose registers only task
+// switches save, so a failed request's waiter logs the error instead
+static void ahci_report_error() {
+    asm volatile("cli");
+    uint8_t pending = ahci.error_pending;
+    uint32_t tfd = ahci.error_tfd;
+    uint32_t active = ahci.error_active;
+    ahci.error_pending = 0;
+    irq_enable();
+    
+    if(pending) {
+        log_error("AHCI", "Task file error, TFD: %08X, Active: %08X",
+                  tfd, active);
+    }
+}
+
+static int8_t ahci_alloc_slot() {
+    for(uint8_t slot = 0; slot < ahci.slots; slot++) {
+        if(!(ahci.active & (1 << slot))) return slot;
+    }
+    return -1;
+}
+
+static void ahci_build_command(uint8_t slot, uint8_t command, uint32_t lba,
+                               uint32_t count, void* buffer, uint8_t write) {
+    ahci_cmd_header_t* header = (ahci_cmd_header_t*)AHCI_CMD_LIST + slot;
+    ahci_cmd_table_t* table = (ahci_cmd_table_t*)(AHCI_CMD_TABLES + 
+                                                  slot * AHCI_CMD_TABLE_SIZE);
+    uint32_t bytes = count * 512;
+    
+    memset(table, 0, sizeof(ahci_cmd_table_t));
+    header->flags = 5 | (write ? 0x40 : 0) | ((bytes ? 1 : 0) << 16);
+    header->prdbc = 0;
+    header->ctba = (uint32_t)table;
+    header->ctbau = 0;
+    
+    if(bytes) {
+        table->prdt[0].dba = (uint32_t)buffer;
+        table->prdt[0].dbau = 0;
+        table->prdt[0].dbc = (bytes - 1) | 0x80000000;
+    }
+    
+    uint8_t* fis = table->cfis;
+    fis[0] = FIS_TYPE_REG_H2D;
+    fis[1] = 0x80; // Command register update
+    fis[2] = command;
+    fis[4] = lba & 0xFF;
+    fis[5] = (lba >> 8) & 0xFF;
+    fis[6] = (lba >> 16) & 0xFF;
+    fis[7] = 0x40; // LBA mode
+    fis[8] = (lba >> 24) & 0xFF;
+    
+    if(command == ATA_CMD_READ_FPDMA || command == ATA_CMD_WRITE_FPDMA) {
+        // NCQ: sector count in FEATURES, tag in COUNT bits 7:3
+        fis[3] = count & 0xFF;
+        fis[11] = (count >> 8) & 0xFF;
+        fis[12] = slot << 3;
+    } else {
+        fis[12] = count & 0xFF;
+        fis[13] = (count >> 8) & 0xFF;
+    }
+}
+
+static uint8_t ahci_submit(disk_request_t* request) {
+    if(request->count > AHCI_MAX_SECTORS || ((uint32_t)request->buffer & 1)) {
+        log_error("AHCI", "Unsupported request, LBA: %d, Count: %d",
+                  request->lba, request->count);
+        request->status = 0;
+        request->pending = 0;
+        return 0;
+    }
+    
+    // Interrupts stay off from slot allocation until the command is issued
+    int8_t slot;
+    while(1) {
+        asm volatile("cli");
+        if((slot = ahci_alloc_slot()) >= 0) break;
+        ahci_sleep();
+        if(ahci_alloc_slot() < 0) ahci_idle();
+    }
+    
+    uint8_t command;
+    if(ahci.ncq) {
+        command = request->write ? ATA_CMD_WRITE_FPDMA : ATA_CMD_READ_FPDMA;
+    } else {
+        command = request->write ? ATA_CMD_WRITE_DMA_EXT : ATA_CMD_READ_DMA_EXT;
+    }
+    ahci_build_command(slot, command, request->lba, request->count,
+                       request->buffer, request->write);
+    
+    request->tag = slot;
+    request->status = 0;
+    request->pending = 1;
+    ahci.requests[slot] = request;
+    ahci.active |= 1 << slot;
+    
+    uint32_t in_flight = 0;
+    for(uint32_t bits = ahci.active; bits; bits >>= 1) in_flight += bits & 1;
+    if(in_flight > disk_stats.max_in_flight) disk_stats.max_in_flight = in_flight;
+    
+    if(ahci.ncq) port_write(PORT_SACT, 1 << slot);
+    port_write(PORT_CI, 1 << slot);
+    irq_enable();
+    
+    disk_stats.commands++;
+    disk_stats.sectors += request->count;
+    return 1;
+}
+
+static uint8_t ahci_wait(disk_request_t* request) {
+    while(1) {
+        asm volatile("cli");
+        if(!request->pending) break;
+        ahci_sleep();
+        if(request->pending) ahci_idle();
+    }
+    irq_enable();
+    
+    if(!request->status) ahci_report_error();
+    return request->status;
+}
+
+// FLUSH CACHE EXT is not queueable, so drain the port first
+static uint8_t ahci_flush() {
+    while(1) {
+        asm volatile("cli");
+        if(!ahci.active) break;
+        ahci_sleep();
+        if(ahci.active) ahci_idle();
+    }
+    
+    // Still cli: slot 0 is free and nothing can be issued in between
+    disk_request_t request = {.buffer = NULL};
+    ahci_build_command(0, ATA_CMD_FLUSH_EXT, 0, 0, NULL, 0);
+    request.pending = 1;
+    ahci.requests[0] = &request;
+    ahci.active |= 1;
+    port_write(PORT_CI, 1);
+    irq_enable();
+    
+    return ahci_wait(&request);
+}
+
+// Synchronous paths split into commands and keep a full queue of them
+static uint8_t ahci_transfer(uint32_t lba, uint32_t count, void* buffer,
+                             uint8_t write) {
+    // DMA needs word alignment; bounce odd buffers a chunk at a time
+    if((uint32_t)buffer & 1) {
+        uint8_t* bounce = (uint8_t*)AHCI_BOUNCE_BUFFER;
+        while(count > 0) {
+            uint32_t chunk = count > AHCI_BOUNCE_SECTORS ? 
+                             AHCI_BOUNCE_SECTORS : count;
+            if(write) memcpy(bounce, buffer, chunk * 512);
+            if(!ahci_transfer(lba, chunk, bounce, write)) return 0;
+            if(!write) memcpy(buffer, bounce, chunk * 512);
+            
+            lba += chunk;
+            count -= chunk;
+            buffer = (uint8_t*)buffer + chunk * 512;
+        }
+        return 1;
+    }
+    
+    disk_request_t requests[DISK_BATCH_MAX];
+    uint32_t issued = 0;
+    
+    while(count > 0 && issued < DISK_BATCH_MAX) {
+        uint32_t chunk = count > AHCI_MAX_SECTORS ? AHCI_MAX_SECTORS : count;
+        requests[issued].lba = lba;
+        requests[issued].count = chunk;
+        requests[issued].buffer = buffer;
+        requests[issued].write = write;
+        ahci_submit(&requests[issued]);
+        issued++;
+        
+        lba += chunk;
+        count -= chunk;
+        buffer = (uint8_t*)buffer + chunk * 512;
+    }
+    
+    uint8_t ok = 1;
+    for(uint32_t i = 0; i < issued; i++) {
+        if(!ahci_wait(&requests[i])) ok = 0;
+    }
+    
+    if(ok && count > 0) return ahci_transfer(lba, count, buffer, write);
+    return ok;
+}
+
+static uint8_t ahci_read(uint32_t lba, uint32_t count, void* buffer) {
+    return ahci_transfer(lba, count, buffer, 0);
+}
+
+static uint8_t ahci_write(uint32_t lba, uint32_t count, const void* buffer) {
+    if(!ahci_transfer(lba, count, (void*)buffer, 1)) return 0;
+    return ahci_flush();
+}
+
+disk_backend_t ahci_backend = {
+    "AHCI",
+    ahci_read,
+    ahci_write,
+    NULL,
+    ahci_submit,
+    ahci_wait
+};
+
+disk_backend_t* ahci_init() {
+    pci_device_t dev;
+    
+    // Mass storage controller, SATA, AHCI 1.0 programming interface
+    if(!pci_find_class(0x01, 0x06, &dev) || dev.prog_if != 0x01) return NULL;
+    
+    memset(&ahci, 0, sizeof(ahci));
+    ahci.abar = (volatile uint8_t*)(pci_bar(&dev, 5) & 0xFFFFFFF0);
+    ahci.irq = dev.irq;
+    pci_enable_bus_master(&dev);
+    
+    hba_write(AHCI_GHC, hba_read(AHCI_GHC) | AHCI_GHC_AE);
+    
+    uint32_t cap = hba_read(AHCI_CAP);
+    uint32_t implemented = hba_read(AHCI_PI);
+    ahci.slots = ((cap >> 8) & 0x1F) + 1;
+    ahci.ncq = (cap & AHCI_CAP_SNCQ) != 0;
+    
+    for(uint8_t i = 0; i < 32; i++) {
+        if(!(implemented & (1 << i))) continue;
+        
+        volatile uint8_t* port = ahci.abar + AHCI_PORT_BASE + i * AHCI_PORT_SIZE;
+        uint32_t ssts = *(volatile uint32_t*)(port + PORT_SSTS);
+        uint32_t sig = *(volatile uint32_t*)(port + PORT_SIG);
+        if((ssts & 0x0F) == SSTS_DET_PRESENT && sig == SATA_SIG_ATA) {
+            ahci.port = port;
+            break;
+        }
+    }
+    
+    if(!ahci.port) return NULL;
+    
+    ahci_stop_port();
+    memset((void*)AHCI_CMD_LIST, 0, 0x400);
+    memset((void*)AHCI_FIS_AREA, 0, 0x100);
+    port_write(PORT_CLB, AHCI_CMD_LIST);
+    port_write(PORT_CLBU, 0);
+    port_write(PORT_FB, AHCI_FIS_AREA);
+    port_write(PORT_FBU, 0);
+    port_write(PORT_SERR, 0xFFFFFFFF);
+    port_write(PORT_IS, 0xFFFFFFFF);
+    port_write(PORT_IE, PORT_IE_DEFAULT);
+    ahci_start_port();
+    
+    register_irq_handler(ahci.irq, isr_ahci);
+    hba_write(AHCI_IS, 0xFFFFFFFF);
+    hba_write(AHCI_GHC, hba_read(AHCI_GHC) | AHCI_GHC_IE);
+    
+    log_activity("AHCI", "Slots: %d, NCQ: %s", ahci.slots,
+                 ahci.ncq ? "yes" : "no");
+    
+    return &ahci_backend;
+}
@@ -0,0 +1,200 @@
+#include "pos_system.h"
+
+// Sector cache in the Device I/O Buffer region (0x380000 - 0x3BFFFF)
+#define BCACHE_BASE 0x380000
+#define BCACHE_BLOCKS 512
+#define BCACHE_HASH_SIZE 1024
+#define BCACHE_NONE 0xFFFF
+#define SECTOR_SIZE 512
+
+typedef struct {
+    uint32_t lba;
+    uint16_t hash_next;
+    uint8_t valid;
+    uint8_t dirty;
+    uint8_t pinned;
+    uint8_t referenced; // CLOCK second-chance bit
+} bcache_entry_t;
+
+bcache_entry_t bcache_entries[BCACHE_BLOCKS];
+uint16_t bcache_hash[BCACHE_HASH_SIZE];
+uint32_t bcache_hand = 0;
+bcache_stats_t bcache_stats;
+
+static uint8_t* bcache_data(uint16_t index) {
+    return (uint8_t*)(BCACHE_BASE + (uint32_t)index * SECTOR_SIZE);
+}
+
+static uint16_t bcache_lookup(uint32_t lba) {
+    uint16_t index = bcache_hash[lba % BCACHE_HASH_SIZE];
+    while(index != BCACHE_NONE) {
+        if(bcache_entries[index].lba == lba) return index;
+        index = bcache_entries[index].hash_next;
+    }
+    return BCACHE_NONE;
+}
+
+static void bcache_unhash(uint16_t index) {
+    uint16_t* link = &bcache_hash[bcache_entries[index].lba % BCACHE_HASH_SIZE];
+    while(*link != BCACHE_NONE) {
+        if(*link == index) {
+            *link = bcache_entries[index].hash_next;
+            return;
+        }
+        link = &bcache_entries[*link].hash_next;
+    }
+}
+
+static void bcache_writeback(uint16_t index) {
+    if(bcache_entries[index].dirty) {
+        disk_write_sector(bcache_entries[index].lba, bcache_data(index));
+        bcache_entries[index].dirty = 0;
+        bcache_stats.writebacks++;
+    }
+}
+
+// CLOCK replacement: skip pinned blocks, give referenced ones a second chance
+static uint16_t bcache_victim() {
+    for(uint32_t scanned = 0; scanned < 2 * BCACHE_BLOCKS; scanned++) {
+        uint16_t index = bcache_hand;
+        bcache_hand = (bcache_hand + 1) % BCACHE_BLOCKS;
+        
+        bcache_entry_t* entry = &bcache_entries[index];
+        if(!entry->valid) return index;
+        if(entry->pinned) continue;
+        if(entry->referenced) {
+            entry->referenced = 0;
+            continue;
+        }
+        
+        bcache_writeback(index);
+        bcache_unhash(index);
+        entry->valid = 0;
+        bcache_stats.evictions++;
+        return index;
+    }
+    return BCACHE_NONE;
+}
+
+// Find or allocate the block for an LBA; read it from disk if requested
+static uint16_t bcache_fetch(uint32_t lba, uint8_t read) {
+    uint16_t index = bcache_lookup(lba);
+    if(index != BCACHE_NONE) {
+        bcache_entries[index].referenced = 1;
+        bcache_stats.hits++;
+        return index;
+    }
+    
+    bcache_stats.misses++;
+    
+    index = bcache_victim();
+    if(index == BCACHE_NONE) {
+        log_error("Block cache", "All blocks pinned, LBA: %d", lba);
+        return BCACHE_NONE;
+    }
+    
+    bcache_entry_t* entry = &bcache_entries[index];
+    entry->lba = lba;
+    entry->valid = 1;
+    entry->dirty = 0;
+    entry->pinned = 0;
+    entry->referenced = 1;
+    entry->hash_next = bcache_hash[lba % BCACHE_HASH_SIZE];
+    bcache_hash[lba % BCACHE_HASH_SIZE] = index;
+    
+    if(read) {
+        disk_read_sector(lba, bcache_data(index));
+    }
+    
+    return index;
+}
+
+void bcache_init() {
+    for(uint32_t i = 0; i < BCACHE_HASH_SIZE; i++) {
+        bcache_hash[i] = BCACHE_NONE;
+    }
+    memset(bcache_entries, 0, sizeof(bcache_entries));
+    memset(&bcache_stats, 0, sizeof(bcache_stats));
+    bcache_hand = 0;
+}
+
+// Pointer to the cached sector; valid until the block is evicted, so
+// callers that hold it across other cache calls must pin it
+uint8_t* bcache_get(uint32_t lba) {
+    uint16_t index = bcache_fetch(lba, 1);
+    if(index == BCACHE_NONE) return NULL;
+    return bcache_data(index);
+}
+
+uint8_t bcache_read(uint32_t lba, void* buffer) {
+    uint16_t index = bcache_fetch(lba, 1);
+    if(index == BCACHE_NONE) {
+        disk_read_sector(lba, buffer);
+        return 0;
+    }
+    memcpy(buffer, bcache_data(index), SECTOR_SIZE);
+    return 1;
+}
+
+// Write-back: the sector reaches disk on eviction or bcache_flush()
+uint8_t bcache_write(uint32_t lba, const void* buffer) {
+    uint16_t index = bcache_fetch(lba, 0);
+    if(index == BCACHE_NONE) {
+        disk_write_sector(lba, (void*)buffer);
+        return 0;
+    }
+    memcpy(bcache_data(index), buffer, SECTOR_SIZE);
+    bcache_entries[index].dirty = 1;
+    return 1;
+}
+
+void bcache_mark_dirty(uint32_t lba) {
+    uint16_t index = bcache_lookup(lba);
+    if(index != BCACHE_NONE) {
+        bcache_entries[index].dirty = 1;
+    }
+}
+
+void bcache_pin(uint32_t lba) {
+    uint16_t index = bcache_fetch(lba, 1);
+    if(index != BCACHE_NONE) {
+        bcache_entries[index].pinned = 1;
+    }
+}
+
+void bcache_unpin(uint32_t lba) {
+    uint16_t index = bcache_lookup(lba);
+    if(index != BCACHE_NONE) {
+        bcache_entries[index].pinned = 0;
+    }
+}
+
+void bcache_flush() {
+    for(uint16_t i = 0; i < BCACHE_BLOCKS; i++) {
+        if(bcache_entries[i].valid) {
+            bcache_writeback(i);
+        }
+    }
+}
+
+// Direct multi-sector I/O bypasses the cache; these keep the two coherent
+void bcache_flush_range(uint32_t lba, uint32_t count) {
+    for(uint16_t i = 0; i < BCACHE_BLOCKS; i++) {
+        if(bcache_entries[i].valid &&
+           bcache_entries[i].lba >= lba && bcache_entries[i].lba < lba + count) {
+            bcache_writeback(i);
+        }
+    }
+}
+
+void bcache_invalidate_range(uint32_t lba, uint32_t count) {
+    for(uint16_t i = 0; i < BCACHE_BLOCKS; i++) {
+        bcache_entry_t* entry = &bcache_entries[i];
+        if(entry->valid && !entry->pinned &&
+           entry->lba >= lba && entry->lba < lba + count) {
+            bcache_unhash(i);
+            entry->valid = 0;
+            entry->dirty = 0;
+        }
+    }
+}
@@ -35,17 +35,6 @@ typedef struct {
     uint8_t taxable;
 } transaction_item_t;
 
-typedef struct {
-    char provider_code[8];
-    char provider_name[32];
-    float coverage_percentage;
-    float max_coverage_per_year;
-    float used_coverage;
-    uint8_t requires_preauth;
-    char contact[64];
-    char phone[20];
-} insurance_provider_t;
-
 typedef struct {
     uint32_t cashier_id;
     char name[32];
@@ -58,15 +47,45 @@ typedef struct {
 } cashier_session_t;
 
 // Databases
-transaction_t transaction_db[MAX_TRANSACTIONS];
-transaction_item_t transaction_items[MAX_TRANSACTIONS * 10]; // 10 items per transaction avg
-insurance_provider_t insurance_db[MAX_INSURANCE_PROVIDERS];
+transaction_t transaction_db_store[MAX_TRANSACTIONS];
+transaction_t* transaction_db = transaction_db_store;
+transaction_item_t transaction_items_store[MAX_TRANSACTIONS * 10]; // 10 items per transaction avg
+transaction_item_t* transaction_items = transaction_items_store;
+insurance_provider_t insurance_db_store[MAX_INSURANCE_PROVIDERS];
+insurance_provider_t* insurance_db = insurance_db_store;
 cashier_session_t current_cashier;
 
 // Current state
 float cash_drawer = 1000.00; // Starting float
 uint32_t current_transaction_id = 0;
 
+// Table files
+void load_transaction_database() {
+    transaction_db = db_register_table(DB_TABLE_TRANSACTION, "TRANSACT.DAT",
+                                       transaction_db_store,
+                                       sizeof(transaction_t), MAX_TRANSACTIONS);
+    transaction_items = db_register_table(DB_TABLE_TRANSACTION_ITEM,
+                                          "TRANITEM.DAT",
+                                          transaction_items_store,
+                                          sizeof(transaction_item_t),
+                                          MAX_TRANSACTIONS * 10);
+    db_load_table(DB_TABLE_TRANSACTION);
+    db_load_table(DB_TABLE_TRANSACTION_ITEM);
+}
+
+void save_transaction_database() {
+    db_save_table(DB_TABLE_TRANSACTION);
+    db_save_table(DB_TABLE_TRANSACTION_ITEM);
+}
+
+void load_insurance_database() {
+    insurance_db = db_register_table(DB_TABLE_INSURANCE, "INSURANC.DAT",
+                                     insurance_db_store,
+                                     sizeof(insurance_provider_t),
+                                     MAX_INSURANCE_PROVIDERS);
+    db_load_table(DB_TABLE_INSURANCE);
+}
+
 void cashier_login() {
     clear_screen();
     print_header("CASHIER LOGIN");
@@ -134,23 +153,40 @@ void process_payment(uint32_t dispense_id) {
     float insurance_amount = 0;
     float patient_amount = amount_due;
     
+    // Terms come from the master data; INSURANC.DAT only carries what
+    // each provider has paid out, in the same row as its master record
+    const insurance_provider_t* provider = NULL;
+    if(use_insurance && patient->insurance_type <= MAX_INSURANCE_PROVIDERS) {
+        provider = master_row(&master_insurance, patient->insurance_type - 1);
+    }
+    if(use_insurance && provider == NULL) {
+        log_error("Cashier", "No insurance provider for type %d",
+                  patient->insurance_type);
+        print("Insurance provider not on file, patient pays in full.\n");
+        use_insurance = 0;
+    }
+    
     if(use_insurance) {
         insurance_provider_t* ins = 
             &insurance_db[patient->insurance_type - 1];
         
-        insurance_amount = amount_due * ins->coverage_percentage / 100;
-        if(insurance_amount > ins->max_coverage_per_year - ins->used_coverage) {
-            insurance_amount = ins->max_coverage_per_year - ins->used_coverage;
+        insurance_amount = amount_due * provider->coverage_percentage / 100;
+        if(insurance_amount > 
+           provider->max_coverage_per_year - ins->used_coverage) {
+            insurance_amount = 
+                provider->max_coverage_per_year - ins->used_coverage;
         }
+        if(insurance_amount < 0) insurance_amount = 0;
         
         patient_amount = amount_due - insurance_amount;
         
-        print("\nInsurance Coverage: %.1f%%\n", ins->coverage_percentage);
+        print("\nInsurance Coverage: %.1f%%\n", provider->coverage_percentage);
         print("Insurance Pays: $%.2f\n", insurance_amount);
         print("Patient Pays: $%.2f\n", patient_amount);
         
         // Update insurance used
         ins->used_coverage += insurance_amount;
+        db_log_change(DB_TABLE_INSURANCE, ins);
     }
     
     // Process patient payment
@@ -239,6 +275,11 @@ void process_payment(uint32_t dispense_id) {
     // Update dispense record
     dispense->status = 1; // Paid
     
+    // Redo-log the payment; one commit makes it durable
+    db_log_change(DB_TABLE_TRANSACTION, trans);
+    db_log_change(DB_TABLE_DISPENSE, dispense);
+    db_commit();
+    
     // Print receipt
     print_receipt(trans->transaction_id);
     
@@ -432,8 +473,13 @@ void cashier_main() {
     while(1) {
         clear_screen();
         print_header("CASHIER SYSTEM - %s", current_cashier.till_number);
+        boot_first_menu();
         
         // Check for pending payments (from pharmacy)
+        uint32_t dispense_id;
+        while(ipc_take_work(MODULE_CASHIER, &dispense_id)) {
+            process_payment(dispense_id);
+        }
         check_pending_payments();
         
         print_time_date();
@@ -448,7 +494,8 @@ void cashier_main() {
         print("7. Logout\n");
         print("\nSelection: ");
         
-        char choice = getchar();
+        // 0 when a payment request arrives first; the loop then handles it
+        char choice = ipc_menu_key(MODULE_CASHIER);
         switch(choice) {
             case '1':
                 process_payment_menu();
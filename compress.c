@@ -0,0 +1,472 @@
+#include "pos_system.h"
+
+// LZ4-style block compression and the clinical text store. Free-text
+// fields (diagnosis, symptoms, notes) live outside their records as one
+// compressed blob per record, so the fixed-size tables only carry a
+// reference. The blobs are records of their own table and are saved with
+// it; a small hot window keeps the decoded text of the records written or
+// read most recently, so only cold text is decompressed.
+#define LZ_HASH_BITS 12
+#define LZ_MIN_MATCH 4
+#define LZ_LAST_LITERALS 5 // The stream always ends in this many literals
+#define LZ_MATCH_LIMIT 12  // No match may start closer than this to the end
+
+#define TEXT_FILENAME "CLINTEXT.DAT"
+#define TEXT_BLOCK_SIZE 64
+#define TEXT_BLOCKS 16384 // 1MB of compressed text
+#define TEXT_HOT_ENTRIES 8
+
+// A blob is a run of blocks starting with this header. Runs tile the
+// store from block 0; a run with blocks == 0 marks the free tail.
+typedef struct {
+    uint16_t blocks;   // Run length, header included
+    uint16_t packed;   // Stored bytes after the header, 0 = free run
+    uint16_t raw;      // Decoded length; packed == raw means stored as is
+    uint16_t reserved;
+    uint32_t checksum; // CRC32C of the stored bytes
+} text_blob_t;
+
+typedef struct {
+    uint8_t data[TEXT_BLOCK_SIZE];
+} text_block_t;
+
+typedef struct {
+    uint32_t ref;
+    uint32_t checksum; // Blob checksum when decoded, catches reuse
+    uint32_t length;
+    uint32_t last_use;
+    char text[TEXT_MAX];
+} text_hot_t;
+
+uint16_t lz_hash_table[1 << LZ_HASH_BITS];
+
+text_block_t text_blocks_store[TEXT_BLOCKS];
+text_block_t* text_blocks = text_blocks_store;
+text_hot_t text_hot[TEXT_HOT_ENTRIES];
+uint32_t text_clock = 0;
+uint8_t text_packed[TEXT_MAX + TEXT_MAX / 255 + 16];
+char text_raw[TEXT_MAX];
+text_stats_t text_stats;
+
+static uint32_t read32(const uint8_t* p) {
+    return *(const uint32_t*)p;
+}
+
+static uint32_t lz_hash(uint32_t value) {
+    return (value * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+// Lengths of 15 and up spill into extra bytes, 255 at a time
+static uint32_t length_bytes(uint32_t length) {
+    return length >= 15 ? (length - 15) / 255 + 1 : 0;
+}
+
+static uint8_t* put_length(uint8_t* op, uint32_t length) {
+    while(length >= 255) {
+        *op++ = 255;
+        length -= 255;
+    }
+    *op++ = length;
+    return op;
+}
+
+static uint8_t get_length(const uint8_t** ip, const uint8_t* end,
+                          uint32_t* length) {
+    uint8_t byte;
+    do {
+        if(*ip >= end) return 0;
+        byte = *(*ip)++;
+        *length += byte;
+    } while(byte == 255);
+    return 1;
+}
+
+// One sequence: literals, then a match of match_length + LZ_MIN_MATCH
+// bytes at offset back. The final sequence has literals only (offset 0).
+static uint8_t* put_sequence(uint8_t* op, uint8_t* op_end,
+                             const uint8_t* literals, uint32_t literal_length,
+                             uint32_t offset, uint32_t match_length) {
+    uint32_t need = 1 + length_bytes(literal_length) + literal_length;
+    if(offset) need += 2 + length_bytes(match_length);
+    if(need > (uint32_t)(op_end - op)) return NULL;
+    
+    uint8_t* token = op++;
+    *token = (literal_length >= 15 ? 15 : literal_length) << 4;
+    if(literal_length >= 15) op = put_length(op, literal_length - 15);
+    memcpy(op, literals, literal_length);
+    op += literal_length;
+    if(!offset) return op;
+    
+    *op++ = offset & 0xFF;
+    *op++ = offset >> 8;
+    *token |= match_length >= 15 ? 15 : match_length;
+    if(match_length >= 15) op = put_length(op, match_length - 15);
+    return op;
+}
+
+// Returns the compressed size, or 0 if it does not fit in capacity.
+// Inputs are limited to 64KB so every offset fits the 16-bit field.
+// The hash table is shared, so callers hold the storage lock.
+uint32_t lz_compress(const uint8_t* src, uint32_t length, uint8_t* dst,
+                     uint32_t capacity) {
+    if(length > 0xFFFF) return 0;
+    
+    const uint8_t* ip = src;
+    const uint8_t* anchor = src;
+    const uint8_t* end = src + length;
+    uint8_t* op = dst;
+    uint8_t* op_end = dst + capacity;
+    
+    // Positions are stored plus one so 0 means empty
+    memset(lz_hash_table, 0, sizeof(lz_hash_table));
+    
+    if(length >= LZ_MATCH_LIMIT) {
+        const uint8_t* limit = end - LZ_MATCH_LIMIT;
+        while(ip <= limit) {
+            uint32_t h = lz_hash(read32(ip));
+            uint32_t candidate = lz_hash_table[h];
+            lz_hash_table[h] = ip - src + 1;
+            
+            const uint8_t* ref = src + candidate - 1;
+            if(!candidate || read32(ref) != read32(ip)) {
+                ip++;
+                continue;
+            }
+            
+            const uint8_t* match_end = ip + LZ_MIN_MATCH;
+            ref += LZ_MIN_MATCH;
+            while(match_end < end - LZ_LAST_LITERALS && *match_end == *ref) {
+                match_end++;
+                ref++;
+            }
+            
+            op = put_sequence(op, op_end, anchor, ip - anchor,
+                              match_end - ref,
+                              match_end - ip - LZ_MIN_MATCH);
+            if(!op) return 0;
+            ip = match_end;
+            anchor = ip;
+        }
+    }
+    
+    op = put_sequence(op, op_end, anchor, end - anchor, 0, 0);
+    if(!op) return 0;
+    return op - dst;
+}
+
+// Returns the decoded size, or 0 if the stream is malformed or would
+// overrun capacity
+uint32_t lz_decompress(const uint8_t* src, uint32_t length, uint8_t* dst,
+                       uint32_t capacity) {
+    const uint8_t* ip = src;
+    const uint8_t* end = src + length;
+    uint8_t* op = dst;
+    uint8_t* op_end = dst + capacity;
+    
+    while(ip < end) {
+        uint8_t token = *ip++;
+        
+        uint32_t literal_length = token >> 4;
+        if(literal_length == 15 && !get_length(&ip, end, &literal_length)) {
+            return 0;
+        }
+        if(literal_length > (uint32_t)(end - ip) ||
+           literal_length > (uint32_t)(op_end - op)) {
+            return 0;
+        }
+        memcpy(op, ip, literal_length);
+        ip += literal_length;
+        op += literal_length;
+        if(ip == end) break; // Final sequence
+        
+        if(end - ip < 2) return 0;
+        uint32_t offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if(offset == 0 || offset > (uint32_t)(op - dst)) return 0;
+        
+        uint32_t match_length = token & 15;
+        if(match_length == 15 && !get_length(&ip, end, &match_length)) {
+            return 0;
+        }
+        match_length += LZ_MIN_MATCH;
+        if(match_length > (uint32_t)(op_end - op)) return 0;
+        
+        // Overlapping matches repeat the pattern, so copy bytewise
+        const uint8_t* ref = op - offset;
+        if(offset >= match_length) {
+            memcpy(op, ref, match_length);
+            op += match_length;
+        } else {
+            while(match_length--) *op++ = *ref++;
+        }
+    }
+    
+    return op - dst;
+}
+
+static text_blob_t* blob_at(uint32_t block) {
+    return (text_blob_t*)&text_blocks[block];
+}
+
+static void mark_blocks(uint32_t block, uint32_t count) {
+    for(uint32_t i = 0; i < count; i++) {
+        db_mark_dirty(DB_TABLE_TEXT, &text_blocks[block + i]);
+    }
+}
+
+static uint32_t blob_blocks(uint32_t stored) {
+    return (sizeof(text_blob_t) + stored + TEXT_BLOCK_SIZE - 1) /
+           TEXT_BLOCK_SIZE;
+}
+
+// First fit over the runs, merging neighbouring free runs on the way
+static uint32_t alloc_blocks(uint32_t count) {
+    uint32_t block = 0;
+    while(block < TEXT_BLOCKS) {
+        text_blob_t* blob = blob_at(block);
+        if(blob->blocks == 0) {
+            // Free tail
+            if(block + count > TEXT_BLOCKS) return TEXT_BLOCKS;
+            if(block + count < TEXT_BLOCKS) {
+                memset(blob_at(block + count), 0, sizeof(text_blob_t));
+                mark_blocks(block + count, 1);
+            }
+            return block;
+        }
+        
+        if(blob->packed == 0) {
+            uint32_t next = block + blob->blocks;
+            while(next < TEXT_BLOCKS && blob_at(next)->blocks != 0 &&
+                  blob_at(next)->packed == 0) {
+                next += blob_at(next)->blocks;
+            }
+            if(next < TEXT_BLOCKS && blob_at(next)->blocks == 0) {
+                // Free run reaches the tail; fold it in
+                memset(blob, 0, sizeof(text_blob_t));
+                mark_blocks(block, 1);
+                continue;
+            }
+            if(blob->blocks != next - block) {
+                blob->blocks = next - block;
+                mark_blocks(block, 1);
+            }
+            
+            if(blob->blocks >= count) {
+                if(blob->blocks > count) {
+                    text_blob_t* rest = blob_at(block + count);
+                    memset(rest, 0, sizeof(text_blob_t));
+                    rest->blocks = blob->blocks - count;
+                    mark_blocks(block + count, 1);
+                }
+                return block;
+            }
+        }
+        block += blob->blocks;
+    }
+    return TEXT_BLOCKS;
+}
+
+static void drop_hot(uint32_t ref) {
+    for(uint32_t i = 0; i < TEXT_HOT_ENTRIES; i++) {
+        if(text_hot[i].ref == ref) text_hot[i].ref = 0;
+    }
+}
+
+static text_hot_t* hot_slot() {
+    text_hot_t* oldest = &text_hot[0];
+    for(uint32_t i = 1; i < TEXT_HOT_ENTRIES; i++) {
+        if(text_hot[i].last_use < oldest->last_use) oldest = &text_hot[i];
+    }
+    return oldest;
+}
+
+static void keep_hot(uint32_t ref, const char* text, uint32_t length) {
+    text_hot_t* hot = hot_slot();
+    hot->ref = ref;
+    hot->checksum = blob_at(ref - 1)->checksum;
+    hot->length = length;
+    hot->last_use = ++text_clock;
+    memcpy(hot->text, text, length);
+}
+
+static void free_text(uint32_t ref) {
+    if(ref == 0 || ref > TEXT_BLOCKS) return;
+    
+    text_blob_t* blob = blob_at(ref - 1);
+    if(blob->blocks == 0 || blob->packed == 0) return;
+    
+    blob->packed = 0;
+    mark_blocks(ref - 1, 1);
+    drop_hot(ref);
+}
+
+static uint32_t store_text(uint32_t old_ref, const char** fields,
+                           uint8_t count) {
+    uint32_t length = 0;
+    for(uint8_t i = 0; i < count; i++) {
+        uint32_t size = strlen(fields[i]) + 1;
+        if(length + size > TEXT_MAX) {
+            log_error("Text", "Record text over %d bytes", TEXT_MAX);
+            return old_ref;
+        }
+        memcpy(text_raw + length, fields[i], size);
+        length += size;
+    }
+    
+    // Keep the original bytes when compression does not win
+    uint32_t packed = lz_compress((uint8_t*)text_raw, length, text_packed,
+                                  length - 1);
+    const uint8_t* stored = text_packed;
+    if(packed == 0) {
+        stored = (uint8_t*)text_raw;
+        packed = length;
+    }
+    
+    uint32_t blocks = blob_blocks(packed);
+    uint32_t block = alloc_blocks(blocks);
+    if(block >= TEXT_BLOCKS) {
+        log_error("Text", "%s full, %d bytes not stored", TEXT_FILENAME,
+                  packed);
+        return old_ref;
+    }
+    
+    text_blob_t* blob = blob_at(block);
+    blob->blocks = blocks;
+    blob->packed = packed;
+    blob->raw = length;
+    blob->reserved = 0;
+    blob->checksum = calculate_crc32c(stored, packed);
+    memcpy(blob + 1, stored, packed);
+    mark_blocks(block, blocks);
+    
+    text_stats.raw_bytes += length;
+    text_stats.packed_bytes += packed;
+    
+    free_text(old_ref);
+    keep_hot(block + 1, text_raw, length);
+    return block + 1;
+}
+
+static text_hot_t* decode(uint32_t ref) {
+    if(ref == 0 || ref > TEXT_BLOCKS) return NULL;
+    text_blob_t* blob = blob_at(ref - 1);
+    if(blob->blocks == 0 || blob->packed == 0) return NULL;
+    
+    for(uint32_t i = 0; i < TEXT_HOT_ENTRIES; i++) {
+        if(text_hot[i].ref == ref && text_hot[i].checksum == blob->checksum) {
+            text_hot[i].last_use = ++text_clock;
+            text_stats.hot_hits++;
+            return &text_hot[i];
+        }
+    }
+    
+    const uint8_t* stored = (const uint8_t*)(blob + 1);
+    if(ref - 1 + blob_blocks(blob->packed) > TEXT_BLOCKS ||
+       blob->raw > TEXT_MAX ||
+       calculate_crc32c(stored, blob->packed) != blob->checksum) {
+        log_error("Text", "Corrupt text blob %d", ref);
+        return NULL;
+    }
+    
+    drop_hot(ref);
+    text_hot_t* hot = hot_slot();
+    if(blob->packed == blob->raw) {
+        memcpy(hot->text, stored, blob->raw);
+    } else if(lz_decompress(stored, blob->packed, (uint8_t*)hot->text,
+                            TEXT_MAX) != blob->raw) {
+        log_error("Text", "Corrupt text blob %d", ref);
+        hot->ref = 0;
+        return NULL;
+    }
+    
+    if(blob->raw && hot->text[blob->raw - 1] != 0) {
+        log_error("Text", "Corrupt text blob %d", ref);
+        hot->ref = 0;
+        return NULL;
+    }
+    
+    hot->ref = ref;
+    hot->checksum = blob->checksum;
+    hot->length = blob->raw;
+    hot->last_use = ++text_clock;
+    text_stats.decodes++;
+    return hot;
+}
+
+static uint8_t copy_field(uint32_t ref, uint8_t field, char* out,
+                          uint32_t capacity) {
+    text_hot_t* hot = decode(ref);
+    if(!hot) return 0;
+    
+    uint32_t offset = 0;
+    while(field > 0 && offset < hot->length) {
+        offset += strlen(hot->text + offset) + 1;
+        field--;
+    }
+    if(offset >= hot->length) return 1;
+    
+    uint32_t length = strlen(hot->text + offset);
+    if(length >= capacity) length = capacity - 1;
+    memcpy(out, hot->text + offset, length);
+    out[length] = 0;
+    return 1;
+}
+
+// The store, its scratch buffers and the hot window are shared by every
+// task (and the loader converting old files), so each call holds the
+// storage lock; text_field copies out before a hot entry can be reused.
+void text_free(uint32_t ref) {
+    storage_lock();
+    free_text(ref);
+    storage_unlock();
+}
+
+// Pack count strings, each NUL terminated, into one blob and return its
+// reference. The blob behind old_ref is released only once the new one
+// is written; on failure old_ref comes back and the old text stays.
+uint32_t text_store(uint32_t old_ref, const char** fields, uint8_t count) {
+    storage_lock();
+    uint32_t ref = store_text(old_ref, fields, count);
+    storage_unlock();
+    return ref;
+}
+
+// Copy one field of a stored blob out; missing text reads as empty
+uint8_t text_field(uint32_t ref, uint8_t field, char* out, uint32_t capacity) {
+    out[0] = 0;
+    if(ref == 0) return 1;
+    
+    storage_lock();
+    uint8_t found = copy_field(ref, field, out, capacity);
+    storage_unlock();
+    return found;
+}
+
+static void text_ready() {
+    memset(text_hot, 0, sizeof(text_hot));
+    
+    uint32_t blobs = 0;
+    uint32_t used = 0;
+    uint32_t block = 0;
+    while(block < TEXT_BLOCKS && blob_at(block)->blocks != 0) {
+        text_blob_t* blob = blob_at(block);
+        if(blob->packed) {
+            blobs++;
+            used += blob->blocks;
+        }
+        block += blob->blocks;
+    }
+    
+    log_activity("Text", "%d records, %d KB of %d KB in use", blobs,
+                 used * TEXT_BLOCK_SIZE / 1024,
+                 TEXT_BLOCKS * TEXT_BLOCK_SIZE / 1024);
+}
+
+// Shared by every module with free text; registering twice is harmless
+void load_text_database() {
+    text_blocks = db_register_table(DB_TABLE_TEXT, TEXT_FILENAME,
+                                    text_blocks_store, sizeof(text_block_t),
+                                    TEXT_BLOCKS);
+    db_set_ready_handler(DB_TABLE_TEXT, text_ready);
+    db_load_table(DB_TABLE_TEXT);
+}
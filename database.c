@@ -0,0 +1,879 @@
+#include "pos_system.h"
+
+// Table registry: owner modules register their arrays, the database layer
+// handles files, logging and checkpoints
+#define DB_CHUNK_SIZE 4096
+#define DB_MAX_CHUNKS 16384 // 64MB of tables
+
+// Sector map scratch in the upper half of the Transaction Buffer
+#define DB_LBA_MAP 0x340000
+#define DB_LBA_MAP_ENTRIES (0x40000 / 4)
+
+// Tables are placed page-aligned in the Database Storage region
+// (0x200000 - 0x2FFFFF) while it has room and used there in place
+#define DB_STORAGE_BASE 0x200000
+#define DB_STORAGE_SIZE 0x100000
+#define DB_PAGE_SIZE DB_CHUNK_SIZE
+
+// Table file: one header sector, then the record image padded to whole
+// pages, so a load is a multi-sector read straight to the table address
+#define DB_FILE_MAGIC 0x31424450 // "PDB1"
+
+typedef struct {
+    uint32_t checksum; // CRC32C of the rest of the header
+    uint32_t magic;
+    uint32_t table;
+    uint32_t record_size;
+    uint32_t record_count;
+    uint32_t image_size;
+} db_file_header_t;
+
+typedef struct {
+    const char* filename;
+    uint8_t* base;
+    uint32_t record_size;
+    uint32_t record_count;
+    uint32_t first_chunk; // Into db_dirty_chunks
+    uint32_t chunk_count;
+    uint8_t registered;
+    uint8_t in_storage; // Owns whole pages of Database Storage
+    uint8_t paged;      // File is known to be in the page format
+    uint8_t state;
+    uint8_t convert;    // File holds the converter's old layout
+    uint32_t convert_offset; // Where its records start in the file
+    uint8_t frozen;     // Conversion failed; saves would destroy the file
+    uint32_t waiters;   // Tasks blocked in db_wait_table(), by task id
+} db_table_t;
+
+// Previous record layout of a table and how to turn one of its records
+// into the current one. old_record is a scratch copy the converter may
+// modify; record holds the current image to update. convert returns 0
+// if it could not store everything, release undoes a converted record.
+#define DB_CONVERT_MAX 1024
+
+typedef struct {
+    uint32_t record_size;
+    uint8_t (*convert)(void* old_record, void* record);
+    void (*release)(void* record);
+} db_converter_t;
+
+// Boot loading
+#define DB_LOAD_MAX_REQUESTS 256
+#define DB_LOAD_MAX_SECTORS 4096 // 2MB per command
+
+#define DB_STATE_UNLOADED 0
+#define DB_STATE_QUEUED 1   // Registered at boot, reads not yet issued
+#define DB_STATE_LOADING 2
+#define DB_STATE_READY 3
+
+typedef struct {
+    uint32_t first_request; // Into db_load_requests
+    uint32_t request_count;
+    uint32_t tail_lba;      // Partial last sector, bounced after the reads
+} db_load_job_t;
+
+db_table_t db_tables[DB_TABLE_COUNT];
+uint32_t db_dirty_chunks[DB_MAX_CHUNKS / 32];
+uint32_t db_snapshot_chunks[DB_MAX_CHUNKS / 32]; // Changed since last snapshot
+uint32_t db_chunks_allocated = 0;
+uint32_t db_storage_used = 0;
+
+void (*db_ready_handlers[DB_TABLE_COUNT])();
+db_converter_t db_converters[DB_TABLE_COUNT];
+uint8_t db_convert_record[DB_CONVERT_MAX];
+uint8_t db_boot_queueing = 0;
+uint64_t db_boot_start = 0;
+uint32_t db_boot_commands = 0;
+uint32_t db_boot_sectors = 0;
+disk_request_t db_load_requests[DB_LOAD_MAX_REQUESTS];
+uint32_t db_load_request_count = 0;
+db_load_job_t db_load_jobs[DB_TABLE_COUNT];
+uint8_t db_load_headers[DB_TABLE_COUNT][512] __attribute__((aligned(512)));
+
+static uint32_t table_size(db_table_t* table) {
+    return table->record_size * table->record_count;
+}
+
+static uint32_t image_size(db_table_t* table) {
+    return (table_size(table) + DB_PAGE_SIZE - 1) & ~(DB_PAGE_SIZE - 1);
+}
+
+static uint8_t chunk_dirty(db_table_t* table, uint32_t chunk) {
+    uint32_t bit = table->first_chunk + chunk;
+    return (db_dirty_chunks[bit / 32] >> (bit % 32)) & 1;
+}
+
+static void clear_dirty(db_table_t* table) {
+    for(uint32_t i = 0; i < table->chunk_count; i++) {
+        uint32_t bit = table->first_chunk + i;
+        db_dirty_chunks[bit / 32] &= ~(1u << (bit % 32));
+    }
+}
+
+void db_init() {
+    memset(db_tables, 0, sizeof(db_tables));
+    memset(db_dirty_chunks, 0, sizeof(db_dirty_chunks));
+    memset(db_snapshot_chunks, 0, sizeof(db_snapshot_chunks));
+    db_chunks_allocated = 0;
+    db_storage_used = 0;
+    memset(db_ready_handlers, 0, sizeof(db_ready_handlers));
+    memset(db_converters, 0, sizeof(db_converters));
+    
+    if(!wal_init()) {
+        log_error("Database", "Write-ahead log unavailable, using full saves");
+    }
+}
+
+// Returns where the table lives: its pages in Database Storage, or the
+// owner's own array once the region is full
+void* db_register_table(db_table_id_t id, const char* filename, void* fallback,
+                        uint32_t record_size, uint32_t record_count) {
+    if(id >= DB_TABLE_COUNT) return fallback;
+    
+    db_table_t* table = &db_tables[id];
+    if(!table->registered) {
+        table->record_size = record_size;
+        table->record_count = record_count;
+        
+        uint32_t image = image_size(table);
+        if(db_storage_used + image <= DB_STORAGE_SIZE) {
+            table->base = (uint8_t*)(DB_STORAGE_BASE + db_storage_used);
+            table->in_storage = 1;
+            memset(table->base, 0, image);
+            db_storage_used += image;
+        } else {
+            table->base = (uint8_t*)fallback;
+            table->in_storage = 0;
+            log_activity("Database", "%s: %d KB, %d KB of Database Storage free",
+                         filename, image / 1024, 
+                         (DB_STORAGE_SIZE - db_storage_used) / 1024);
+        }
+        
+        uint32_t chunks = (record_size * record_count + DB_CHUNK_SIZE - 1) / 
+                          DB_CHUNK_SIZE;
+        if(db_chunks_allocated + chunks > DB_MAX_CHUNKS) {
+            log_error("Database", "No dirty map space for %s", filename);
+            chunks = 0; // Saves fall back to whole-file writes
+        }
+        table->first_chunk = db_chunks_allocated;
+        table->chunk_count = chunks;
+        db_chunks_allocated += chunks;
+    }
+    
+    table->filename = filename;
+    table->registered = 1;
+    return table->base;
+}
+
+// Every record mutation goes through here (or db_log_change) so saves
+// know which 4KB chunks of the table file are stale
+void db_mark_dirty(db_table_id_t id, const void* record) {
+    db_table_t* table = &db_tables[id];
+    if(id >= DB_TABLE_COUNT || !table->registered) return;
+    
+    uint32_t offset = (const uint8_t*)record - table->base;
+    if((const uint8_t*)record < table->base || offset >= table_size(table)) {
+        return;
+    }
+    
+    uint32_t first = offset / DB_CHUNK_SIZE;
+    uint32_t last = (offset + table->record_size - 1) / DB_CHUNK_SIZE;
+    for(uint32_t chunk = first; chunk <= last && chunk < table->chunk_count; 
+        chunk++) {
+        uint32_t bit = table->first_chunk + chunk;
+        db_dirty_chunks[bit / 32] |= 1u << (bit % 32);
+        db_snapshot_chunks[bit / 32] |= 1u << (bit % 32);
+    }
+}
+
+// Pages for snapshots: chunk numbers across all tables, in registration
+// order, each DB_PAGE_SIZE bytes of one table
+uint32_t db_page_count() {
+    return db_chunks_allocated;
+}
+
+uint8_t* db_page_address(uint32_t page, uint32_t* bytes) {
+    for(uint32_t id = 0; id < DB_TABLE_COUNT; id++) {
+        db_table_t* table = &db_tables[id];
+        if(!table->registered || page < table->first_chunk ||
+           page >= table->first_chunk + table->chunk_count) {
+            continue;
+        }
+        
+        uint32_t offset = (page - table->first_chunk) * DB_PAGE_SIZE;
+        uint32_t size = table_size(table);
+        *bytes = size - offset < DB_PAGE_SIZE ? size - offset : DB_PAGE_SIZE;
+        return table->base + offset;
+    }
+    *bytes = 0;
+    return NULL;
+}
+
+// Callers hold interrupts off so a page is taken and cleared atomically
+uint8_t db_snapshot_test_clear(uint32_t page) {
+    uint32_t mask = 1u << (page % 32);
+    if(!(db_snapshot_chunks[page / 32] & mask)) return 0;
+    db_snapshot_chunks[page / 32] &= ~mask;
+    return 1;
+}
+
+void db_snapshot_mark(uint32_t page) {
+    db_snapshot_chunks[page / 32] |= 1u << (page % 32);
+}
+
+// A page rewritten wholesale, e.g. by a restore
+void db_mark_page(uint32_t page) {
+    db_dirty_chunks[page / 32] |= 1u << (page % 32);
+    db_snapshot_chunks[page / 32] |= 1u << (page % 32);
+}
+
+uint32_t db_snapshot_pending() {
+    uint32_t count = 0;
+    for(uint32_t page = 0; page < db_chunks_allocated; page++) {
+        count += (db_snapshot_chunks[page / 32] >> (page % 32)) & 1;
+    }
+    return count;
+}
+
+// Where one table's pages sit in the numbering and the record layout
+// they hold; all zero for a table that is not registered
+void db_page_layout(db_table_id_t id, db_page_layout_t* layout) {
+    memset(layout, 0, sizeof(db_page_layout_t));
+    db_table_t* table = &db_tables[id];
+    if(id >= DB_TABLE_COUNT || !table->registered) return;
+    
+    layout->first_page = table->first_chunk;
+    layout->pages = table->chunk_count;
+    layout->record_size = table->record_size;
+    layout->record_count = table->record_count;
+}
+
+static uint32_t header_crc(db_file_header_t* header) {
+    return calculate_crc32c(&header->magic, 
+                            sizeof(db_file_header_t) - sizeof(uint32_t));
+}
+
+static void write_file_header(db_table_t* table, db_table_id_t id, 
+                              uint32_t lba) {
+    uint8_t sector[512];
+    memset(sector, 0, sizeof(sector));
+    
+    db_file_header_t* header = (db_file_header_t*)sector;
+    header->magic = DB_FILE_MAGIC;
+    header->table = id;
+    header->record_size = table->record_size;
+    header->record_count = table->record_count;
+    header->image_size = image_size(table);
+    header->checksum = header_crc(header);
+    bcache_write(lba, sector);
+}
+
+// 1 for a valid header matching the table, 0 if the sector is not a
+// page-format header, -1 if it describes some other layout. The old
+// layout of a registered converter is flagged for table_ready().
+static int8_t check_header(db_table_t* table, db_table_id_t id, 
+                           uint8_t* sector) {
+    db_file_header_t* header = (db_file_header_t*)sector;
+    if(header->magic != DB_FILE_MAGIC || header->checksum != header_crc(header)) {
+        return 0;
+    }
+    if(db_converters[id].convert && header->table == id &&
+       header->record_size == db_converters[id].record_size &&
+       header->record_count == table->record_count) {
+        table->convert = 1;
+        table->convert_offset = 512;
+        return -1;
+    }
+    if(header->table != id || header->record_size != table->record_size ||
+       header->record_count != table->record_count) {
+        log_error("Database", "%s: file holds %d x %d bytes, expected %d x %d",
+                  table->filename, header->record_count, header->record_size,
+                  table->record_count, table->record_size);
+        return -1;
+    }
+    return 1;
+}
+
+// Sectors of the image that can be read straight into the table; pages
+// in Database Storage take the partial last sector as well
+static uint32_t direct_sectors(db_table_t* table) {
+    uint32_t size = table_size(table);
+    return table->in_storage ? (size + 511) / 512 : size / 512;
+}
+
+// Bounce the partial last sector of a table outside Database Storage
+static void read_tail(db_table_t* table, uint32_t lba) {
+    uint32_t size = table_size(table);
+    if(table->in_storage || size % 512 == 0) return;
+    
+    uint8_t sector[512];
+    bcache_read(lba, sector);
+    memcpy(table->base + (size / 512) * 512, sector, size % 512);
+}
+
+// Read a page-format file straight into the table, one command per
+// contiguous run; returns 0 if the file is not in that format
+static uint8_t read_image(db_table_t* table, db_table_id_t id) {
+    uint32_t sectors = (table_size(table) + 511) / 512;
+    uint32_t* lbas = (uint32_t*)DB_LBA_MAP;
+    
+    if(sectors + 1 > DB_LBA_MAP_ENTRIES ||
+       file_map_sectors(table->filename, lbas, sectors + 1) < sectors + 1) {
+        return 0;
+    }
+    
+    uint8_t sector[512];
+    bcache_read(lbas[0], sector);
+    int8_t valid = check_header(table, id, sector);
+    if(valid == 0) return 0;
+    if(valid < 0) return 1; // Keep the table empty rather than misread it
+    
+    uint32_t* data = lbas + 1;
+    uint32_t direct = direct_sectors(table);
+    uint32_t first = 0;
+    while(first < direct) {
+        uint32_t run = 1;
+        while(first + run < direct && data[first + run] == data[first] + run) {
+            run++;
+        }
+        bcache_flush_range(data[first], run);
+        disk_read_sectors(data[first], run, table->base + first * 512);
+        first += run;
+    }
+    if(direct < sectors) read_tail(table, data[direct]);
+    
+    table->paged = 1;
+    return 1;
+}
+
+// Raw image from before the page format; rewritten on next save. A raw
+// file of exactly the converter's old size is converted instead.
+static void read_raw(db_table_t* table, db_table_id_t id) {
+    table->paged = 0;
+    if(db_converters[id].convert &&
+       file_size(table->filename) == 
+       db_converters[id].record_size * table->record_count) {
+        table->convert = 1;
+        table->convert_offset = 0;
+        return;
+    }
+    file_read(table->filename, table->base, table_size(table));
+}
+
+static uint8_t table_dirty(db_table_t* table) {
+    for(uint32_t i = 0; i < table->chunk_count; i++) {
+        if(chunk_dirty(table, i)) return 1;
+    }
+    return 0;
+}
+
+// One-time upgrade of a file in the old layout: each old record is read
+// through the cache and handed to the owner's converter, then the file
+// is rewritten in the current layout. Converters may store into other
+// tables (clinical text), so those are saved first and no rewritten
+// record can point at data that is not on disk. If any record fails,
+// everything converted is released and the table is frozen: it stays
+// empty and unsaved, and the old file is kept for a later attempt.
+static void convert_table(db_table_t* table, db_table_id_t id) {
+    db_converter_t* converter = &db_converters[id];
+    uint32_t old_size = converter->record_size;
+    uint32_t bytes = table->convert_offset + old_size * table->record_count;
+    uint32_t sectors = (bytes + 511) / 512;
+    uint32_t* lbas = (uint32_t*)DB_LBA_MAP;
+    table->convert = 0;
+    
+    memset(table->base, 0, table_size(table));
+    if(old_size > DB_CONVERT_MAX || sectors > DB_LBA_MAP_ENTRIES ||
+       file_map_sectors(table->filename, lbas, sectors) < sectors) {
+        log_error("Database", "%s: cannot convert %d-byte records",
+                  table->filename, old_size);
+        table->frozen = 1;
+        return;
+    }
+    
+    uint8_t sector[512];
+    uint32_t cached = sectors; // Index of the sector held in sector[]
+    for(uint32_t i = 0; i < table->record_count; i++) {
+        uint32_t offset = table->convert_offset + i * old_size;
+        uint32_t done = 0;
+        while(done < old_size) {
+            uint32_t index = (offset + done) / 512;
+            if(index != cached) {
+                bcache_read(lbas[index], sector);
+                cached = index;
+            }
+            uint32_t start = (offset + done) % 512;
+            uint32_t length = 512 - start;
+            if(length > old_size - done) length = old_size - done;
+            memcpy(db_convert_record + done, sector + start, length);
+            done += length;
+        }
+        if(!converter->convert(db_convert_record,
+                               table->base + i * table->record_size)) {
+            for(uint32_t j = 0; j < i; j++) {
+                converter->release(table->base + j * table->record_size);
+            }
+            memset(table->base, 0, table_size(table));
+            table->frozen = 1;
+            log_error("Database", "%s: conversion stopped at record %d of %d, "
+                      "old file kept", table->filename, i, table->record_count);
+            return;
+        }
+    }
+    
+    for(uint32_t other = 0; other < DB_TABLE_COUNT; other++) {
+        if(other != id && db_tables[other].state == DB_STATE_READY &&
+           table_dirty(&db_tables[other])) {
+            db_save_table(other);
+        }
+    }
+    table->paged = 0;
+    db_save_table(id);
+    log_activity("Database", "%s: converted from %d to %d bytes per record",
+                 table->filename, old_size, table->record_size);
+}
+
+// Roll a freshly read table forward from the log, run its ready handler
+// and release every task waiting for it
+static void table_ready(db_table_t* table, db_table_id_t id) {
+    clear_dirty(table);
+    if(table->convert) convert_table(table, id);
+    
+    uint32_t replayed = wal_replay_table(id);
+    if(replayed > 0) {
+        log_activity("Database", "%s: %d records replayed from log",
+                     table->filename, replayed);
+    }
+    
+    if(db_ready_handlers[id]) db_ready_handlers[id]();
+    
+    asm volatile("cli");
+    table->state = DB_STATE_READY;
+    uint32_t waiters = table->waiters;
+    table->waiters = 0;
+    irq_enable();
+    
+    for(uint32_t task = 0; waiters; task++, waiters >>= 1) {
+        if(waiters & 1) task_wake(task);
+    }
+}
+
+static void load_now(db_table_t* table, db_table_id_t id) {
+    table->state = DB_STATE_LOADING;
+    storage_lock();
+    if(!read_image(table, id)) read_raw(table, id);
+    table_ready(table, id);
+    storage_unlock();
+}
+
+// Block until the boot loader (or another task) has finished the table
+void db_wait_table(db_table_id_t id) {
+    db_table_t* table = &db_tables[id];
+    if(id >= DB_TABLE_COUNT) return;
+    
+    while(1) {
+        asm volatile("cli");
+        if(table->state == DB_STATE_READY) break;
+        table->waiters |= 1 << current_task;
+        task_block();
+        if(table->state != DB_STATE_READY) asm volatile("sti; hlt");
+    }
+    asm volatile("sti");
+}
+
+void db_wait_all() {
+    for(uint32_t id = 0; id < DB_TABLE_COUNT; id++) {
+        if(db_tables[id].registered) db_wait_table(id);
+    }
+}
+
+// Load the last checkpoint, then roll it forward from the log. Tables
+// the boot loader already has in flight are waited for instead.
+void db_load_table(db_table_id_t id) {
+    db_table_t* table = &db_tables[id];
+    if(id >= DB_TABLE_COUNT || !table->registered) return;
+    
+    if(db_boot_queueing) {
+        if(table->state == DB_STATE_UNLOADED) table->state = DB_STATE_QUEUED;
+        return;
+    }
+    
+    switch(table->state) {
+        case DB_STATE_UNLOADED:
+            load_now(table, id);
+            break;
+        case DB_STATE_QUEUED:
+        case DB_STATE_LOADING:
+            db_wait_table(id);
+            break;
+    }
+}
+
+void db_set_ready_handler(db_table_id_t id, void (*handler)()) {
+    if(id < DB_TABLE_COUNT) db_ready_handlers[id] = handler;
+}
+
+// Tables were rewritten underneath their owners (a snapshot restore), so
+// indexes and caches built by the ready handlers are stale. Every handler
+// runs again, in table order, since some derived data (the patient index)
+// is checked against a table other than its own.
+void db_tables_restored() {
+    storage_lock();
+    for(uint32_t id = 0; id < DB_TABLE_COUNT; id++) {
+        if(db_tables[id].registered && db_ready_handlers[id]) {
+            db_ready_handlers[id]();
+        }
+    }
+    storage_unlock();
+}
+
+// Register before db_load_table(): a file (or logged record) still in
+// the layout with old_size-byte records is converted when it is loaded
+void db_set_converter(db_table_id_t id, uint32_t old_size,
+                      uint8_t (*convert)(void* old_record, void* record),
+                      void (*release)(void* record)) {
+    if(id >= DB_TABLE_COUNT || old_size > DB_CONVERT_MAX) return;
+    db_converters[id].record_size = old_size;
+    db_converters[id].convert = convert;
+    db_converters[id].release = release;
+}
+
+// Describe every read of one page-format table: the header sector, then
+// the image in runs of at most DB_LOAD_MAX_SECTORS; 0 if it must be
+// loaded the slow way (missing, raw format or no request slots left)
+static uint8_t queue_table_reads(db_table_t* table, db_table_id_t id) {
+    uint32_t sectors = (table_size(table) + 511) / 512;
+    uint32_t* lbas = (uint32_t*)DB_LBA_MAP;
+    
+    if(db_load_request_count >= DB_LOAD_MAX_REQUESTS ||
+       sectors + 1 > DB_LBA_MAP_ENTRIES ||
+       file_map_sectors(table->filename, lbas, sectors + 1) < sectors + 1) {
+        return 0;
+    }
+    
+    db_load_job_t* job = &db_load_jobs[id];
+    job->first_request = db_load_request_count;
+    job->tail_lba = sectors > 0 ? lbas[sectors] : 0;
+    
+    uint32_t next = db_load_request_count;
+    uint32_t* data = lbas + 1;
+    uint32_t direct = direct_sectors(table);
+    
+    disk_request_t* request = &db_load_requests[next++];
+    request->lba = lbas[0];
+    request->count = 1;
+    request->buffer = db_load_headers[id];
+    request->write = 0;
+    
+    uint32_t first = 0;
+    while(first < direct) {
+        if(next >= DB_LOAD_MAX_REQUESTS) return 0;
+        
+        uint32_t run = 1;
+        while(first + run < direct && run < DB_LOAD_MAX_SECTORS &&
+              data[first + run] == data[first] + run) {
+            run++;
+        }
+        
+        request = &db_load_requests[next++];
+        request->lba = data[first];
+        request->count = run;
+        request->buffer = table->base + first * 512;
+        request->write = 0;
+        first += run;
+    }
+    
+    // Reads below bypass the cache
+    for(uint32_t r = job->first_request; r < next; r++) {
+        bcache_flush_range(db_load_requests[r].lba, db_load_requests[r].count);
+    }
+    
+    job->request_count = next - job->first_request;
+    db_load_request_count = next;
+    return 1;
+}
+
+// Collect one table's reads; the tables after it are still in flight
+static void finish_table_reads(db_table_t* table, db_table_id_t id) {
+    db_load_job_t* job = &db_load_jobs[id];
+    uint8_t ok = 1;
+    for(uint32_t r = 0; r < job->request_count; r++) {
+        if(!disk_wait(&db_load_requests[job->first_request + r])) ok = 0;
+    }
+    
+    int8_t valid = ok ? check_header(table, id, db_load_headers[id]) : 0;
+    if(valid == 0) {
+        // Raw image or read error: the data may be partly overwritten
+        if(!read_image(table, id)) read_raw(table, id);
+    } else if(valid < 0) {
+        memset(table->base, 0, table_size(table));
+    } else {
+        read_tail(table, job->tail_lba);
+        table->paged = 1;
+    }
+    
+    table_ready(table, id);
+}
+
+// Boot-time loading, first half: runs before the scheduler starts. The
+// owners' loaders register every table, then the reads of all of them
+// are described so the loader task can put them in flight together.
+void db_boot_queue() {
+    db_boot_start = rdtsc();
+    db_boot_commands = disk_stats.commands;
+    db_boot_sectors = disk_stats.sectors;
+    
+    db_boot_queueing = 1;
+    load_patient_database();
+    load_prescription_database();
+    load_medication_database();
+    load_inventory_database();
+    load_transaction_database();
+    load_insurance_database();
+    load_appointment_database();
+    load_department_database();
+    load_schedule_database();
+    load_equipment_database();
+    load_maintenance_database();
+    db_boot_queueing = 0;
+    
+    // Tables left QUEUED are loaded the slow way by the loader task
+    db_load_request_count = 0;
+    for(uint32_t id = 0; id < DB_TABLE_COUNT; id++) {
+        if(db_tables[id].state == DB_STATE_QUEUED &&
+           queue_table_reads(&db_tables[id], id)) {
+            db_tables[id].state = DB_STATE_LOADING;
+        }
+    }
+}
+
+// Second half: submit everything, then finish and announce each table as
+// soon as its own reads land while the rest are still transferring. The
+// storage lock is held throughout, since the requests share the drivers
+// with every other disk user.
+void db_loader_task(void* param) {
+    (void)param;
+    storage_lock();
+    for(uint32_t r = 0; r < db_load_request_count; r++) {
+        disk_submit(&db_load_requests[r]);
+    }
+    
+    // Tables with a converter go last: converting may store into others
+    uint32_t tables = 0;
+    for(uint32_t pass = 0; pass < 2; pass++) {
+        for(uint32_t id = 0; id < DB_TABLE_COUNT; id++) {
+            db_table_t* table = &db_tables[id];
+            if((db_converters[id].convert != NULL) != pass) continue;
+            
+            if(table->state == DB_STATE_LOADING) {
+                finish_table_reads(table, id);
+                tables++;
+            } else if(table->state == DB_STATE_QUEUED) {
+                load_now(table, id);
+                tables++;
+            }
+        }
+    }
+    
+    storage_unlock();
+    
+    // Cycles / 1024 keeps the elapsed time in 32 bits
+    uint32_t ms = (uint32_t)((rdtsc() - db_boot_start) >> 10) / tsc_mhz() *
+                  1024 / 1000;
+    log_activity("Database", "Boot load: %d tables, %d KB, %d commands, %d ms",
+                 tables, (disk_stats.sectors - db_boot_sectors) / 2,
+                 disk_stats.commands - db_boot_commands, ms);
+    
+    task_exit();
+}
+
+// Rewrite sectors [first, first + count) of the table file in place,
+// one command per contiguous run; a partial final sector is zero-padded
+static void write_sectors(db_table_t* table, uint32_t* lbas, uint32_t first,
+                          uint32_t count) {
+    uint32_t size = table_size(table);
+    
+    while(count > 0) {
+        uint32_t run = 1;
+        while(run < count && lbas[first + run] == lbas[first] + run) run++;
+        
+        uint8_t* data = table->base + first * 512;
+        uint32_t whole = run;
+        if((first + run) * 512 > size) whole--; // Last sector is partial
+        
+        if(whole > 0) {
+            bcache_invalidate_range(lbas[first], whole);
+            disk_write_sectors(lbas[first], whole, data);
+        }
+        if(whole < run) {
+            uint8_t tail[512];
+            memset(tail, 0, sizeof(tail));
+            memcpy(tail, data + whole * 512, size % 512);
+            bcache_write(lbas[first + whole], tail);
+        }
+        
+        first += run;
+        count -= run;
+    }
+}
+
+// Write only the dirty chunks when the file already exists at full size;
+// returns the bytes written
+static uint32_t save_table(db_table_t* table, db_table_id_t id) {
+    uint32_t size = table_size(table);
+    uint32_t sectors = (size + 511) / 512;
+    uint32_t* lbas = (uint32_t*)DB_LBA_MAP;
+    uint32_t written = 0;
+    
+    uint8_t in_place = table->chunk_count > 0 && 
+                       sectors + 1 <= DB_LBA_MAP_ENTRIES;
+    if(in_place && (!table->paged || 
+       file_map_sectors(table->filename, lbas, sectors + 1) < sectors + 1)) {
+        // First save in page format: reserve a contiguous file, then
+        // write the header and all of the image
+        in_place = file_preallocate(table->filename, 
+                                    512 + image_size(table)) &&
+                   file_map_sectors(table->filename, lbas, sectors + 1) >= 
+                   sectors + 1;
+        if(in_place) {
+            write_file_header(table, id, lbas[0]);
+            table->paged = 1;
+        }
+        for(uint32_t i = 0; in_place && i < table->chunk_count; i++) {
+            uint32_t bit = table->first_chunk + i;
+            db_dirty_chunks[bit / 32] |= 1u << (bit % 32);
+        }
+    }
+    
+    if(!in_place) {
+        file_write(table->filename, table->base, size);
+        table->paged = 0;
+        written = size;
+    } else {
+        uint32_t chunk = 0;
+        while(chunk < table->chunk_count) {
+            if(!chunk_dirty(table, chunk)) {
+                chunk++;
+                continue;
+            }
+            
+            // Coalesce neighbouring dirty chunks into one range
+            uint32_t end = chunk + 1;
+            while(end < table->chunk_count && chunk_dirty(table, end)) end++;
+            
+            uint32_t start_byte = chunk * DB_CHUNK_SIZE;
+            uint32_t end_byte = end * DB_CHUNK_SIZE;
+            if(end_byte > size) end_byte = size;
+            
+            write_sectors(table, lbas + 1, start_byte / 512,
+                          (end_byte - start_byte + 511) / 512);
+            written += end_byte - start_byte;
+            chunk = end;
+        }
+        bcache_flush();
+    }
+    
+    clear_dirty(table);
+    log_activity("Database save", "%s: %d of %d bytes written",
+                 table->filename, written, size);
+    return written;
+}
+
+uint32_t db_save_table(db_table_id_t id) {
+    db_table_t* table = &db_tables[id];
+    if(id >= DB_TABLE_COUNT || !table->registered || table->frozen) return 0;
+    
+    storage_lock();
+    uint32_t written = save_table(table, id);
+    storage_unlock();
+    return written;
+}
+
+void db_apply_record(db_table_id_t id, uint32_t index, const void* data,
+                     uint32_t length) {
+    db_table_t* table = &db_tables[id];
+    if(id < DB_TABLE_COUNT && table->registered &&
+       index < table->record_count && db_converters[id].convert &&
+       length == db_converters[id].record_size) {
+        // Logged before the layout changed
+        uint8_t* record = table->base + index * table->record_size;
+        memcpy(db_convert_record, data, length);
+        if(!db_converters[id].convert(db_convert_record, record)) {
+            log_error("Database", "%s: logged record %d not converted",
+                      table->filename, index);
+        }
+        db_mark_dirty(id, record);
+        return;
+    }
+    if(id >= DB_TABLE_COUNT || !table->registered ||
+       index >= table->record_count || length != table->record_size) {
+        log_error("Database", "Bad log record, Table: %d, Index: %d", id, index);
+        return;
+    }
+    
+    memcpy(table->base + index * table->record_size, data, length);
+    db_mark_dirty(id, table->base + index * table->record_size);
+}
+
+// Log the current image of one record; call db_commit() once the whole
+// operation has been logged
+uint8_t db_log_change(db_table_id_t id, const void* record) {
+    db_table_t* table = &db_tables[id];
+    if(id >= DB_TABLE_COUNT || !table->registered) return 0;
+    
+    uint32_t offset = (const uint8_t*)record - table->base;
+    uint32_t index = offset / table->record_size;
+    if((const uint8_t*)record < table->base || index >= table->record_count) {
+        log_error("Database", "Record outside table %s", table->filename);
+        return 0;
+    }
+    
+    db_mark_dirty(id, record);
+    if(wal_append(id, index, record, table->record_size)) return 1;
+    
+    // Log full: fold it into the table files and start over
+    wal_commit();
+    if(db_checkpoint() && wal_append(id, index, record, table->record_size)) {
+        return 1;
+    }
+    
+    // No log to fall back on; the table file has to carry the change
+    db_save_table(id);
+    return 0;
+}
+
+uint8_t db_commit() {
+    return wal_commit();
+}
+
+// Save every registered table and truncate the log. Records for a table
+// nobody has loaded yet would be lost, so those block the truncation.
+uint8_t db_checkpoint() {
+    uint32_t registered = 0;
+    for(uint32_t id = 0; id < DB_TABLE_COUNT; id++) {
+        if(db_tables[id].registered) registered |= 1 << id;
+    }
+    
+    uint32_t pending = wal_table_mask();
+    if(pending & ~registered) {
+        log_error("Database", "Checkpoint deferred, unloaded tables: %08X",
+                  pending & ~registered);
+        return 0;
+    }
+    
+    uint32_t written = 0;
+    for(uint32_t id = 0; id < DB_TABLE_COUNT; id++) {
+        if(db_tables[id].registered) {
+            written += db_save_table(id);
+        }
+    }
+    
+    wal_reset();
+    log_activity("Database checkpoint", "%d KB written", written / 1024);
+    return 1;
+}
+
+void save_databases() {
+    wal_commit();
+    db_checkpoint();
+}
@@ -0,0 +1,340 @@
+#include "pos_system.h"
+
+// Root directory with an in-memory hash index of 8.3 names
+#define DIR_ENTRY_SIZE 32
+#define DIR_ENTRIES_PER_SECTOR (512 / DIR_ENTRY_SIZE)
+#define DIR_MAX_ENTRIES 8192
+#define DIR_MAX_SECTORS (DIR_MAX_ENTRIES / DIR_ENTRIES_PER_SECTOR)
+#define DIR_INDEX_SIZE 16384 // Power of two, load factor <= 0.5
+#define DIR_INDEX_EMPTY 0xFFFF
+
+#define DIR_ENTRY_END 0x00
+#define DIR_ENTRY_DELETED 0xE5
+#define DIR_ATTR_VOLUME_ID 0x08
+#define DIR_ATTR_LONG_NAME 0x0F
+#define DIR_ATTR_ARCHIVE 0x20
+
+typedef struct {
+    char name[11];
+    uint8_t attributes;
+    uint8_t reserved;
+    uint8_t create_time_tenths;
+    uint16_t create_time;
+    uint16_t create_date;
+    uint16_t access_date;
+    uint16_t cluster_high;
+    uint16_t modify_time;
+    uint16_t modify_date;
+    uint16_t cluster_low;
+    uint32_t size;
+} __attribute__((packed)) dir_entry_t;
+
+// Linear probing; slots hold the entry number plus a hash tag so most
+// mismatches never touch the directory sector
+typedef struct {
+    uint16_t entry;
+    uint16_t tag;
+} dir_index_slot_t;
+
+dir_index_slot_t dir_index[DIR_INDEX_SIZE];
+uint32_t dir_sector_lba[DIR_MAX_SECTORS];
+uint32_t dir_capacity = 0;    // Entries the directory can hold right now
+uint32_t dir_first_free = 0;  // No free entry below this one
+uint32_t dir_file_count = 0;
+dir_stats_t dir_stats;
+
+static uint32_t name_hash(const char* fat_name) {
+    uint32_t hash = 2166136261u; // FNV-1a
+    for(int i = 0; i < 11; i++) {
+        hash = (hash ^ (uint8_t)fat_name[i]) * 16777619u;
+    }
+    return hash;
+}
+
+// Entries are reached through the block cache; a fixed root stays pinned
+static dir_entry_t* entry_at(uint32_t entry) {
+    uint8_t* sector = bcache_get(dir_sector_lba[entry / DIR_ENTRIES_PER_SECTOR]);
+    if(sector == NULL) return NULL;
+    return (dir_entry_t*)sector + (entry % DIR_ENTRIES_PER_SECTOR);
+}
+
+static void entry_dirty(uint32_t entry) {
+    bcache_mark_dirty(dir_sector_lba[entry / DIR_ENTRIES_PER_SECTOR]);
+}
+
+static uint32_t entry_cluster(dir_entry_t* dirent) {
+    uint32_t cluster = dirent->cluster_low;
+    if(fat_volume.type == 32) cluster |= (uint32_t)dirent->cluster_high << 16;
+    return cluster;
+}
+
+static void index_insert(const char* fat_name, uint32_t entry) {
+    uint32_t hash = name_hash(fat_name);
+    uint32_t slot = hash & (DIR_INDEX_SIZE - 1);
+    while(dir_index[slot].entry != DIR_INDEX_EMPTY) {
+        slot = (slot + 1) & (DIR_INDEX_SIZE - 1);
+    }
+    dir_index[slot].entry = entry;
+    dir_index[slot].tag = hash >> 16;
+}
+
+// Index slot holding fat_name, or DIR_INDEX_SIZE if absent
+static uint32_t index_find(const char* fat_name) {
+    uint32_t hash = name_hash(fat_name);
+    uint16_t tag = hash >> 16;
+    uint32_t slot = hash & (DIR_INDEX_SIZE - 1);
+    
+    dir_stats.lookups++;
+    while(dir_index[slot].entry != DIR_INDEX_EMPTY) {
+        if(dir_index[slot].tag == tag) {
+            dir_entry_t* dirent = entry_at(dir_index[slot].entry);
+            dir_stats.compares++;
+            if(dirent && memcmp(dirent->name, fat_name, 11) == 0) return slot;
+        }
+        slot = (slot + 1) & (DIR_INDEX_SIZE - 1);
+    }
+    return DIR_INDEX_SIZE;
+}
+
+// Backward-shift deletion keeps probe chains intact without tombstones
+static void index_remove(uint32_t slot) {
+    uint32_t next = (slot + 1) & (DIR_INDEX_SIZE - 1);
+    while(dir_index[next].entry != DIR_INDEX_EMPTY) {
+        // An entry whose sector cannot be read has no known home; it is
+        // left where it is
+        dir_entry_t* dirent = entry_at(dir_index[next].entry);
+        if(dirent) {
+            uint32_t home = name_hash(dirent->name) & (DIR_INDEX_SIZE - 1);
+            
+            // Move it back if its home is not within (slot, next]
+            if(((next - home) & (DIR_INDEX_SIZE - 1)) >= 
+               ((next - slot) & (DIR_INDEX_SIZE - 1))) {
+                dir_index[slot] = dir_index[next];
+                slot = next;
+            }
+        }
+        next = (next + 1) & (DIR_INDEX_SIZE - 1);
+    }
+    dir_index[slot].entry = DIR_INDEX_EMPTY;
+}
+
+// FAT32 roots are cluster chains; add one zeroed cluster when full. The
+// zeroed sectors reach the disk before the FAT links them in.
+static uint8_t grow_directory() {
+    uint32_t per_cluster = fat_volume.sectors_per_cluster;
+    if(fat_volume.type != 32 || 
+       dir_capacity / DIR_ENTRIES_PER_SECTOR + per_cluster > DIR_MAX_SECTORS) {
+        return 0;
+    }
+    
+    uint32_t cluster = allocate_cluster();
+    if(cluster == 0) return 0;
+    
+    uint8_t zero[512];
+    memset(zero, 0, sizeof(zero));
+    uint32_t sector = cluster_to_sector(cluster);
+    for(uint32_t i = 0; i < per_cluster; i++) {
+        bcache_write(sector + i, zero);
+    }
+    bcache_flush();
+    
+    uint32_t last = fat_volume.root_cluster;
+    while(fat_cluster_valid(read_fat_entry(last))) {
+        last = read_fat_entry(last);
+    }
+    write_fat_entry(last, cluster);
+    fat_flush();
+    
+    for(uint32_t i = 0; i < per_cluster; i++) {
+        dir_sector_lba[dir_capacity / DIR_ENTRIES_PER_SECTOR] = sector + i;
+        dir_capacity += DIR_ENTRIES_PER_SECTOR;
+    }
+    return 1;
+}
+
+void dir_init() {
+    memset(&dir_stats, 0, sizeof(dir_stats));
+    for(uint32_t i = 0; i < DIR_INDEX_SIZE; i++) {
+        dir_index[i].entry = DIR_INDEX_EMPTY;
+    }
+    dir_capacity = 0;
+    dir_file_count = 0;
+    
+    // Sector map of the root directory
+    uint32_t sectors = 0;
+    if(fat_volume.type == 32) {
+        uint32_t cluster = fat_volume.root_cluster;
+        while(fat_cluster_valid(cluster) && sectors < DIR_MAX_SECTORS) {
+            for(uint32_t i = 0; i < fat_volume.sectors_per_cluster &&
+                sectors < DIR_MAX_SECTORS; i++) {
+                dir_sector_lba[sectors++] = cluster_to_sector(cluster) + i;
+            }
+            cluster = read_fat_entry(cluster);
+        }
+    } else {
+        for(uint32_t i = 0; i < fat_volume.root_sectors && 
+            sectors < DIR_MAX_SECTORS; i++) {
+            dir_sector_lba[sectors++] = fat_volume.root_start + i;
+        }
+    }
+    dir_capacity = sectors * DIR_ENTRIES_PER_SECTOR;
+    dir_first_free = dir_capacity;
+    
+    // One pass over the directory builds the index
+    for(uint32_t entry = 0; entry < dir_capacity; entry++) {
+        dir_entry_t* dirent = entry_at(entry);
+        if(dirent == NULL) break;
+        
+        uint8_t first = (uint8_t)dirent->name[0];
+        if(first == DIR_ENTRY_END) {
+            if(entry < dir_first_free) dir_first_free = entry;
+            break;
+        }
+        if(first == DIR_ENTRY_DELETED) {
+            if(entry < dir_first_free) dir_first_free = entry;
+            continue;
+        }
+        if(dirent->attributes == DIR_ATTR_LONG_NAME ||
+           (dirent->attributes & DIR_ATTR_VOLUME_ID)) {
+            continue;
+        }
+        
+        index_insert(dirent->name, entry);
+        dir_file_count++;
+    }
+    
+    log_activity("Directory", "%d files indexed, %d entries",
+                 dir_file_count, dir_capacity);
+}
+
+// "name.ext" -> "NAME    EXT"
+void convert_to_fat_name(const char* filename, char* fat_name) {
+    memset(fat_name, ' ', 11);
+    fat_name[11] = '\0';
+    
+    int pos = 0;
+    while(*filename && *filename != '.' && pos < 8) {
+        char c = *filename++;
+        fat_name[pos++] = (c >= 'a' && c <= 'z') ? c - 32 : c;
+    }
+    while(*filename && *filename != '.') filename++;
+    
+    if(*filename == '.') {
+        filename++;
+        pos = 8;
+        while(*filename && pos < 11) {
+            char c = *filename++;
+            fat_name[pos++] = (c >= 'a' && c <= 'z') ? c - 32 : c;
+        }
+    }
+}
+
+uint32_t find_file_cluster(const char* fat_name) {
+    uint32_t slot = index_find(fat_name);
+    if(slot == DIR_INDEX_SIZE) return 0;
+    return entry_cluster(entry_at(dir_index[slot].entry));
+}
+
+// Point an existing entry at new contents, or claim a free entry;
+// returns 0 if the name is new and there is no room for it
+uint8_t create_directory_entry(const char* fat_name, uint32_t cluster, uint32_t size) {
+    uint32_t slot = index_find(fat_name);
+    uint32_t entry;
+    
+    if(slot != DIR_INDEX_SIZE) {
+        entry = dir_index[slot].entry;
+    } else {
+        if(dir_file_count >= DIR_INDEX_SIZE / 2) {
+            log_error("Directory", "Index full, cannot create %s", fat_name);
+            return 0;
+        }
+        
+        entry = dir_first_free;
+        while(1) {
+            if(entry >= dir_capacity && !grow_directory()) {
+                log_error("Directory", "Directory full, cannot create %s", 
+                          fat_name);
+                return 0;
+            }
+            uint8_t first = (uint8_t)entry_at(entry)->name[0];
+            if(first == DIR_ENTRY_END || first == DIR_ENTRY_DELETED) break;
+            entry++;
+        }
+        dir_first_free = entry + 1;
+    }
+    
+    dir_entry_t* dirent = entry_at(entry);
+    if(slot == DIR_INDEX_SIZE) {
+        memset(dirent, 0, sizeof(dir_entry_t));
+        memcpy(dirent->name, fat_name, 11);
+        dirent->attributes = DIR_ATTR_ARCHIVE;
+    }
+    dirent->cluster_low = cluster & 0xFFFF;
+    dirent->cluster_high = fat_volume.type == 32 ? (cluster >> 16) : 0;
+    dirent->size = size;
+    entry_dirty(entry);
+    
+    if(slot == DIR_INDEX_SIZE) {
+        index_insert(fat_name, entry);
+        dir_file_count++;
+    }
+    return 1;
+}
+
+// Drop the entry and return its first cluster (0 if it did not exist)
+uint32_t remove_directory_entry(const char* fat_name) {
+    uint32_t slot = index_find(fat_name);
+    if(slot == DIR_INDEX_SIZE) return 0;
+    
+    uint32_t entry = dir_index[slot].entry;
+    dir_entry_t* dirent = entry_at(entry);
+    uint32_t cluster = entry_cluster(dirent);
+    
+    index_remove(slot);
+    dirent->name[0] = (char)DIR_ENTRY_DELETED;
+    entry_dirty(entry);
+    
+    dir_file_count--;
+    if(entry < dir_first_free) dir_first_free = entry;
+    return cluster;
+}
+
+void file_delete(const char* filename) {
+    char fat_name[12];
+    convert_to_fat_name(filename, fat_name);
+    
+    storage_lock();
+    uint32_t cluster = remove_directory_entry(fat_name);
+    if(cluster != 0) {
+        fat_free_chain(cluster);
+    }
+    
+    bcache_flush();
+    fat_flush();
+    storage_unlock();
+}
+
+uint8_t file_exists(const char* filename) {
+    char fat_name[12];
+    convert_to_fat_name(filename, fat_name);
+    
+    storage_lock();
+    uint8_t found = index_find(fat_name) != DIR_INDEX_SIZE;
+    storage_unlock();
+    return found;
+}
+
+uint32_t file_size(const char* filename) {
+    char fat_name[12];
+    convert_to_fat_name(filename, fat_name);
+    
+    storage_lock();
+    uint32_t size = 0;
+    uint32_t slot = index_find(fat_name);
+    if(slot != DIR_INDEX_SIZE) {
+        dir_entry_t* dirent = entry_at(dir_index[slot].entry);
+        if(dirent) size = dirent->size;
+    }
+    storage_unlock();
+    return size;
+}
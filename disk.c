@@ -0,0 +1,360 @@
+#include "pos_system.h"
+
+// Primary ATA channel, master drive, LBA28 PIO
+#define ATA_DATA 0x1F0
+#define ATA_ERROR 0x1F1
+#define ATA_SECTOR_COUNT 0x1F2
+#define ATA_LBA_LOW 0x1F3
+#define ATA_LBA_MID 0x1F4
+#define ATA_LBA_HIGH 0x1F5
+#define ATA_DRIVE_HEAD 0x1F6
+#define ATA_STATUS 0x1F7
+#define ATA_COMMAND 0x1F7
+
+#define ATA_CMD_READ_SECTORS 0x20
+#define ATA_CMD_WRITE_SECTORS 0x30
+#define ATA_CMD_CACHE_FLUSH 0xE7
+#define ATA_CMD_IDENTIFY 0xEC
+
+#define ATA_STATUS_ERR 0x01
+#define ATA_STATUS_DRQ 0x08
+#define ATA_STATUS_DF 0x20
+#define ATA_STATUS_BSY 0x80
+
+#define ATA_TIMEOUT_MS 5000      // Covers spin-up of a drive in standby
+#define ATA_PROBE_TIMEOUT_MS 100
+
+disk_stats_t disk_stats;
+disk_backend_t* disk_backend;
+
+// Storage lock: the drivers' single in-flight state, the block cache,
+// the FAT scratch chain and the table files are used by one task at a
+// time. File and table calls nest disk calls, so the owner may re-enter.
+uint32_t storage_owner = 0;
+uint32_t storage_depth = 0;
+uint32_t storage_waiters = 0; // Tasks blocked in storage_lock(), by task id
+
+// Every backend that probed successfully, fastest first
+#define DISK_MAX_BACKENDS 4
+disk_backend_t* disk_backends[DISK_MAX_BACKENDS];
+uint32_t disk_backend_count = 0;
+uint8_t ata_present = 0; // IDENTIFY answered on the primary master
+
+// Benchmark scratch area in the driver part of the Device I/O Buffer
+#define DISK_BENCH_BUFFER 0x3D0000
+#define DISK_BENCH_SEQ_SECTORS 2048 // 1MB
+#define DISK_BENCH_SEQ_CHUNK 128
+#define DISK_BENCH_IOPS_READS 256
+#define DISK_BENCH_LBA_SPAN 2048
+
+static uint64_t ata_deadline(uint32_t ms) {
+    return rdtsc() + (uint64_t)tsc_mhz() * 1000 * ms;
+}
+
+// 0 on an error, or if the drive is still busy at the timeout
+static uint8_t ata_wait_ready() {
+    uint64_t deadline = ata_deadline(ATA_TIMEOUT_MS);
+    uint8_t status;
+    while((status = inb(ATA_STATUS)) & ATA_STATUS_BSY) {
+        if(rdtsc() > deadline) return 0;
+    }
+    return !(status & (ATA_STATUS_ERR | ATA_STATUS_DF));
+}
+
+static uint8_t ata_wait_drq(uint32_t timeout_ms) {
+    uint64_t deadline = ata_deadline(timeout_ms);
+    uint8_t status;
+    do {
+        status = inb(ATA_STATUS);
+        if(status & (ATA_STATUS_ERR | ATA_STATUS_DF)) return 0;
+        if(rdtsc() > deadline) return 0;
+    } while((status & ATA_STATUS_BSY) || !(status & ATA_STATUS_DRQ));
+    return 1;
+}
+
+// Nothing on the channel leaves the bus floating and status reads 0xFF;
+// a status of 0 after IDENTIFY means no drive, and ATAPI devices abort it
+// or report their signature in the LBA registers
+static uint8_t ata_probe() {
+    if(inb(ATA_STATUS) == 0xFF) return 0;
+    
+    outb(ATA_DRIVE_HEAD, 0xA0);
+    outb(ATA_SECTOR_COUNT, 0);
+    outb(ATA_LBA_LOW, 0);
+    outb(ATA_LBA_MID, 0);
+    outb(ATA_LBA_HIGH, 0);
+    outb(ATA_COMMAND, ATA_CMD_IDENTIFY);
+    if(inb(ATA_STATUS) == 0) return 0;
+    
+    uint64_t deadline = ata_deadline(ATA_PROBE_TIMEOUT_MS);
+    while(inb(ATA_STATUS) & ATA_STATUS_BSY) {
+        if(rdtsc() > deadline) return 0;
+    }
+    if(inb(ATA_LBA_MID) != 0 || inb(ATA_LBA_HIGH) != 0) return 0;
+    if(!ata_wait_drq(ATA_PROBE_TIMEOUT_MS)) return 0;
+    
+    uint16_t identify[256];
+    insw(ATA_DATA, identify, 256);
+    return 1;
+}
+
+// One command moves up to DISK_MAX_SECTORS; a count register of 0 means
+// 256. Returns 0 if the drive never became ready for it.
+static uint8_t ata_issue(uint32_t lba, uint32_t count, uint8_t command) {
+    if(!ata_present || !ata_wait_ready()) return 0;
+    outb(ATA_DRIVE_HEAD, 0xE0 | ((lba >> 24) & 0x0F));
+    outb(ATA_SECTOR_COUNT, (uint8_t)(count & 0xFF));
+    outb(ATA_LBA_LOW, lba & 0xFF);
+    outb(ATA_LBA_MID, (lba >> 8) & 0xFF);
+    outb(ATA_LBA_HIGH, (lba >> 16) & 0xFF);
+    outb(ATA_COMMAND, command);
+    
+    disk_stats.commands++;
+    disk_stats.sectors += count;
+    return 1;
+}
+
+uint8_t ata_pio_read(uint32_t lba, uint32_t count, void* buffer) {
+    uint8_t* bytes = (uint8_t*)buffer;
+    
+    while(count > 0) {
+        uint32_t chunk = count > DISK_MAX_SECTORS ? DISK_MAX_SECTORS : count;
+        if(!ata_issue(lba, chunk, ATA_CMD_READ_SECTORS)) {
+            log_error("Disk read failed", "LBA: %d, drive not ready", lba);
+            disk_stats.errors++;
+            return 0;
+        }
+        
+        for(uint32_t i = 0; i < chunk; i++) {
+            if(!ata_wait_drq(ATA_TIMEOUT_MS)) {
+                log_error("Disk read failed", "LBA: %d, Error: %02X",
+                          lba + i, inb(ATA_ERROR));
+                disk_stats.errors++;
+                return 0;
+            }
+            insw(ATA_DATA, bytes, 256);
+            bytes += 512;
+        }
+        
+        lba += chunk;
+        count -= chunk;
+    }
+    
+    return 1;
+}
+
+uint8_t ata_pio_write(uint32_t lba, uint32_t count, const void* buffer) {
+    const uint8_t* bytes = (const uint8_t*)buffer;
+    
+    while(count > 0) {
+        uint32_t chunk = count > DISK_MAX_SECTORS ? DISK_MAX_SECTORS : count;
+        if(!ata_issue(lba, chunk, ATA_CMD_WRITE_SECTORS)) {
+            log_error("Disk write failed", "LBA: %d, drive not ready", lba);
+            disk_stats.errors++;
+            return 0;
+        }
+        
+        for(uint32_t i = 0; i < chunk; i++) {
+            if(!ata_wait_drq(ATA_TIMEOUT_MS)) {
+                log_error("Disk write failed", "LBA: %d, Error: %02X",
+                          lba + i, inb(ATA_ERROR));
+                disk_stats.errors++;
+                return 0;
+            }
+            outsw(ATA_DATA, bytes, 256);
+            bytes += 512;
+        }
+        
+        lba += chunk;
+        count -= chunk;
+    }
+    
+    // Make the data durable before reporting success
+    outb(ATA_COMMAND, ATA_CMD_CACHE_FLUSH);
+    return ata_wait_ready();
+}
+
+disk_backend_t ata_pio_backend = {
+    "ATA-PIO",
+    ata_pio_read,
+    ata_pio_write,
+    NULL,
+    NULL,
+    NULL
+};
+
+// Sleeps while another task is inside the storage stack; before the
+// scheduler starts there is only the boot code, so it never waits
+void storage_lock() {
+    while(1) {
+        asm volatile("cli");
+        if(storage_depth == 0 || storage_owner == current_task) break;
+        storage_waiters |= 1 << current_task;
+        task_block();
+        if(storage_depth != 0 && storage_owner != current_task) {
+            asm volatile("sti; hlt");
+        }
+    }
+    storage_owner = current_task;
+    storage_depth++;
+    irq_enable();
+}
+
+void storage_unlock() {
+    asm volatile("cli");
+    uint32_t waiters = 0;
+    if(--storage_depth == 0) {
+        waiters = storage_waiters;
+        storage_waiters = 0;
+    }
+    irq_enable();
+    
+    for(uint32_t task = 0; waiters; task++, waiters >>= 1) {
+        if(waiters & 1) task_wake(task);
+    }
+}
+
+// Prefer virtio, then AHCI, then bus-master DMA; plain PIO only if a
+// drive answers on the primary channel
+void disk_init() {
+    memset(&disk_stats, 0, sizeof(disk_stats));
+    disk_backend_count = 0;
+    
+    disk_backend_t* backend = virtio_blk_init();
+    if(backend) disk_backends[disk_backend_count++] = backend;
+    
+    backend = ahci_init();
+    if(backend) disk_backends[disk_backend_count++] = backend;
+    
+    backend = ide_dma_init();
+    if(backend) disk_backends[disk_backend_count++] = backend;
+    
+    ata_present = ata_probe();
+    if(ata_present) disk_backends[disk_backend_count++] = &ata_pio_backend;
+    
+    if(disk_backend_count == 0) {
+        // Every request then fails instead of touching absent hardware
+        log_error("Disk", "No disk found");
+        disk_backend = &ata_pio_backend;
+        return;
+    }
+    disk_backend = disk_backends[0];
+    
+    log_activity("Disk", "Backend: %s", disk_backend->name);
+}
+
+// Start a request; on backends without a queue it completes before
+// returning and disk_wait() just reports the result. Callers hold the
+// storage lock from the first submit to the last wait.
+uint8_t disk_submit(disk_request_t* request) {
+    if(disk_backend->submit) {
+        return disk_backend->submit(request);
+    }
+    
+    if(request->write) {
+        request->status = disk_backend->write(request->lba, request->count,
+                                              request->buffer);
+    } else {
+        request->status = disk_backend->read(request->lba, request->count,
+                                             request->buffer);
+    }
+    request->pending = 0;
+    return request->status;
+}
+
+uint8_t disk_wait(disk_request_t* request) {
+    if(disk_backend->wait) {
+        return disk_backend->wait(request);
+    }
+    return request->status;
+}
+
+uint8_t disk_submit_batch(disk_request_t* requests, uint32_t count) {
+    storage_lock();
+    uint8_t ok = 1;
+    if(disk_backend->submit_batch) {
+        ok = disk_backend->submit_batch(requests, count);
+    } else {
+        // Keep all of them in flight, then collect
+        for(uint32_t i = 0; i < count; i++) {
+            disk_submit(&requests[i]);
+        }
+        for(uint32_t i = 0; i < count; i++) {
+            if(!disk_wait(&requests[i])) ok = 0;
+        }
+    }
+    storage_unlock();
+    return ok;
+}
+
+// Read-only comparison of every probed backend: sequential KB/s with
+// large commands and random single-sector IOPS, batched where supported
+void disk_benchmark() {
+    uint8_t* buffer = (uint8_t*)DISK_BENCH_BUFFER;
+    uint32_t mhz = tsc_mhz();
+    disk_backend_t* active = disk_backend;
+    disk_request_t requests[DISK_BATCH_MAX];
+    
+    // Nobody else may issue commands while the backend is swapped
+    storage_lock();
+    for(uint32_t b = 0; b < disk_backend_count; b++) {
+        disk_backend = disk_backends[b];
+        
+        uint64_t start = rdtsc();
+        for(uint32_t lba = 0; lba < DISK_BENCH_SEQ_SECTORS; 
+            lba += DISK_BENCH_SEQ_CHUNK) {
+            disk_backend->read(lba, DISK_BENCH_SEQ_CHUNK, buffer);
+        }
+        uint32_t seq_usecs = (uint32_t)(rdtsc() - start) / mhz;
+        
+        // Scattered LBAs so neither the drive nor QEMU can stream ahead
+        uint32_t lba = 1;
+        start = rdtsc();
+        for(uint32_t done = 0; done < DISK_BENCH_IOPS_READS; 
+            done += DISK_BATCH_MAX) {
+            for(uint32_t i = 0; i < DISK_BATCH_MAX; i++) {
+                lba = (lba * 1103 + 37) % DISK_BENCH_LBA_SPAN;
+                requests[i].lba = lba;
+                requests[i].count = 1;
+                requests[i].buffer = buffer + i * 512;
+                requests[i].write = 0;
+            }
+            disk_submit_batch(requests, DISK_BATCH_MAX);
+        }
+        uint32_t iops_usecs = (uint32_t)(rdtsc() - start) / mhz;
+        
+        // Millisecond resolution keeps the rate math in 32 bits
+        uint32_t seq_ms = seq_usecs / 1000 + 1;
+        uint32_t iops_ms = iops_usecs / 1000 + 1;
+        uint32_t kb_per_sec = (DISK_BENCH_SEQ_SECTORS / 2) * 1000 / seq_ms;
+        uint32_t iops = DISK_BENCH_IOPS_READS * 1000 / iops_ms;
+        
+        log_activity("Disk benchmark", "%s: %d KB/s sequential, %d IOPS",
+                     disk_backend->name, kb_per_sec, iops);
+    }
+    
+    disk_backend = active;
+    storage_unlock();
+}
+
+uint8_t disk_read_sectors(uint32_t lba, uint32_t count, void* buffer) {
+    storage_lock();
+    uint8_t ok = disk_backend->read(lba, count, buffer);
+    storage_unlock();
+    return ok;
+}
+
+uint8_t disk_write_sectors(uint32_t lba, uint32_t count, const void* buffer) {
+    storage_lock();
+    uint8_t ok = disk_backend->write(lba, count, buffer);
+    storage_unlock();
+    return ok;
+}
+
+void disk_read_sector(uint32_t lba, void* buffer) {
+    disk_read_sectors(lba, 1, buffer);
+}
+
+void disk_write_sector(uint32_t lba, void* buffer) {
+    disk_write_sectors(lba, 1, buffer);
+}
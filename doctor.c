@@ -3,6 +3,16 @@
 #define MAX_PATIENTS 1000
 #define MAX_PRESCRIPTIONS 5000
 #define MAX_DIAGNOSES 200
+#define PATIENT_INDEX_SIZE 2048 // Power of two, load <= 0.5
+#define PATIENT_INDEX_BITS 11
+
+// Architectural performance counter 0 set to count last-level cache
+// misses (event 2Eh, umask 41h) in any ring
+#define MSR_PERFEVTSEL0 0x186
+#define MSR_PMC0 0xC1
+#define PERF_LLC_MISSES 0x412E
+#define PERF_ENABLE ((1 << 16) | (1 << 17) | (1 << 22))
+#define LAYOUT_QUEUE_LENGTH 100 // Size of the reception waiting queue
 
 typedef struct {
     uint32_t patient_id;
@@ -29,15 +39,28 @@ typedef struct {
     uint32_t patient_id;
     uint32_t doctor_id;
     uint32_t date;
-    char diagnosis[128];
-    char symptoms[256];
-    char notes[512];
+    uint32_t text_ref; // Diagnosis, symptoms and notes, compressed
     uint8_t severity; // 1-10
     uint8_t followup_required;
     uint32_t followup_date;
     uint8_t status; // 0=draft, 1=finalized, 2=dispensed
 } prescription_t;
 
+// Layout before the text moved to the text store; converted on load
+typedef struct {
+    uint32_t prescription_id;
+    uint32_t patient_id;
+    uint32_t doctor_id;
+    uint32_t date;
+    char diagnosis[128];
+    char symptoms[256];
+    char notes[512];
+    uint8_t severity;
+    uint8_t followup_required;
+    uint32_t followup_date;
+    uint8_t status;
+} prescription_v1_t;
+
 typedef struct {
     uint32_t item_id;
     uint32_t prescription_id;
@@ -56,6 +79,27 @@ typedef struct {
     uint32_t dispense_date;
 } prescription_item_t;
 
+// patient_id -> patient_db slot, open addressed with linear probing.
+// Patient ID 0 is never issued, so it marks an empty entry.
+typedef struct {
+    uint32_t patient_id;
+    uint32_t slot;
+} patient_index_entry_t;
+
+// Hot columns of patient_db: what searches scan and lists display, one
+// array per field so a scan reads only the bytes it compares. patient_db
+// stays the persistent record and carries the cold fields; these columns
+// are rebuilt from it at load and follow it through the search hooks.
+typedef struct {
+    uint32_t patient_id[MAX_PATIENTS];
+    uint32_t last_visit[MAX_PATIENTS];
+    uint8_t active[MAX_PATIENTS];
+    uint8_t age[MAX_PATIENTS];
+    char first_name[MAX_PATIENTS][32];
+    char last_name[MAX_PATIENTS][32];
+    char phone[MAX_PATIENTS][16];
+} patient_hot_t;
+
 typedef struct {
     uint32_t doctor_id;
     char license_number[20];
@@ -69,10 +113,17 @@ typedef struct {
     uint8_t logged_in;
 } doctor_session_t;
 
-// Database Storage
-patient_record_t patient_db[MAX_PATIENTS];
-prescription_t prescription_db[MAX_PRESCRIPTIONS];
-prescription_item_t prescription_items[MAX_PRESCRIPTIONS * 5]; // 5 items per prescription avg
+// Tables; the pointers move into the Database Storage region when it has room
+patient_record_t patient_db_store[MAX_PATIENTS];
+patient_record_t* patient_db = patient_db_store;
+patient_index_entry_t patient_id_index_store[PATIENT_INDEX_SIZE];
+patient_index_entry_t* patient_id_index = patient_id_index_store;
+uint32_t search_candidates[MAX_PATIENTS]; // Too big for a task stack
+patient_hot_t patient_hot;
+prescription_t prescription_db_store[MAX_PRESCRIPTIONS];
+prescription_t* prescription_db = prescription_db_store;
+prescription_item_t prescription_items_store[MAX_PRESCRIPTIONS * 5]; // 5 items per prescription avg
+prescription_item_t* prescription_items = prescription_items_store;
 doctor_session_t current_doctor;
 
 // Current state
@@ -80,6 +131,413 @@ uint32_t current_patient_id = 0;
 uint32_t current_prescription_id = 0;
 uint8_t current_screen = 0; // 0=login, 1=search, 2=patient, 3=prescription
 
+static uint32_t patient_index_home(uint32_t patient_id) {
+    return (patient_id * 2654435761u) >> (32 - PATIENT_INDEX_BITS);
+}
+
+static void patient_index_set(uint32_t i, uint32_t patient_id, uint32_t slot) {
+    patient_id_index[i].patient_id = patient_id;
+    patient_id_index[i].slot = slot;
+    db_mark_dirty(DB_TABLE_PATIENT_INDEX, &patient_id_index[i]);
+}
+
+void patient_index_insert(uint32_t patient_id, uint32_t slot) {
+    if(patient_id == 0) return;
+    
+    uint32_t i = patient_index_home(patient_id);
+    while(patient_id_index[i].patient_id != 0 &&
+          patient_id_index[i].patient_id != patient_id) {
+        i = (i + 1) & (PATIENT_INDEX_SIZE - 1);
+    }
+    patient_index_set(i, patient_id, slot);
+}
+
+// Backward-shift delete keeps every probe chain unbroken without
+// tombstones
+void patient_index_remove(uint32_t patient_id) {
+    uint32_t i = patient_index_home(patient_id);
+    while(patient_id_index[i].patient_id != patient_id) {
+        if(patient_id_index[i].patient_id == 0) return;
+        i = (i + 1) & (PATIENT_INDEX_SIZE - 1);
+    }
+    
+    uint32_t hole = i;
+    while(1) {
+        i = (i + 1) & (PATIENT_INDEX_SIZE - 1);
+        uint32_t id = patient_id_index[i].patient_id;
+        if(id == 0) break;
+        
+        // Entries whose home lies cyclically in (hole, i] must stay put
+        uint32_t home = patient_index_home(id);
+        if(((i - home) & (PATIENT_INDEX_SIZE - 1)) <
+           ((i - hole) & (PATIENT_INDEX_SIZE - 1))) {
+            continue;
+        }
+        patient_index_set(hole, id, patient_id_index[i].slot);
+        hole = i;
+    }
+    patient_index_set(hole, 0, 0);
+}
+
+static int32_t patient_index_slot(uint32_t patient_id) {
+    if(patient_id == 0) return -1;
+    
+    uint32_t i = patient_index_home(patient_id);
+    while(patient_id_index[i].patient_id != 0) {
+        if(patient_id_index[i].patient_id == patient_id) {
+            return patient_id_index[i].slot;
+        }
+        i = (i + 1) & (PATIENT_INDEX_SIZE - 1);
+    }
+    return -1;
+}
+
+patient_record_t* find_patient(uint32_t patient_id) {
+    int32_t slot = patient_index_slot(patient_id);
+    if(slot < 0 || slot >= MAX_PATIENTS) return NULL;
+    
+    patient_record_t* patient = &patient_db[slot];
+    if(!patient->active || patient->patient_id != patient_id) return NULL;
+    return patient;
+}
+
+void deactivate_patient(uint32_t patient_id) {
+    patient_record_t* patient = find_patient(patient_id);
+    if(patient == NULL) return;
+    
+    patient_search_remove(patient - patient_db);
+    patient->active = 0;
+    db_mark_dirty(DB_TABLE_PATIENT, patient);
+    patient_index_remove(patient_id);
+    
+    log_activity("Patient deactivated", "ID: %d", patient_id);
+}
+
+// The index file is trusted only if it holds exactly the active patients;
+// anything else (first boot, a crash between the two saves) rebuilds it
+static void patient_index_ready() {
+    uint32_t active = 0;
+    uint8_t valid = 1;
+    for(uint32_t i = 0; i < MAX_PATIENTS && valid; i++) {
+        if(!patient_db[i].active) continue;
+        active++;
+        if(patient_index_slot(patient_db[i].patient_id) != (int32_t)i) {
+            valid = 0;
+        }
+    }
+    
+    uint32_t entries = 0;
+    for(uint32_t i = 0; i < PATIENT_INDEX_SIZE; i++) {
+        if(patient_id_index[i].patient_id != 0) entries++;
+    }
+    if(valid && entries == active) return;
+    
+    memset(patient_id_index, 0,
+           PATIENT_INDEX_SIZE * sizeof(patient_index_entry_t));
+    for(uint32_t i = 0; i < PATIENT_INDEX_SIZE; i++) {
+        db_mark_dirty(DB_TABLE_PATIENT_INDEX, &patient_id_index[i]);
+    }
+    for(uint32_t i = 0; i < MAX_PATIENTS; i++) {
+        if(patient_db[i].active) {
+            patient_index_insert(patient_db[i].patient_id, i);
+        }
+    }
+    log_activity("Patient index", "Rebuilt, %d patients", active);
+}
+
+static void patient_hot_load(uint32_t slot) {
+    patient_record_t* patient = &patient_db[slot];
+    patient_hot.patient_id[slot] = patient->patient_id;
+    patient_hot.last_visit[slot] = patient->last_visit;
+    patient_hot.active[slot] = patient->active;
+    patient_hot.age[slot] = patient->age;
+    memcpy(patient_hot.first_name[slot], patient->first_name, 32);
+    memcpy(patient_hot.last_name[slot], patient->last_name, 32);
+    memcpy(patient_hot.phone[slot], patient->phone, 15);
+    patient_hot.phone[slot][15] = 0;
+}
+
+// The text search_patient() matches: ID, "First Last" and phone
+static void patient_search_fields(uint32_t slot, char* id_str,
+                                  char* full_name, const char** fields) {
+    int_to_str(patient_hot.patient_id[slot], id_str);
+    strcpy(full_name, patient_hot.first_name[slot]);
+    strcat(full_name, " ");
+    strcat(full_name, patient_hot.last_name[slot]);
+    fields[0] = id_str;
+    fields[1] = full_name;
+    fields[2] = patient_hot.phone[slot];
+}
+
+// Call after a record's searchable or listed fields are filled in, and
+// before and after (remove, then add) any edit to them
+void patient_search_add(uint32_t slot) {
+    patient_hot_load(slot);
+    if(!patient_hot.active[slot]) return;
+    
+    char id_str[12];
+    char full_name[65];
+    const char* fields[3];
+    patient_search_fields(slot, id_str, full_name, fields);
+    trigram_add(slot, fields, 3);
+}
+
+void patient_search_remove(uint32_t slot) {
+    if(!patient_hot.active[slot]) return;
+    
+    char id_str[12];
+    char full_name[65];
+    const char* fields[3];
+    patient_search_fields(slot, id_str, full_name, fields);
+    trigram_remove(slot, fields, 3);
+    patient_hot.active[slot] = 0;
+}
+
+// Last name for lists such as the reception queue, from the hot columns
+const char* patient_last_name(uint32_t patient_id) {
+    int32_t slot = patient_index_slot(patient_id);
+    if(slot < 0 || slot >= MAX_PATIENTS || !patient_hot.active[slot] ||
+       patient_hot.patient_id[slot] != patient_id) {
+        return NULL;
+    }
+    return patient_hot.last_name[slot];
+}
+
+static void patient_search_build() {
+    trigram_reset();
+    for(uint32_t i = 0; i < MAX_PATIENTS; i++) {
+        patient_search_add(i);
+    }
+}
+
+// Layout benchmark: the search scan and the queue listing, run over
+// whole records as before the split and over the hot columns, each from
+// a cold cache. LLC misses come from the performance counters when the
+// CPU has them; the footprint is the bytes each loop can touch.
+typedef struct {
+    uint32_t usecs;
+    uint32_t misses;
+} layout_sample_t;
+
+static uint8_t llc_counter_available() {
+    uint32_t eax, ebx, ecx, edx;
+    cpuid(0, &eax, &ebx, &ecx, &edx);
+    if(eax < 0x0A) return 0;
+    
+    // Version, a general counter, and EBX bit 4 (LLC misses unavailable)
+    // both present in the event vector and clear
+    cpuid(0x0A, &eax, &ebx, &ecx, &edx);
+    return (eax & 0xFF) != 0 && ((eax >> 8) & 0xFF) != 0 &&
+           ((eax >> 24) & 0xFF) > 4 && !(ebx & (1 << 4));
+}
+
+static uint64_t layout_sample_start(uint8_t counters) {
+    wbinvd();
+    if(counters) {
+        wrmsr(MSR_PERFEVTSEL0, 0);
+        wrmsr(MSR_PMC0, 0);
+        wrmsr(MSR_PERFEVTSEL0, PERF_LLC_MISSES | PERF_ENABLE);
+    }
+    return rdtsc();
+}
+
+static void layout_sample_end(uint8_t counters, uint64_t start,
+                              layout_sample_t* sample) {
+    sample->usecs = (uint32_t)(rdtsc() - start) / tsc_mhz();
+    sample->misses = 0;
+    if(counters) {
+        sample->misses = (uint32_t)rdmsr(MSR_PMC0);
+        wrmsr(MSR_PERFEVTSEL0, 0);
+    }
+}
+
+// The search loop as it ran over patient_db before the split
+static uint32_t layout_scan_records(const char* term) {
+    uint32_t matches = 0;
+    for(uint32_t i = 0; i < MAX_PATIENTS; i++) {
+        patient_record_t* patient = &patient_db[i];
+        if(!patient->active) continue;
+        
+        char id_str[12];
+        char full_name[65];
+        int_to_str(patient->patient_id, id_str);
+        strcpy(full_name, patient->first_name);
+        strcat(full_name, " ");
+        strcat(full_name, patient->last_name);
+        if(strstr(id_str, term) != NULL || strstr(full_name, term) != NULL ||
+           strstr(patient->phone, term) != NULL) {
+            matches++;
+        }
+    }
+    return matches;
+}
+
+static uint32_t layout_scan_hot(const char* term) {
+    uint32_t matches = 0;
+    for(uint32_t i = 0; i < MAX_PATIENTS; i++) {
+        if(!patient_hot.active[i]) continue;
+        
+        char id_str[12];
+        char full_name[65];
+        const char* fields[3];
+        patient_search_fields(i, id_str, full_name, fields);
+        for(uint32_t f = 0; f < 3; f++) {
+            if(strstr(fields[f], term) != NULL) {
+                matches++;
+                break;
+            }
+        }
+    }
+    return matches;
+}
+
+void patient_layout_benchmark() {
+    uint8_t counters = llc_counter_available();
+    
+    // A queue spread over the table, like patients registered over time
+    uint32_t active = 0;
+    for(uint32_t i = 0; i < MAX_PATIENTS; i++) {
+        if(patient_hot.active[i]) search_candidates[active++] = i;
+    }
+    uint32_t queue[LAYOUT_QUEUE_LENGTH];
+    uint32_t queue_length = active < LAYOUT_QUEUE_LENGTH ? 
+                            active : LAYOUT_QUEUE_LENGTH;
+    for(uint32_t q = 0; q < queue_length; q++) {
+        queue[q] = patient_hot.patient_id[search_candidates[q * active / 
+                                                            queue_length]];
+    }
+    
+    // A term nothing contains makes every record compare all fields
+    layout_sample_t scan[2];
+    layout_sample_t list[2];
+    uint32_t checks[2] = {0, 0};
+    
+    uint64_t start = layout_sample_start(counters);
+    checks[0] += layout_scan_records("~~~");
+    layout_sample_end(counters, start, &scan[0]);
+    
+    start = layout_sample_start(counters);
+    checks[1] += layout_scan_hot("~~~");
+    layout_sample_end(counters, start, &scan[1]);
+    
+    start = layout_sample_start(counters);
+    for(uint32_t q = 0; q < queue_length; q++) {
+        patient_record_t* patient = find_patient(queue[q]);
+        if(patient) checks[0] += patient->last_name[0];
+    }
+    layout_sample_end(counters, start, &list[0]);
+    
+    start = layout_sample_start(counters);
+    for(uint32_t q = 0; q < queue_length; q++) {
+        const char* last_name = patient_last_name(queue[q]);
+        if(last_name) checks[1] += last_name[0];
+    }
+    layout_sample_end(counters, start, &list[1]);
+    
+    uint32_t record_kb = MAX_PATIENTS * sizeof(patient_record_t) / 1024;
+    uint32_t hot_kb = MAX_PATIENTS * (sizeof(patient_hot.patient_id[0]) + 
+                                      sizeof(patient_hot.active[0]) + 
+                                      sizeof(patient_hot.first_name[0]) + 
+                                      sizeof(patient_hot.last_name[0]) + 
+                                      sizeof(patient_hot.phone[0])) / 1024;
+    
+    log_activity("Patient layout", 
+                 "Search scan of %d: records %d KB %d us %d misses, "
+                 "hot columns %d KB %d us %d misses",
+                 active, record_kb, scan[0].usecs, scan[0].misses,
+                 hot_kb, scan[1].usecs, scan[1].misses);
+    log_activity("Patient layout",
+                 "Queue of %d: records %d us %d misses, "
+                 "hot columns %d us %d misses",
+                 queue_length, list[0].usecs, list[0].misses,
+                 list[1].usecs, list[1].misses);
+    if(!counters) {
+        log_activity("Patient layout", "No LLC miss counter, timings only");
+    }
+    if(checks[0] != checks[1]) {
+        log_error("Patient layout", "Layouts disagree: %d != %d",
+                  checks[0], checks[1]);
+    }
+}
+
+// Table files
+void load_patient_database() {
+    patient_db = db_register_table(DB_TABLE_PATIENT, "PATIENTS.DAT",
+                                   patient_db_store, sizeof(patient_record_t),
+                                   MAX_PATIENTS);
+    patient_id_index = db_register_table(DB_TABLE_PATIENT_INDEX, "PATIDX.DAT",
+                                         patient_id_index_store,
+                                         sizeof(patient_index_entry_t),
+                                         PATIENT_INDEX_SIZE);
+    db_set_ready_handler(DB_TABLE_PATIENT, patient_search_build);
+    db_set_ready_handler(DB_TABLE_PATIENT_INDEX, patient_index_ready);
+    db_load_table(DB_TABLE_PATIENT);
+    db_load_table(DB_TABLE_PATIENT_INDEX);
+}
+
+void save_patient_database() {
+    db_save_table(DB_TABLE_PATIENT);
+}
+
+static uint8_t prescription_convert(void* old_record, void* record) {
+    prescription_v1_t* old = (prescription_v1_t*)old_record;
+    prescription_t* pres = (prescription_t*)record;
+    
+    pres->prescription_id = old->prescription_id;
+    pres->patient_id = old->patient_id;
+    pres->doctor_id = old->doctor_id;
+    pres->date = old->date;
+    pres->severity = old->severity;
+    pres->followup_required = old->followup_required;
+    pres->followup_date = old->followup_date;
+    pres->status = old->status;
+    
+    old->diagnosis[sizeof(old->diagnosis) - 1] = 0;
+    old->symptoms[sizeof(old->symptoms) - 1] = 0;
+    old->notes[sizeof(old->notes) - 1] = 0;
+    if(old->diagnosis[0] || old->symptoms[0] || old->notes[0]) {
+        const char* text[3] = { old->diagnosis, old->symptoms, old->notes };
+        uint32_t ref = text_store(pres->text_ref, text, 3);
+        if(ref == pres->text_ref) return 0; // Store full
+        pres->text_ref = ref;
+    } else {
+        text_free(pres->text_ref);
+        pres->text_ref = 0;
+    }
+    return 1;
+}
+
+static void prescription_release(void* record) {
+    prescription_t* pres = (prescription_t*)record;
+    text_free(pres->text_ref);
+    pres->text_ref = 0;
+}
+
+// The text store is loaded first: converting an old file stores into it
+void load_prescription_database() {
+    load_text_database();
+    prescription_db = db_register_table(DB_TABLE_PRESCRIPTION, "PRESCRIP.DAT",
+                                        prescription_db_store,
+                                        sizeof(prescription_t),
+                                        MAX_PRESCRIPTIONS);
+    prescription_items = db_register_table(DB_TABLE_PRESCRIPTION_ITEM,
+                                           "PRESITEM.DAT",
+                                           prescription_items_store,
+                                           sizeof(prescription_item_t),
+                                           MAX_PRESCRIPTIONS * 5);
+    db_set_converter(DB_TABLE_PRESCRIPTION, sizeof(prescription_v1_t),
+                     prescription_convert, prescription_release);
+    db_load_table(DB_TABLE_PRESCRIPTION);
+    db_load_table(DB_TABLE_PRESCRIPTION_ITEM);
+}
+
+// One text file per printed prescription, e.g. RX000123.TXT
+void save_prescription_file(uint32_t prescription_id, char* text) {
+    char filename[16];
+    sprintf(filename, "RX%06d.TXT", prescription_id % 1000000);
+    file_write(filename, text, strlen(text));
+}
+
 void doctor_login() {
     clear_screen();
     print_header("DOCTOR LOGIN");
@@ -120,6 +578,7 @@ void main_menu() {
         print_header("MAIN MENU - DR. %s %s", 
                     current_doctor.first_name, 
                     current_doctor.last_name);
+        boot_first_menu();
         
         print_time_date();
         
@@ -163,33 +622,30 @@ void search_patient() {
     print("Search (ID/Name/Phone): ");
     read_input(search_term, 32);
     
-    // Search algorithm
+    // Candidates from the trigram index, in slot order like a scan, so
+    // the first 50 matches are the same either way; short terms scan
+    // every record
+    uint32_t candidate_count = trigram_query(search_term, search_candidates,
+                                             MAX_PATIENTS);
+    uint8_t scan = (candidate_count == 0xFFFFFFFF);
+    if(scan) candidate_count = MAX_PATIENTS;
+    
     uint32_t results[50];
     uint32_t result_count = 0;
     
-    for(uint32_t i = 0; i < MAX_PATIENTS; i++) {
-        if(patient_db[i].active) {
-            // Check ID
-            char id_str[10];
-            int_to_str(patient_db[i].patient_id, id_str);
-            if(strstr(id_str, search_term) != NULL) {
-                results[result_count++] = i;
-                continue;
-            }
-            
-            // Check name
-            char full_name[65];
-            strcpy(full_name, patient_db[i].first_name);
-            strcat(full_name, " ");
-            strcat(full_name, patient_db[i].last_name);
-            if(strstr(full_name, search_term) != NULL) {
-                results[result_count++] = i;
-                continue;
-            }
-            
-            // Check phone
-            if(strstr(patient_db[i].phone, search_term) != NULL) {
+    for(uint32_t c = 0; c < candidate_count && result_count < 50; c++) {
+        uint32_t i = scan ? c : search_candidates[c];
+        if(!patient_hot.active[i]) continue;
+        
+        char id_str[12];
+        char full_name[65];
+        const char* fields[3];
+        patient_search_fields(i, id_str, full_name, fields);
+        
+        for(uint32_t f = 0; f < 3; f++) {
+            if(strstr(fields[f], search_term) != NULL) {
                 results[result_count++] = i;
+                break;
             }
         }
     }
@@ -208,14 +664,14 @@ void search_patient() {
     for(uint32_t i = 0; i < result_count && i < 20; i++) {
         uint32_t idx = results[i];
         print("%4d %-20s %-12s %-6d ", 
-              patient_db[idx].patient_id,
-              patient_db[idx].last_name,
-              patient_db[idx].phone,
-              patient_db[idx].age);
+              patient_hot.patient_id[idx],
+              patient_hot.last_name[idx],
+              patient_hot.phone[idx],
+              patient_hot.age[idx]);
         
         // Format date
         char date_str[11];
-        format_date(patient_db[idx].last_visit, date_str);
+        format_date(patient_hot.last_visit[idx], date_str);
         print("%s\n", date_str);
     }
     
@@ -225,11 +681,9 @@ void search_patient() {
     if(selected_id == 0) return;
     
     // Find and display patient
-    for(uint32_t i = 0; i < MAX_PATIENTS; i++) {
-        if(patient_db[i].patient_id == selected_id) {
-            display_patient_details(i);
-            break;
-        }
+    int32_t slot = patient_index_slot(selected_id);
+    if(slot >= 0) {
+        display_patient_details(slot);
     }
 }
 
@@ -259,14 +713,21 @@ void create_prescription() {
     pres->date = get_system_time();
     pres->status = 0; // Draft
     
+    char diagnosis[128];
+    char symptoms[256];
+    char notes[512];
+    
     print("Diagnosis: ");
-    read_input(pres->diagnosis, 128);
+    read_input(diagnosis, 128);
     
     print("Symptoms: ");
-    read_input(pres->symptoms, 256);
+    read_input(symptoms, 256);
     
     print("Notes: ");
-    read_input(pres->notes, 512);
+    read_input(notes, 512);
+    
+    const char* text[3] = { diagnosis, symptoms, notes };
+    pres->text_ref = text_store(pres->text_ref, text, 3);
     
     print("Severity (1-10): ");
     pres->severity = read_uint();
@@ -312,6 +773,8 @@ void create_prescription() {
             break;
     }
     
+    db_mark_dirty(DB_TABLE_PRESCRIPTION, pres);
+    
     log_activity("Prescription created", 
                 "Patient ID: %d, Prescription ID: %d",
                 current_patient_id, pres->prescription_id);
@@ -373,6 +836,7 @@ void prescription_item_loop(uint32_t prescription_id) {
         print("Price: $%.2f x %d = $%.2f\n", 
               item->unit_price, item->quantity, item->total);
         
+        db_mark_dirty(DB_TABLE_PRESCRIPTION_ITEM, item);
         item_count++;
         
         print("\nAdd another medication? (Y/N): ");
@@ -386,12 +850,55 @@ void prescription_item_loop(uint32_t prescription_id) {
     }
 }
 
+void view_history() {
+    if(current_patient_id == 0) {
+        print("No patient selected. Search patient first.\n");
+        wait_key();
+        return;
+    }
+    
+    clear_screen();
+    print_header("PRESCRIPTION HISTORY");
+    
+    print("%8s %-10s %-8s %s\n", "ID", "Date", "Severity", "Diagnosis");
+    print("------------------------------------------------------------\n");
+    
+    uint32_t shown = 0;
+    for(uint32_t i = 0; i < MAX_PRESCRIPTIONS && shown < 20; i++) {
+        prescription_t* pres = &prescription_db[i];
+        if(pres->patient_id != current_patient_id) continue;
+        
+        char date_str[11];
+        format_date(pres->date, date_str);
+        
+        // Older prescriptions are decompressed from the text store here
+        char diagnosis[48];
+        text_field(pres->text_ref, 0, diagnosis, sizeof(diagnosis));
+        
+        print("%08X %-10s %-8d %s\n", pres->prescription_id, date_str,
+              pres->severity, diagnosis);
+        shown++;
+    }
+    
+    if(shown == 0) {
+        print("\nNo prescriptions on file.\n");
+    }
+    wait_key();
+}
+
 void print_prescription(uint32_t prescription_id) {
     // Format prescription for printing
     char buffer[2048];
     prescription_t* pres = &prescription_db[prescription_id];
     patient_record_t* patient = find_patient(pres->patient_id);
     
+    char diagnosis[128];
+    char symptoms[256];
+    char notes[512];
+    text_field(pres->text_ref, 0, diagnosis, sizeof(diagnosis));
+    text_field(pres->text_ref, 1, symptoms, sizeof(symptoms));
+    text_field(pres->text_ref, 2, notes, sizeof(notes));
+    
     sprintf(buffer, 
         "========================================\n"
         "          HOSPITAL PRESCRIPTION        \n"
@@ -415,9 +922,9 @@ void print_prescription(uint32_t prescription_id) {
         current_doctor.first_name, current_doctor.last_name,
         current_doctor.specialization,
         current_doctor.license_number,
-        pres->diagnosis,
-        pres->symptoms,
-        pres->notes);
+        diagnosis,
+        symptoms,
+        notes);
     
     // Add medications
     for(int i = 0; i < 5; i++) {
@@ -0,0 +1,410 @@
+#include "pos_system.h"
+
+// Fallback layout from the BPB in bootloader.asm (1.44MB FAT12 floppy)
+#define DEFAULT_RESERVED_SECTORS 1
+#define DEFAULT_FAT_COUNT 2
+#define DEFAULT_FAT_SECTORS 9
+#define DEFAULT_ROOT_ENTRIES 224
+#define DEFAULT_TOTAL_SECTORS 2880
+
+// FAT copy held in the Hardware Buffer region (0x480000 - 0x4FFFFF)
+#define FAT_CACHE_BASE 0x480000
+#define FAT_CACHE_SIZE 0x60000
+#define FAT_CACHE_SECTORS (FAT_CACHE_SIZE / 512)
+#define FAT_CHAIN_BASE 0x4E0000
+#define FAT_MAX_CHAIN (0x20000 / 4)
+#define FAT_MAX_CLUSTERS (FAT_CACHE_SIZE / 4)
+
+typedef struct {
+    uint8_t jump[3];
+    char oem_id[8];
+    uint16_t bytes_per_sector;
+    uint8_t sectors_per_cluster;
+    uint16_t reserved_sectors;
+    uint8_t fat_count;
+    uint16_t root_entries;
+    uint16_t total_sectors;
+    uint8_t media_descriptor;
+    uint16_t sectors_per_fat;
+    uint16_t sectors_per_track;
+    uint16_t heads;
+    uint32_t hidden_sectors;
+    uint32_t total_sectors_large;
+    // FAT32 extended BPB
+    uint32_t sectors_per_fat32;
+    uint16_t flags;
+    uint16_t version;
+    uint32_t root_cluster;
+} __attribute__((packed)) fat_bpb_t;
+
+fat_volume_t fat_volume;
+uint8_t* fat_image = (uint8_t*)FAT_CACHE_BASE;
+uint32_t fat_dirty_sectors[FAT_CACHE_SECTORS / 32]; // Bit per FAT sector
+uint32_t fat_free_map[FAT_MAX_CLUSTERS / 32 + 1];   // Bit set = free
+uint32_t fat_free_count = 0;
+uint32_t fat_next_hint = 2;                         // Next-fit starting point
+uint32_t* fat_chain = (uint32_t*)FAT_CHAIN_BASE;
+fat_stats_t fat_stats;
+
+static uint8_t cluster_free(uint32_t cluster) {
+    return (fat_free_map[cluster / 32] >> (cluster % 32)) & 1;
+}
+
+static void set_cluster_free(uint32_t cluster, uint8_t free) {
+    if(free) {
+        fat_free_map[cluster / 32] |= 1u << (cluster % 32);
+        fat_free_count++;
+    } else {
+        fat_free_map[cluster / 32] &= ~(1u << (cluster % 32));
+        fat_free_count--;
+    }
+}
+
+static void mark_fat_dirty(uint32_t offset) {
+    uint32_t sector = offset / 512;
+    fat_dirty_sectors[sector / 32] |= 1u << (sector % 32);
+}
+
+static uint8_t fat_sector_dirty(uint32_t sector) {
+    return (fat_dirty_sectors[sector / 32] >> (sector % 32)) & 1;
+}
+
+// Derive the volume geometry from the boot sector; the type follows the
+// cluster count exactly as the FAT specification defines it
+static void mount_volume() {
+    uint8_t sector[512];
+    fat_bpb_t* bpb = (fat_bpb_t*)sector;
+    
+    uint32_t reserved = DEFAULT_RESERVED_SECTORS;
+    uint32_t fat_count = DEFAULT_FAT_COUNT;
+    uint32_t fat_sectors = DEFAULT_FAT_SECTORS;
+    uint32_t root_entries = DEFAULT_ROOT_ENTRIES;
+    uint32_t total = DEFAULT_TOTAL_SECTORS;
+    uint32_t per_cluster = 1;
+    uint32_t root_cluster = 0;
+    
+    if(disk_read_sectors(0, 1, sector) && bpb->bytes_per_sector == 512 &&
+       bpb->sectors_per_cluster != 0 && bpb->fat_count != 0) {
+        reserved = bpb->reserved_sectors;
+        fat_count = bpb->fat_count;
+        root_entries = bpb->root_entries;
+        per_cluster = bpb->sectors_per_cluster;
+        fat_sectors = bpb->sectors_per_fat ? bpb->sectors_per_fat 
+                                           : bpb->sectors_per_fat32;
+        total = bpb->total_sectors ? bpb->total_sectors 
+                                   : bpb->total_sectors_large;
+        root_cluster = bpb->root_cluster;
+    } else {
+        log_error("FAT", "No valid BPB, assuming 1.44MB FAT12 layout");
+    }
+    
+    fat_volume.sectors_per_cluster = per_cluster;
+    fat_volume.fat_start = reserved;
+    fat_volume.fat_sectors = fat_sectors;
+    fat_volume.fat_count = fat_count;
+    fat_volume.root_start = reserved + fat_count * fat_sectors;
+    fat_volume.root_sectors = (root_entries * 32 + 511) / 512;
+    fat_volume.data_start = fat_volume.root_start + fat_volume.root_sectors;
+    fat_volume.cluster_count = (total - fat_volume.data_start) / per_cluster;
+    
+    if(fat_volume.cluster_count < 4085) {
+        fat_volume.type = 12;
+        fat_volume.eoc = 0xFF8;
+        fat_volume.root_cluster = 0;
+    } else if(fat_volume.cluster_count < 65525) {
+        fat_volume.type = 16;
+        fat_volume.eoc = 0xFFF8;
+        fat_volume.root_cluster = 0;
+    } else {
+        fat_volume.type = 32;
+        fat_volume.eoc = 0x0FFFFFF8;
+        fat_volume.root_cluster = root_cluster;
+    }
+}
+
+void fs_init() {
+    bcache_init();
+    fat_init();
+    
+    // A fixed root directory is touched on every file operation
+    for(uint32_t i = 0; i < fat_volume.root_sectors; i++) {
+        bcache_pin(fat_volume.root_start + i);
+    }
+    
+    dir_init();
+}
+
+void fat_init() {
+    memset(&fat_stats, 0, sizeof(fat_stats));
+    memset(fat_free_map, 0, sizeof(fat_free_map));
+    memset(fat_dirty_sectors, 0, sizeof(fat_dirty_sectors));
+    fat_free_count = 0;
+    fat_next_hint = 2;
+    
+    mount_volume();
+    
+    // Only clusters whose entries fit in the cache are usable
+    uint32_t cached = fat_volume.fat_sectors;
+    if(cached > FAT_CACHE_SECTORS) {
+        cached = FAT_CACHE_SECTORS;
+    }
+    uint32_t addressable = cached * 512 * 8 / fat_volume.type - 2;
+    if(addressable > FAT_MAX_CLUSTERS - 2) addressable = FAT_MAX_CLUSTERS - 2;
+    if(fat_volume.cluster_count > addressable) {
+        log_error("FAT", "Using %d of %d clusters", addressable,
+                  fat_volume.cluster_count);
+        fat_volume.cluster_count = addressable;
+    }
+    fat_volume.last_cluster = fat_volume.cluster_count + 1;
+    
+    if(!disk_read_sectors(fat_volume.fat_start, cached, fat_image)) {
+        log_error("FAT", "Cannot read FAT");
+        memset(fat_image, 0, cached * 512);
+        return;
+    }
+    
+    for(uint32_t cluster = 2; cluster <= fat_volume.last_cluster; cluster++) {
+        if(read_fat_entry(cluster) == 0) {
+            set_cluster_free(cluster, 1);
+        }
+    }
+    
+    log_activity("FAT", "FAT%d, %d of %d clusters free, %d sectors/cluster",
+                 fat_volume.type, fat_free_count, fat_volume.cluster_count,
+                 fat_volume.sectors_per_cluster);
+}
+
+uint32_t cluster_to_sector(uint32_t cluster) {
+    return fat_volume.data_start + (cluster - 2) * fat_volume.sectors_per_cluster;
+}
+
+uint8_t fat_cluster_valid(uint32_t cluster) {
+    return cluster >= 2 && cluster <= fat_volume.last_cluster;
+}
+
+uint32_t read_fat_entry(uint32_t cluster) {
+    if(fat_volume.type == 32) {
+        return ((uint32_t*)fat_image)[cluster] & 0x0FFFFFFF;
+    }
+    if(fat_volume.type == 16) {
+        return ((uint16_t*)fat_image)[cluster];
+    }
+    
+    // 12-bit entries, two per three bytes
+    uint32_t offset = cluster + cluster / 2;
+    uint16_t value = fat_image[offset] | (fat_image[offset + 1] << 8);
+    
+    return (cluster & 1) ? (value >> 4) : (value & 0x0FFF);
+}
+
+void write_fat_entry(uint32_t cluster, uint32_t value) {
+    if(!fat_cluster_valid(cluster)) return;
+    
+    uint8_t was_free = read_fat_entry(cluster) == 0;
+    
+    if(fat_volume.type == 32) {
+        // Top four bits are reserved and must be preserved
+        uint32_t* entry = &((uint32_t*)fat_image)[cluster];
+        *entry = (*entry & 0xF0000000) | (value & 0x0FFFFFFF);
+        mark_fat_dirty(cluster * 4);
+    } else if(fat_volume.type == 16) {
+        ((uint16_t*)fat_image)[cluster] = value;
+        mark_fat_dirty(cluster * 2);
+    } else {
+        uint32_t offset = cluster + cluster / 2;
+        if(cluster & 1) {
+            fat_image[offset] = (fat_image[offset] & 0x0F) | ((value << 4) & 0xF0);
+            fat_image[offset + 1] = (value >> 4) & 0xFF;
+        } else {
+            fat_image[offset] = value & 0xFF;
+            fat_image[offset + 1] = (fat_image[offset + 1] & 0xF0) | 
+                                    ((value >> 8) & 0x0F);
+        }
+        
+        // A 12-bit entry may straddle two sectors
+        mark_fat_dirty(offset);
+        mark_fat_dirty(offset + 1);
+    }
+    
+    if(was_free != (value == 0)) {
+        set_cluster_free(cluster, value == 0);
+    }
+}
+
+// Length of the free run starting at cluster, capped at want
+static uint32_t free_run(uint32_t cluster, uint32_t want) {
+    uint32_t length = 0;
+    while(cluster + length <= fat_volume.last_cluster && length < want &&
+          cluster_free(cluster + length)) {
+        length++;
+    }
+    return length;
+}
+
+// Next free cluster at or after start, skipping fully used words
+static uint32_t next_free(uint32_t start) {
+    uint32_t cluster = start;
+    while(cluster <= fat_volume.last_cluster) {
+        if((cluster % 32) == 0 && fat_free_map[cluster / 32] == 0) {
+            cluster += 32;
+            continue;
+        }
+        if(cluster_free(cluster)) return cluster;
+        cluster++;
+    }
+    return 0;
+}
+
+// Next-fit search for a free run of count clusters from the hint; reports
+// the largest run seen if none is long enough
+static uint32_t find_run(uint32_t count, uint32_t* best_length) {
+    uint32_t best_start = 0;
+    uint32_t cluster = next_free(fat_next_hint);
+    uint8_t wrapped = 0;
+    
+    *best_length = 0;
+    while(1) {
+        if(cluster == 0) {
+            if(wrapped) break;
+            wrapped = 1;
+            cluster = next_free(2);
+            continue;
+        }
+        if(wrapped && cluster >= fat_next_hint) break;
+        
+        uint32_t length = free_run(cluster, count);
+        if(length > *best_length) {
+            best_start = cluster;
+            *best_length = length;
+            if(length == count) break;
+        }
+        cluster = next_free(cluster + length);
+    }
+    
+    return best_start;
+}
+
+static void link_chain(uint32_t count) {
+    for(uint32_t i = 0; i < count; i++) {
+        write_fat_entry(fat_chain[i], 
+                        i + 1 < count ? fat_chain[i + 1] : 0x0FFFFFFF);
+    }
+    
+    fat_next_hint = fat_chain[count - 1] + 1;
+    if(fat_next_hint > fat_volume.last_cluster) fat_next_hint = 2;
+    fat_stats.allocations++;
+}
+
+// Next-fit: take the first free run from the hint that holds the whole
+// file; if none does, fill from the largest run found on the way.
+// The returned chain is already linked in the FAT.
+uint32_t* allocate_clusters(uint32_t count) {
+    if(count == 0 || count > fat_free_count || count > FAT_MAX_CHAIN) {
+        return NULL;
+    }
+    
+    uint32_t best_length;
+    uint32_t best_start = find_run(count, &best_length);
+    
+    uint32_t allocated = 0;
+    for(uint32_t i = 0; i < best_length; i++) {
+        fat_chain[allocated++] = best_start + i;
+    }
+    
+    if(best_length < count) {
+        // Fragmented volume: largest run first, then whatever follows
+        uint32_t cluster = next_free(2);
+        while(allocated < count && cluster != 0) {
+            if(cluster < best_start || cluster >= best_start + best_length) {
+                fat_chain[allocated++] = cluster;
+            }
+            cluster = next_free(cluster + 1);
+        }
+        fat_stats.fragmented++;
+    }
+    
+    link_chain(count);
+    return fat_chain;
+}
+
+// All-or-nothing contiguous allocation; returns the first cluster or 0
+uint32_t allocate_contiguous(uint32_t count) {
+    if(count == 0 || count > fat_free_count || count > FAT_MAX_CHAIN) return 0;
+    
+    uint32_t best_length;
+    uint32_t start = find_run(count, &best_length);
+    if(best_length < count) return 0;
+    
+    for(uint32_t i = 0; i < count; i++) {
+        fat_chain[i] = start + i;
+    }
+    link_chain(count);
+    return start;
+}
+
+// One cluster marked end-of-chain, or 0. Unlike allocate_clusters() it
+// leaves fat_chain alone, so file_write() can grow the directory while
+// still holding the chain of the file it is writing.
+uint32_t allocate_cluster() {
+    if(fat_free_count == 0) return 0;
+    
+    uint32_t cluster = next_free(fat_next_hint);
+    if(cluster == 0) cluster = next_free(2);
+    if(cluster == 0) return 0;
+    
+    write_fat_entry(cluster, 0x0FFFFFFF);
+    fat_next_hint = cluster + 1;
+    if(fat_next_hint > fat_volume.last_cluster) fat_next_hint = 2;
+    fat_stats.allocations++;
+    return cluster;
+}
+
+void fat_free_chain(uint32_t cluster) {
+    while(fat_cluster_valid(cluster)) {
+        uint32_t next = read_fat_entry(cluster);
+        write_fat_entry(cluster, 0);
+        cluster = next;
+    }
+}
+
+// Clusters in the chain, or 0 if it is not one contiguous run
+uint32_t fat_contiguous_length(uint32_t cluster) {
+    uint32_t length = 0;
+    while(fat_cluster_valid(cluster)) {
+        uint32_t next = read_fat_entry(cluster);
+        length++;
+        if(fat_cluster_valid(next) && next != cluster + 1) return 0;
+        cluster = next;
+    }
+    return length;
+}
+
+// Write dirty FAT sectors to every copy, one command per run
+void fat_flush() {
+    uint32_t cached = fat_volume.fat_sectors;
+    if(cached > FAT_CACHE_SECTORS) cached = FAT_CACHE_SECTORS;
+    
+    uint32_t sector = 0;
+    while(sector < cached) {
+        if(!fat_sector_dirty(sector)) {
+            sector++;
+            continue;
+        }
+        
+        uint32_t run = 1;
+        while(sector + run < cached && fat_sector_dirty(sector + run)) {
+            run++;
+        }
+        
+        for(uint32_t copy = 0; copy < fat_volume.fat_count; copy++) {
+            uint32_t lba = fat_volume.fat_start + copy * fat_volume.fat_sectors +
+                           sector;
+            bcache_invalidate_range(lba, run);
+            disk_write_sectors(lba, run, fat_image + sector * 512);
+        }
+        fat_stats.sectors_written += run * fat_volume.fat_count;
+        sector += run;
+    }
+    
+    memset(fat_dirty_sectors, 0, sizeof(fat_dirty_sectors));
+}
@@ -0,0 +1,211 @@
+#include "pos_system.h"
+
+// PIIX bus-master IDE, primary channel
+#define ATA_DATA 0x1F0
+#define ATA_SECTOR_COUNT 0x1F2
+#define ATA_LBA_LOW 0x1F3
+#define ATA_LBA_MID 0x1F4
+#define ATA_LBA_HIGH 0x1F5
+#define ATA_DRIVE_HEAD 0x1F6
+#define ATA_STATUS 0x1F7
+#define ATA_COMMAND 0x1F7
+
+#define ATA_CMD_READ_DMA 0xC8
+#define ATA_CMD_WRITE_DMA 0xCA
+#define ATA_CMD_CACHE_FLUSH 0xE7
+
+#define ATA_STATUS_ERR 0x01
+#define ATA_STATUS_DF 0x20
+#define ATA_STATUS_BSY 0x80
+
+// Bus-master registers relative to BAR4
+#define BM_COMMAND 0x00
+#define BM_STATUS 0x02
+#define BM_PRDT 0x04
+
+#define BM_CMD_START 0x01
+#define BM_CMD_READ 0x08 // Device to memory
+#define BM_STATUS_ERROR 0x02
+#define BM_STATUS_IRQ 0x04
+
+#define IDE_PRIMARY_IRQ 14
+#define IDE_PRD_ENTRIES 16
+#define PRD_END_OF_TABLE 0x8000
+
+typedef struct {
+    uint32_t address;
+    uint16_t byte_count; // 0 means 64KB
+    uint16_t flags;
+} __attribute__((packed)) prd_entry_t;
+
+typedef struct {
+    volatile uint8_t done;
+    volatile uint8_t bm_status;
+    volatile uint8_t ata_status;
+    uint32_t waiter;
+} ide_dma_request_t;
+
+// 128-byte aligned so the table never crosses a 64KB boundary
+prd_entry_t ide_prd_table[IDE_PRD_ENTRIES] __attribute__((aligned(128)));
+ide_dma_request_t ide_request;
+uint16_t ide_bm_base = 0;
+
+static void ide_dma_complete() {
+    ide_request.bm_status = inb(ide_bm_base + BM_STATUS);
+    ide_request.ata_status = inb(ATA_STATUS); // Also acknowledges the drive
+    
+    outb(ide_bm_base + BM_COMMAND, 0);
+    outb(ide_bm_base + BM_STATUS, BM_STATUS_IRQ | BM_STATUS_ERROR);
+    
+    ide_request.done = 1;
+}
+
+void isr_ide_primary(interrupt_frame_t* frame) {
+    (void)frame;
+    ide_dma_complete();
+    
+    // EOI to slave and master PIC
+    outb(0xA0, 0x20);
+    outb(0x20, 0x20);
+    
+    task_wake(ide_request.waiter);
+}
+
+// Physical regions may not cross a 64KB boundary
+static uint8_t ide_build_prdt(void* buffer, uint32_t bytes) {
+    uint32_t address = (uint32_t)buffer;
+    uint8_t entry = 0;
+    
+    while(bytes > 0) {
+        if(entry >= IDE_PRD_ENTRIES) return 0;
+        
+        uint32_t boundary = (address & 0xFFFF0000) + 0x10000;
+        uint32_t length = boundary - address;
+        if(length > bytes) length = bytes;
+        
+        ide_prd_table[entry].address = address;
+        ide_prd_table[entry].byte_count = (uint16_t)(length & 0xFFFF);
+        ide_prd_table[entry].flags = 0;
+        
+        address += length;
+        bytes -= length;
+        entry++;
+    }
+    
+    ide_prd_table[entry - 1].flags = PRD_END_OF_TABLE;
+    return 1;
+}
+
+static void ide_dma_wait() {
+    // Boot-time I/O runs before the scheduler: poll with interrupts off
+    if(!scheduler_started) {
+        while(!(inb(ide_bm_base + BM_STATUS) & 
+                (BM_STATUS_IRQ | BM_STATUS_ERROR)));
+        ide_dma_complete();
+        return;
+    }
+    
+    while(1) {
+        asm volatile("cli");
+        if(ide_request.done) break;
+        
+        // Let other tasks run while the controller moves the data
+        ide_request.waiter = current_task;
+        task_block();
+        
+        // Nothing else was ready: sleep until the completion interrupt
+        if(!ide_request.done) asm volatile("sti; hlt");
+    }
+    asm volatile("sti");
+}
+
+static uint8_t ide_dma_transfer(uint32_t lba, uint32_t count, void* buffer,
+                                uint8_t write) {
+    while(count > 0) {
+        uint32_t chunk = count > DISK_MAX_SECTORS ? DISK_MAX_SECTORS : count;
+        
+        if(!ide_build_prdt(buffer, chunk * 512)) return 0;
+        
+        while(inb(ATA_STATUS) & ATA_STATUS_BSY);
+        
+        outb(ide_bm_base + BM_COMMAND, 0);
+        outl(ide_bm_base + BM_PRDT, (uint32_t)ide_prd_table);
+        outb(ide_bm_base + BM_STATUS, BM_STATUS_IRQ | BM_STATUS_ERROR);
+        outb(ide_bm_base + BM_COMMAND, write ? 0 : BM_CMD_READ);
+        
+        ide_request.done = 0;
+        ide_request.waiter = 0xFFFFFFFF;
+        
+        outb(ATA_DRIVE_HEAD, 0xE0 | ((lba >> 24) & 0x0F));
+        outb(ATA_SECTOR_COUNT, (uint8_t)(chunk & 0xFF));
+        outb(ATA_LBA_LOW, lba & 0xFF);
+        outb(ATA_LBA_MID, (lba >> 8) & 0xFF);
+        outb(ATA_LBA_HIGH, (lba >> 16) & 0xFF);
+        outb(ATA_COMMAND, write ? ATA_CMD_WRITE_DMA : ATA_CMD_READ_DMA);
+        
+        outb(ide_bm_base + BM_COMMAND, 
+             (write ? 0 : BM_CMD_READ) | BM_CMD_START);
+        
+        disk_stats.commands++;
+        disk_stats.sectors += chunk;
+        
+        ide_dma_wait();
+        
+        if((ide_request.bm_status & BM_STATUS_ERROR) ||
+           (ide_request.ata_status & (ATA_STATUS_ERR | ATA_STATUS_DF))) {
+            log_error("IDE DMA failed", "LBA: %d, BM: %02X, ATA: %02X",
+                      lba, ide_request.bm_status, ide_request.ata_status);
+            disk_stats.errors++;
+            return 0;
+        }
+        
+        lba += chunk;
+        count -= chunk;
+        buffer = (uint8_t*)buffer + chunk * 512;
+    }
+    
+    return 1;
+}
+
+static uint8_t ide_dma_read(uint32_t lba, uint32_t count, void* buffer) {
+    // Bus masters need word-aligned buffers
+    if((uint32_t)buffer & 1) return ata_pio_read(lba, count, buffer);
+    return ide_dma_transfer(lba, count, buffer, 0);
+}
+
+static uint8_t ide_dma_write(uint32_t lba, uint32_t count, const void* buffer) {
+    if((uint32_t)buffer & 1) return ata_pio_write(lba, count, buffer);
+    if(!ide_dma_transfer(lba, count, (void*)buffer, 1)) return 0;
+    
+    outb(ATA_COMMAND, ATA_CMD_CACHE_FLUSH);
+    while(inb(ATA_STATUS) & ATA_STATUS_BSY);
+    return 1;
+}
+
+disk_backend_t ide_dma_backend = {
+    "IDE-DMA",
+    ide_dma_read,
+    ide_dma_write,
+    NULL,
+    NULL,
+    NULL
+};
+
+disk_backend_t* ide_dma_init() {
+    pci_device_t dev;
+    
+    // Mass storage controller, IDE interface
+    if(!pci_find_class(0x01, 0x01, &dev)) return NULL;
+    
+    // prog-if bit 7: bus mastering supported
+    if(!(dev.prog_if & 0x80)) return NULL;
+    
+    uint32_t bar4 = pci_bar(&dev, 4);
+    if(!(bar4 & 1)) return NULL; // Expect an I/O BAR
+    ide_bm_base = bar4 & 0xFFFC;
+    
+    pci_enable_bus_master(&dev);
+    register_irq_handler(IDE_PRIMARY_IRQ, isr_ide_primary);
+    
+    return &ide_dma_backend;
+}
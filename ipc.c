@@ -1,7 +1,21 @@
 #include "pos_system.h"
 
-#define MAX_IPC_MESSAGES 100
+#define MAX_IPC_MESSAGES 256
 #define IPC_BUFFER_SIZE 4096
+#define IPC_MODULE_COUNT 6
+#define IPC_TOPIC_RING_SIZE 64
+#define IPC_INLINE_PAYLOAD 28
+#define IPC_PAYLOAD_BLOCK_SIZE 256
+#define IPC_PAYLOAD_BLOCKS (4 * IPC_BUFFER_SIZE / IPC_PAYLOAD_BLOCK_SIZE)
+#define IPC_NO_PAYLOAD_BLOCK 0xFFFF
+#define IPC_NO_WAITER 0xFFFFFFFF
+#define IPC_LATENCY_BUCKETS 16
+#define IPC_WORK_QUEUE_SIZE 32
+
+// Slot flags
+#define IPC_FLAG_REQUIRES_ACK  0x01
+#define IPC_FLAG_ACKNOWLEDGED  0x02
+#define IPC_FLAG_OUT_OF_LINE   0x04
 
 typedef enum {
     MSG_NONE = 0,
@@ -18,21 +32,13 @@ typedef enum {
     MSG_SYSTEM_SHUTDOWN
 } message_type_t;
 
-typedef enum {
-    MODULE_KERNEL = 0,
-    MODULE_DOCTOR,
-    MODULE_MEDICATION,
-    MODULE_CASHIER,
-    MODULE_RECEPTION,
-    MODULE_WAREHOUSE
-} module_id_t;
-
+// Message as seen by senders and handlers
 typedef struct {
     uint32_t message_id;
     message_type_t type;
     module_id_t sender;
     module_id_t receiver;
-    uint32_t timestamp;
+    uint32_t timestamp; // Low 32 bits of the TSC at enqueue
     uint16_t data_size;
     uint8_t priority;
     uint8_t requires_ack;
@@ -41,27 +47,263 @@ typedef struct {
     uint8_t data[256];
 } ipc_message_t;
 
+// Compact form held in queues (48 bytes). Payloads up to
+// IPC_INLINE_PAYLOAD bytes live in the slot, larger ones in a pool block.
 typedef struct {
-    ipc_message_t messages[MAX_IPC_MESSAGES];
+    uint8_t checksum[4];
+    uint32_t message_id;
+    uint32_t timestamp;
+    uint16_t data_size;
+    uint16_t payload_block;
+    uint8_t type;
+    uint8_t route;    // Sender in high nibble, receiver in low nibble
+    uint8_t priority;
+    uint8_t flags;
+    uint8_t payload[IPC_INLINE_PAYLOAD];
+} ipc_slot_t;
+
+typedef struct {
+    ipc_slot_t messages[MAX_IPC_MESSAGES];
     uint32_t head;
     uint32_t tail;
     uint32_t count;
     uint8_t locked;
 } ipc_queue_t;
 
-ipc_queue_t message_queues[6]; // One for each module
+// Out-of-line payload storage shared by all queues and the topic bus
+typedef struct {
+    uint8_t blocks[IPC_PAYLOAD_BLOCKS][IPC_PAYLOAD_BLOCK_SIZE];
+    uint32_t used[IPC_PAYLOAD_BLOCKS / 32];
+    uint8_t locked;
+} ipc_payload_pool_t;
+
+#define IPC_TOPIC_COUNT (MSG_SYSTEM_SHUTDOWN + 1)
+
+// Broadcast message, stored once and shared by all of its subscribers
+typedef struct {
+    ipc_slot_t message;
+    uint32_t sequence;
+    uint8_t refcount;     // Subscribers that have not consumed it yet
+    uint8_t pending_mask; // Bit per module still holding a reference
+} ipc_topic_slot_t;
+
+typedef struct {
+    ipc_topic_slot_t slots[IPC_TOPIC_RING_SIZE];
+    uint32_t next_sequence;
+    uint32_t cursors[IPC_MODULE_COUNT];     // Next sequence per subscriber
+    uint8_t subscribers[IPC_TOPIC_COUNT];   // Module bitmask per message type
+    uint8_t locked;
+} ipc_topic_bus_t;
+
+void calculate_message_checksum(ipc_slot_t* slot);
+uint8_t verify_message_checksum(ipc_slot_t* slot);
+uint8_t ipc_subscribe(module_id_t module, message_type_t type);
+void send_ipc_notification(module_id_t module);
+
+ipc_queue_t message_queues[IPC_MODULE_COUNT]; // One for each module
+ipc_payload_pool_t payload_pool;
+ipc_topic_bus_t topic_bus;
+
+// Task blocked in ipc_wait_message() for each module
+uint32_t ipc_waiters[IPC_MODULE_COUNT];
+
+// Send-to-handle latency per receiving module
+typedef struct {
+    uint32_t handled;
+    uint32_t total_us;
+    uint32_t max_us;
+} ipc_latency_t;
+
+ipc_latency_t ipc_latency[IPC_MODULE_COUNT];
+
+// Record IDs for handlers that need the console. The service task only
+// queues them and wakes the module's menu loop, which runs them in its
+// own task.
+typedef struct {
+    uint32_t ids[IPC_WORK_QUEUE_SIZE];
+    uint32_t sent[IPC_WORK_QUEUE_SIZE]; // Message timestamps, for latency
+    uint32_t head;
+    uint32_t count;
+    uint32_t waiter; // Task id + 1 sleeping in ipc_menu_key(), 0 = none
+} ipc_work_queue_t;
+
+ipc_work_queue_t ipc_work[IPC_MODULE_COUNT];
+
+typedef struct {
+    uint32_t sent;
+    uint32_t received;
+    uint32_t dropped;
+} ipc_counters_t;
+
+// Per receiver: counters, deepest queue seen and enqueue-to-dequeue
+// latency in log2 microsecond buckets (bucket 0 is < 1 us)
+typedef struct {
+    ipc_counters_t counters;
+    uint32_t high_water;
+    uint32_t latency_hist[IPC_LATENCY_BUCKETS];
+} ipc_queue_stats_t;
+
+ipc_queue_stats_t ipc_queue_stats[IPC_MODULE_COUNT];
+ipc_counters_t ipc_type_stats[IPC_TOPIC_COUNT];
+
+static const char* ipc_module_names[IPC_MODULE_COUNT] = {
+    "KERNEL", "DOCTOR", "PHARMACY", "CASHIER", "RECEPTION", "WAREHOUSE"
+};
+
+static uint32_t next_message_id = 1;
+
+static void lock_topic_bus() {
+    while(topic_bus.locked) {
+        asm("pause");
+    }
+    topic_bus.locked = 1;
+}
+
+static uint16_t alloc_payload_block() {
+    while(payload_pool.locked) {
+        asm("pause");
+    }
+    payload_pool.locked = 1;
+    
+    for(uint16_t i = 0; i < IPC_PAYLOAD_BLOCKS; i++) {
+        if(!(payload_pool.used[i / 32] & (1u << (i % 32)))) {
+            payload_pool.used[i / 32] |= (1u << (i % 32));
+            payload_pool.locked = 0;
+            return i;
+        }
+    }
+    
+    payload_pool.locked = 0;
+    return IPC_NO_PAYLOAD_BLOCK;
+}
+
+static void free_payload_block(uint16_t block) {
+    if(block >= IPC_PAYLOAD_BLOCKS) return;
+    
+    while(payload_pool.locked) {
+        asm("pause");
+    }
+    payload_pool.locked = 1;
+    payload_pool.used[block / 32] &= ~(1u << (block % 32));
+    payload_pool.locked = 0;
+}
+
+static uint8_t* slot_payload(ipc_slot_t* slot) {
+    if(slot->flags & IPC_FLAG_OUT_OF_LINE) {
+        return payload_pool.blocks[slot->payload_block];
+    }
+    return slot->payload;
+}
+
+// A corrupt slot must not point the CRC or the copy outside its payload
+static uint8_t slot_in_bounds(ipc_slot_t* slot) {
+    if(slot->flags & IPC_FLAG_OUT_OF_LINE) {
+        return slot->payload_block < IPC_PAYLOAD_BLOCKS &&
+               slot->data_size <= IPC_PAYLOAD_BLOCK_SIZE;
+    }
+    return slot->data_size <= IPC_INLINE_PAYLOAD;
+}
+
+static void release_slot(ipc_slot_t* slot) {
+    if(slot->flags & IPC_FLAG_OUT_OF_LINE) {
+        free_payload_block(slot->payload_block);
+        slot->flags &= ~IPC_FLAG_OUT_OF_LINE;
+    }
+}
+
+// Pack a message into its compact form; fails if no payload block is free
+static uint8_t encode_message(ipc_slot_t* slot, ipc_message_t* msg) {
+    uint16_t size = msg->data_size;
+    if(size > sizeof(msg->data)) size = sizeof(msg->data);
+    
+    slot->timestamp = (uint32_t)rdtsc();
+    slot->data_size = size;
+    slot->type = (uint8_t)msg->type;
+    slot->route = (uint8_t)((msg->sender << 4) | (msg->receiver & 0x0F));
+    slot->priority = msg->priority;
+    slot->flags = 0;
+    if(msg->requires_ack) slot->flags |= IPC_FLAG_REQUIRES_ACK;
+    if(msg->acknowledged) slot->flags |= IPC_FLAG_ACKNOWLEDGED;
+    slot->payload_block = IPC_NO_PAYLOAD_BLOCK;
+    
+    if(size > IPC_INLINE_PAYLOAD) {
+        slot->payload_block = alloc_payload_block();
+        if(slot->payload_block == IPC_NO_PAYLOAD_BLOCK) return 0;
+        slot->flags |= IPC_FLAG_OUT_OF_LINE;
+    }
+    
+    memcpy(slot_payload(slot), msg->data, size);
+    return 1;
+}
+
+static void decode_message(ipc_slot_t* slot, ipc_message_t* msg) {
+    msg->message_id = slot->message_id;
+    msg->type = (message_type_t)slot->type;
+    msg->sender = (module_id_t)(slot->route >> 4);
+    msg->receiver = (module_id_t)(slot->route & 0x0F);
+    msg->timestamp = slot->timestamp;
+    msg->data_size = slot->data_size;
+    msg->priority = slot->priority;
+    msg->requires_ack = (slot->flags & IPC_FLAG_REQUIRES_ACK) ? 1 : 0;
+    msg->acknowledged = (slot->flags & IPC_FLAG_ACKNOWLEDGED) ? 1 : 0;
+    memcpy(msg->checksum, slot->checksum, 4);
+    if(!slot_in_bounds(slot)) {
+        msg->data_size = 0;
+        return;
+    }
+    memcpy(msg->data, slot_payload(slot), slot->data_size);
+}
+
+static void count_dropped(module_id_t receiver, uint8_t type) {
+    ipc_queue_stats[receiver].counters.dropped++;
+    if(type < IPC_TOPIC_COUNT) ipc_type_stats[type].dropped++;
+}
+
+static void count_dequeued(module_id_t receiver, ipc_slot_t* slot) {
+    ipc_queue_stats[receiver].counters.received++;
+    if(slot->type < IPC_TOPIC_COUNT) ipc_type_stats[slot->type].received++;
+    
+    uint32_t latency_us = ((uint32_t)rdtsc() - slot->timestamp) / tsc_mhz();
+    uint32_t bucket = 0;
+    while(latency_us && bucket < IPC_LATENCY_BUCKETS - 1) {
+        latency_us >>= 1;
+        bucket++;
+    }
+    ipc_queue_stats[receiver].latency_hist[bucket]++;
+}
 
 void ipc_init() {
-    for(int i = 0; i < 6; i++) {
+    crc32c_init();
+    
+    for(int i = 0; i < IPC_MODULE_COUNT; i++) {
         message_queues[i].head = 0;
         message_queues[i].tail = 0;
         message_queues[i].count = 0;
         message_queues[i].locked = 0;
     }
+    
+    memset(&payload_pool, 0, sizeof(payload_pool));
+    memset(&topic_bus, 0, sizeof(topic_bus));
+    memset(ipc_latency, 0, sizeof(ipc_latency));
+    memset(ipc_work, 0, sizeof(ipc_work));
+    memset(ipc_queue_stats, 0, sizeof(ipc_queue_stats));
+    memset(ipc_type_stats, 0, sizeof(ipc_type_stats));
+    
+    for(int i = 0; i < IPC_MODULE_COUNT; i++) {
+        ipc_waiters[i] = IPC_NO_WAITER;
+    }
+    
+    // Broadcast traffic every application module cares about
+    for(int module = MODULE_DOCTOR; module < IPC_MODULE_COUNT; module++) {
+        ipc_subscribe(module, MSG_ALERT);
+        ipc_subscribe(module, MSG_DATA_SYNC);
+        ipc_subscribe(module, MSG_SYSTEM_SHUTDOWN);
+    }
 }
 
-uint8_t ipc_send_message(module_id_t receiver, ipc_message_t* msg) {
-    if(receiver >= 6) return 0;
+static uint8_t enqueue_message(module_id_t receiver, ipc_message_t* msg,
+                               uint32_t message_id) {
+    if(receiver >= IPC_MODULE_COUNT) return 0;
     
     ipc_queue_t* queue = &message_queues[receiver];
     
@@ -73,22 +315,30 @@ uint8_t ipc_send_message(module_id_t receiver, ipc_message_t* msg) {
     
     if(queue->count >= MAX_IPC_MESSAGES) {
         queue->locked = 0;
+        count_dropped(receiver, msg->type);
         return 0; // Queue full
     }
     
     // Copy message
-    memcpy(&queue->messages[queue->tail], msg, sizeof(ipc_message_t));
+    ipc_slot_t* slot = &queue->messages[queue->tail];
+    if(!encode_message(slot, msg)) {
+        queue->locked = 0;
+        count_dropped(receiver, msg->type);
+        return 0; // Payload pool exhausted
+    }
     
-    // Generate message ID
-    static uint32_t next_message_id = 1;
-    queue->messages[queue->tail].message_id = next_message_id++;
+    slot->message_id = message_id;
     
     // Calculate checksum
-    calculate_message_checksum(&queue->messages[queue->tail]);
+    calculate_message_checksum(slot);
     
     queue->tail = (queue->tail + 1) % MAX_IPC_MESSAGES;
     queue->count++;
     
+    if(queue->count > ipc_queue_stats[receiver].high_water) {
+        ipc_queue_stats[receiver].high_water = queue->count;
+    }
+    
     queue->locked = 0;
     
     // Trigger interrupt to notify receiver
@@ -97,8 +347,17 @@ uint8_t ipc_send_message(module_id_t receiver, ipc_message_t* msg) {
     return 1;
 }
 
+uint8_t ipc_send_message(module_id_t receiver, ipc_message_t* msg) {
+    // Generate message ID
+    if(!enqueue_message(receiver, msg, next_message_id++)) return 0;
+    
+    ipc_queue_stats[receiver].counters.sent++;
+    if(msg->type < IPC_TOPIC_COUNT) ipc_type_stats[msg->type].sent++;
+    return 1;
+}
+
 uint8_t ipc_receive_message(module_id_t receiver, ipc_message_t* msg) {
-    if(receiver >= 6) return 0;
+    if(receiver >= IPC_MODULE_COUNT) return 0;
     
     ipc_queue_t* queue = &message_queues[receiver];
     
@@ -111,7 +370,15 @@ uint8_t ipc_receive_message(module_id_t receiver, ipc_message_t* msg) {
     queue->locked = 1;
     
     // Get message
-    memcpy(msg, &queue->messages[queue->head], sizeof(ipc_message_t));
+    ipc_slot_t* slot = &queue->messages[queue->head];
+    uint8_t valid = verify_message_checksum(slot);
+    decode_message(slot, msg);
+    if(valid) {
+        count_dequeued(receiver, slot);
+    } else {
+        count_dropped(receiver, slot->type);
+    }
+    release_slot(slot);
     
     queue->head = (queue->head + 1) % MAX_IPC_MESSAGES;
     queue->count--;
@@ -119,7 +386,7 @@ uint8_t ipc_receive_message(module_id_t receiver, ipc_message_t* msg) {
     queue->locked = 0;
     
     // Verify checksum
-    if(!verify_message_checksum(msg)) {
+    if(!valid) {
         log_error("IPC checksum failed", "Message ID: %d", msg->message_id);
         return 0;
     }
@@ -128,7 +395,7 @@ uint8_t ipc_receive_message(module_id_t receiver, ipc_message_t* msg) {
 }
 
 uint8_t ipc_peek_message(module_id_t receiver, ipc_message_t* msg) {
-    if(receiver >= 6) return 0;
+    if(receiver >= IPC_MODULE_COUNT) return 0;
     
     ipc_queue_t* queue = &message_queues[receiver];
     
@@ -140,124 +407,507 @@ uint8_t ipc_peek_message(module_id_t receiver, ipc_message_t* msg) {
     }
     queue->locked = 1;
     
-    memcpy(msg, &queue->messages[queue->head], sizeof(ipc_message_t));
+    decode_message(&queue->messages[queue->head], msg);
     
     queue->locked = 0;
     
     return 1;
 }
 
-void process_ipc_messages(module_id_t module) {
-    ipc_message_t msg;
+uint8_t ipc_subscribe(module_id_t module, message_type_t type) {
+    if(module >= IPC_MODULE_COUNT || type >= IPC_TOPIC_COUNT) return 0;
     
-    while(ipc_receive_message(module, &msg)) {
-        switch(msg.type) {
-            case MSG_NEW_PRESCRIPTION:
-                if(module == MODULE_MEDICATION) {
-                    uint32_t prescription_id;
-                    memcpy(&prescription_id, msg.data, sizeof(uint32_t));
-                    process_prescription(prescription_id);
-                }
-                break;
-                
-            case MSG_PAYMENT_REQUEST:
-                if(module == MODULE_CASHIER) {
-                    uint32_t dispense_id;
-                    memcpy(&dispense_id, msg.data, sizeof(uint32_t));
-                    process_payment(dispense_id);
-                }
-                break;
-                
-            case MSG_EQUIPMENT_REQUEST:
-                if(module == MODULE_WAREHOUSE) {
-                    // Process equipment request
-                    char equipment_code[16];
-                    char department[32];
-                    memcpy(equipment_code, msg.data, 16);
-                    memcpy(department, msg.data + 16, 32);
-                    
-                    check_equipment_availability(equipment_code, department);
-                }
-                break;
-                
-            case MSG_ALERT:
-                // Display alert on all modules
-                display_alert((char*)msg.data);
-                break;
-                
-            case MSG_SYSTEM_SHUTDOWN:
-                // Prepare for shutdown
-                prepare_shutdown();
-                break;
+    lock_topic_bus();
+    
+    // Start at the current end of the ring; history is not replayed
+    if(!(topic_bus.subscribers[type] & (1 << module))) {
+        uint8_t subscribed = 0;
+        for(int t = 0; t < IPC_TOPIC_COUNT; t++) {
+            if(topic_bus.subscribers[t] & (1 << module)) subscribed = 1;
         }
-        
-        // Send acknowledgment if required
-        if(msg.requires_ack && !msg.acknowledged) {
-            ipc_message_t ack;
-            ack.type = MSG_NONE; // Special ack message
-            ack.sender = module;
-            ack.receiver = msg.sender;
-            ack.requires_ack = 0;
-            memcpy(ack.data, &msg.message_id, sizeof(uint32_t));
-            ack.data_size = sizeof(uint32_t);
-            
-            ipc_send_message(msg.sender, &ack);
+        if(!subscribed) {
+            topic_bus.cursors[module] = topic_bus.next_sequence;
         }
+        topic_bus.subscribers[type] |= (1 << module);
+    }
+    
+    topic_bus.locked = 0;
+    return 1;
+}
+
+// Drop one subscriber's reference; the last one frees the payload
+static void release_topic_slot(ipc_topic_slot_t* slot, module_id_t module) {
+    slot->pending_mask &= ~(1 << module);
+    if(--slot->refcount == 0) {
+        release_slot(&slot->message);
     }
 }
 
-void calculate_message_checksum(ipc_message_t* msg) {
-    // Simple checksum calculation
-    uint32_t sum = 0;
-    uint8_t* bytes = (uint8_t*)msg;
+void ipc_unsubscribe(module_id_t module, message_type_t type) {
+    if(module >= IPC_MODULE_COUNT || type >= IPC_TOPIC_COUNT) return;
     
-    for(uint32_t i = 0; i < offsetof(ipc_message_t, checksum); i++) {
-        sum += bytes[i];
+    lock_topic_bus();
+    
+    topic_bus.subscribers[type] &= ~(1 << module);
+    
+    // Drop references the module still holds on this topic
+    for(int i = 0; i < IPC_TOPIC_RING_SIZE; i++) {
+        ipc_topic_slot_t* slot = &topic_bus.slots[i];
+        if(slot->message.type == type && (slot->pending_mask & (1 << module))) {
+            release_topic_slot(slot, module);
+        }
     }
     
-    // Store in checksum field
-    for(int i = 0; i < 4; i++) {
-        msg->checksum[i] = (sum >> (8 * i)) & 0xFF;
+    topic_bus.locked = 0;
+}
+
+uint8_t ipc_publish(ipc_message_t* msg) {
+    if(msg->type >= IPC_TOPIC_COUNT) return 0;
+    
+    lock_topic_bus();
+    
+    uint8_t mask = topic_bus.subscribers[msg->type] & ~(1 << msg->sender);
+    if(mask == 0) {
+        topic_bus.locked = 0;
+        return 1; // Nobody listening
     }
+    
+    ipc_topic_slot_t* slot = 
+        &topic_bus.slots[topic_bus.next_sequence % IPC_TOPIC_RING_SIZE];
+    
+    // Single copy shared by every subscriber; the oldest broadcast may
+    // still be referenced or the payload pool may be exhausted
+    if(slot->refcount > 0 || !encode_message(&slot->message, msg)) {
+        topic_bus.locked = 0;
+        for(int module = 0; module < IPC_MODULE_COUNT; module++) {
+            if(mask & (1 << module)) count_dropped(module, msg->type);
+        }
+        return 0;
+    }
+    slot->message.message_id = next_message_id++;
+    calculate_message_checksum(&slot->message);
+    
+    slot->sequence = topic_bus.next_sequence++;
+    slot->pending_mask = mask;
+    slot->refcount = 0;
+    for(int module = 0; module < IPC_MODULE_COUNT; module++) {
+        if(mask & (1 << module)) {
+            slot->refcount++;
+            ipc_queue_stats[module].counters.sent++;
+            ipc_type_stats[msg->type].sent++;
+        }
+    }
+    
+    topic_bus.locked = 0;
+    
+    for(int module = 0; module < IPC_MODULE_COUNT; module++) {
+        if(mask & (1 << module)) send_ipc_notification(module);
+    }
+    
+    return 1;
 }
 
-uint8_t verify_message_checksum(ipc_message_t* msg) {
-    uint32_t sum = 0;
-    uint8_t* bytes = (uint8_t*)msg;
+uint8_t ipc_receive_published(module_id_t module, ipc_message_t* msg) {
+    if(module >= IPC_MODULE_COUNT) return 0;
+    
+    lock_topic_bus();
+    
+    // Advance the cursor past broadcasts addressed to other modules
+    while(topic_bus.cursors[module] != topic_bus.next_sequence) {
+        uint32_t sequence = topic_bus.cursors[module]++;
+        ipc_topic_slot_t* slot = 
+            &topic_bus.slots[sequence % IPC_TOPIC_RING_SIZE];
+        
+        if(slot->sequence != sequence || 
+           !(slot->pending_mask & (1 << module))) {
+            continue;
+        }
+        
+        uint8_t valid = verify_message_checksum(&slot->message);
+        decode_message(&slot->message, msg);
+        if(valid) {
+            count_dequeued(module, &slot->message);
+        } else {
+            count_dropped(module, slot->message.type);
+        }
+        release_topic_slot(slot, module);
+        
+        topic_bus.locked = 0;
+        
+        if(!valid) {
+            log_error("IPC checksum failed", "Broadcast ID: %d", msg->message_id);
+            return 0;
+        }
+        return 1;
+    }
     
-    for(uint32_t i = 0; i < offsetof(ipc_message_t, checksum); i++) {
-        sum += bytes[i];
+    topic_bus.locked = 0;
+    return 0;
+}
+
+static void record_latency(module_id_t module, uint32_t sent) {
+    uint32_t latency_us = ((uint32_t)rdtsc() - sent) / tsc_mhz();
+    ipc_latency[module].handled++;
+    ipc_latency[module].total_us += latency_us;
+    if(latency_us > ipc_latency[module].max_us) {
+        ipc_latency[module].max_us = latency_us;
     }
+}
+
+static void defer_work(module_id_t module, ipc_message_t* msg, uint32_t id) {
+    ipc_work_queue_t* work = &ipc_work[module];
     
-    // Verify checksum
-    uint32_t stored_sum = 0;
-    for(int i = 0; i < 4; i++) {
-        stored_sum |= (msg->checksum[i] << (8 * i));
+    asm volatile("cli");
+    if(work->count == IPC_WORK_QUEUE_SIZE) {
+        asm volatile("sti");
+        log_error("IPC", "%s work queue full, dropped %d",
+                  ipc_module_names[module], id);
+        return;
     }
+    uint32_t tail = (work->head + work->count) % IPC_WORK_QUEUE_SIZE;
+    work->ids[tail] = id;
+    work->sent[tail] = msg->timestamp;
+    work->count++;
+    uint32_t waiter = work->waiter;
+    work->waiter = 0;
+    asm volatile("sti");
     
-    return sum == stored_sum;
+    if(waiter) task_wake(waiter - 1);
 }
 
-void send_ipc_notification(module_id_t module) {
-    // Send software interrupt to target module
-    // This would be implemented with APIC or PIC in real system
-    // For simplicity, we'll set a flag that modules check
+// Called from a module's menu loop; returns 0 when nothing is queued
+uint8_t ipc_take_work(module_id_t module, uint32_t* id) {
+    if(module >= IPC_MODULE_COUNT) return 0;
+    
+    ipc_work_queue_t* work = &ipc_work[module];
+    uint8_t taken = 0;
+    
+    uint32_t sent = 0;
+    
+    asm volatile("cli");
+    if(work->count > 0) {
+        *id = work->ids[work->head];
+        sent = work->sent[work->head];
+        work->head = (work->head + 1) % IPC_WORK_QUEUE_SIZE;
+        work->count--;
+        taken = 1;
+    }
+    asm volatile("sti");
+    
+    // The caller handles it next, so this is where send-to-handle ends
+    if(taken) record_latency(module, sent);
+    return taken;
+}
+
+// Menu key for a module's UI task, or 0 when work was queued for it
+// first; the task sleeps until a key press or defer_work() wakes it
+char ipc_menu_key(module_id_t module) {
+    ipc_work_queue_t* work = &ipc_work[module];
+    
+    while(1) {
+        asm volatile("cli");
+        if(work->count > 0) break;
+        if(keyboard_buffer_read != keyboard_buffer_write) {
+            work->waiter = 0;
+            asm volatile("sti");
+            return keyboard_read_char();
+        }
+        
+        work->waiter = current_task + 1;
+        keyboard_waiter = current_task + 1;
+        task_block();
+        if(work->count == 0 && keyboard_buffer_read == keyboard_buffer_write) {
+            asm volatile("sti; hlt");
+        }
+    }
+    work->waiter = 0;
+    asm volatile("sti");
+    return 0;
+}
+
+// Deferred work counts as handled when the menu loop takes it, the rest
+// once its handler here has run
+static void dispatch_ipc_message(module_id_t module, ipc_message_t* msg) {
+    uint8_t deferred = 0;
     
-    switch(module) {
-        case MODULE_DOCTOR:
-            doctor_ipc_flag = 1;
+    switch(msg->type) {
+        case MSG_NEW_PRESCRIPTION:
+            if(module == MODULE_MEDICATION) {
+                uint32_t prescription_id;
+                memcpy(&prescription_id, msg->data, sizeof(uint32_t));
+                defer_work(module, msg, prescription_id);
+                deferred = 1;
+            }
             break;
-        case MODULE_MEDICATION:
-            pharmacy_ipc_flag = 1;
+            
+        case MSG_PAYMENT_REQUEST:
+            if(module == MODULE_CASHIER) {
+                uint32_t dispense_id;
+                memcpy(&dispense_id, msg->data, sizeof(uint32_t));
+                defer_work(module, msg, dispense_id);
+                deferred = 1;
+            }
             break;
-        case MODULE_CASHIER:
-            cashier_ipc_flag = 1;
+            
+        case MSG_EQUIPMENT_REQUEST:
+            if(module == MODULE_WAREHOUSE) {
+                // Process equipment request
+                char equipment_code[16];
+                char department[32];
+                memcpy(equipment_code, msg->data, 16);
+                memcpy(department, msg->data + 16, 32);
+                
+                check_equipment_availability(equipment_code, department);
+            }
             break;
-        case MODULE_RECEPTION:
-            reception_ipc_flag = 1;
+            
+        case MSG_ALERT:
+            // Display alert on all modules
+            display_alert((char*)msg->data);
             break;
-        case MODULE_WAREHOUSE:
-            warehouse_ipc_flag = 1;
+            
+        case MSG_SYSTEM_SHUTDOWN:
+            // Prepare for shutdown
+            prepare_shutdown();
             break;
     }
+    if(!deferred) record_latency(module, msg->timestamp);
+    
+    // Send acknowledgment if required
+    if(msg->requires_ack && !msg->acknowledged) {
+        ipc_message_t ack;
+        ack.type = MSG_NONE; // Special ack message
+        ack.sender = module;
+        ack.receiver = msg->sender;
+        ack.requires_ack = 0;
+        memcpy(ack.data, &msg->message_id, sizeof(uint32_t));
+        ack.data_size = sizeof(uint32_t);
+        
+        ipc_send_message(msg->sender, &ack);
+    }
+}
+
+void process_ipc_messages(module_id_t module) {
+    ipc_message_t msg;
+    
+    while(ipc_receive_message(module, &msg)) {
+        dispatch_ipc_message(module, &msg);
+    }
+    
+    // Broadcast topics the module subscribed to
+    while(ipc_receive_published(module, &msg)) {
+        dispatch_ipc_message(module, &msg);
+    }
+}
+
+// CRC32C over the slot header following the checksum and the payload
+static uint32_t message_crc(ipc_slot_t* slot) {
+    uint8_t* header = (uint8_t*)&slot->message_id;
+    uint32_t header_len = (uint32_t)(slot->payload - header);
+    
+    uint32_t crc = crc32c_update(0xFFFFFFFF, header, header_len);
+    crc = crc32c_update(crc, slot_payload(slot), slot->data_size);
+    return ~crc;
+}
+
+void calculate_message_checksum(ipc_slot_t* slot) {
+    uint32_t crc = message_crc(slot);
+    
+    // Store in checksum field
+    for(int i = 0; i < 4; i++) {
+        slot->checksum[i] = (crc >> (8 * i)) & 0xFF;
+    }
+}
+
+uint8_t verify_message_checksum(ipc_slot_t* slot) {
+    if(!slot_in_bounds(slot)) return 0;
+    
+    uint32_t crc = message_crc(slot);
+    
+    // Verify checksum
+    uint32_t stored_crc = 0;
+    for(int i = 0; i < 4; i++) {
+        stored_crc |= ((uint32_t)slot->checksum[i] << (8 * i));
+    }
+    
+    return crc == stored_crc;
+}
+
+static uint8_t has_pending_messages(module_id_t module) {
+    return message_queues[module].count > 0 ||
+           topic_bus.cursors[module] != topic_bus.next_sequence;
+}
+
+void send_ipc_notification(module_id_t module) {
+    // Wake the module's service task if it is sleeping on its queue
+    uint32_t task_id = ipc_waiters[module];
+    if(task_id != IPC_NO_WAITER) {
+        ipc_waiters[module] = IPC_NO_WAITER;
+        task_wake(task_id);
+    }
+}
+
+void ipc_wait_message(module_id_t module) {
+    if(module >= IPC_MODULE_COUNT) return;
+    
+    // Interrupts off so a send cannot slip in between check and block
+    asm volatile("cli");
+    while(!has_pending_messages(module)) {
+        ipc_waiters[module] = current_task;
+        task_block();
+        
+        // Nothing else was runnable: idle until the next interrupt
+        if(!has_pending_messages(module)) asm volatile("sti; hlt; cli");
+    }
+    asm volatile("sti");
+}
+
+void ipc_service_task(void* param) {
+    module_id_t module = (module_id_t)(uint32_t)param;
+    
+    while(1) {
+        ipc_wait_message(module);
+        process_ipc_messages(module);
+    }
+}
+
+void ipc_latency_report() {
+    for(int module = MODULE_DOCTOR; module < IPC_MODULE_COUNT; module++) {
+        ipc_latency_t* lat = &ipc_latency[module];
+        if(lat->handled == 0) continue;
+        
+        log_activity("IPC latency",
+                    "Module %d: %d messages, avg %d us, max %d us",
+                    module, lat->handled,
+                    lat->total_us / lat->handled, lat->max_us);
+    }
+}
+
+// System monitor page: one line per receiver queue
+void ipc_monitor_page() {
+    vga_clear_screen();
+    vga_print_at(0, 0, "=== IPC QUEUES ===");
+    vga_print_at(0, 2, "Queue      Depth  HWM    Sent   Recv   Drop   p50 us");
+    
+    for(int module = 0; module < IPC_MODULE_COUNT; module++) {
+        ipc_queue_stats_t* stats = &ipc_queue_stats[module];
+        
+        // Median bucket of the enqueue-to-dequeue histogram
+        uint32_t seen = 0;
+        uint32_t median = 0;
+        for(int b = 0; b < IPC_LATENCY_BUCKETS; b++) {
+            seen += stats->latency_hist[b];
+            if(seen * 2 >= stats->counters.received && seen > 0) {
+                median = b ? (1u << (b - 1)) : 0;
+                break;
+            }
+        }
+        
+        char line[80];
+        sprintf(line, "%-10s %-6d %-6d %-6d %-6d %-6d %d",
+                ipc_module_names[module],
+                message_queues[module].count,
+                stats->high_water,
+                stats->counters.sent,
+                stats->counters.received,
+                stats->counters.dropped,
+                median);
+        vga_print_at(0, 3 + module, line);
+    }
+    
+    char pool_buf[40];
+    uint32_t blocks_used = 0;
+    for(int i = 0; i < IPC_PAYLOAD_BLOCKS; i++) {
+        if(payload_pool.used[i / 32] & (1u << (i % 32))) blocks_used++;
+    }
+    sprintf(pool_buf, "Payload blocks: %d/%d", blocks_used, IPC_PAYLOAD_BLOCKS);
+    vga_print_at(0, 10, pool_buf);
+}
+
+// Text dump of all IPC counters and histograms, one record per line:
+//   Q <module> <depth> <hwm> <sent> <received> <dropped>
+//   H <module> <bucket0> ... <bucket15>
+//   T <type> <sent> <received> <dropped>
+//   L <module> <handled> <avg us> <max us>
+// Worst case is about 2.5KB; the buffer is static to keep it off the
+// 4KB task stack.
+#define IPC_DUMP_SIZE 4096
+
+static char ipc_dump_buffer[IPC_DUMP_SIZE];
+static uint32_t ipc_dump_length;
+static uint8_t ipc_dump_truncated;
+
+// Appends whole pieces only, so a full dump ends on a complete field
+static void dump_append(const char* text) {
+    uint32_t length = strlen(text);
+    if(ipc_dump_length + length >= IPC_DUMP_SIZE) {
+        ipc_dump_truncated = 1;
+        return;
+    }
+    memcpy(ipc_dump_buffer + ipc_dump_length, text, length + 1);
+    ipc_dump_length += length;
+}
+
+static void dump_number(uint32_t value) {
+    char field[16]; // " " plus at most 11 characters of %d
+    sprintf(field, " %d", value);
+    dump_append(field);
+}
+
+static void dump_counters(ipc_counters_t* counters) {
+    dump_number(counters->sent);
+    dump_number(counters->received);
+    dump_number(counters->dropped);
+}
+
+void ipc_dump_stats() {
+    ipc_dump_length = 0;
+    ipc_dump_truncated = 0;
+    ipc_dump_buffer[0] = '\0';
+    
+    for(int module = 0; module < IPC_MODULE_COUNT; module++) {
+        ipc_queue_stats_t* stats = &ipc_queue_stats[module];
+        
+        dump_append("Q ");
+        dump_append(ipc_module_names[module]);
+        dump_number(message_queues[module].count);
+        dump_number(stats->high_water);
+        dump_counters(&stats->counters);
+        dump_append("\n");
+        
+        dump_append("H ");
+        dump_append(ipc_module_names[module]);
+        for(int b = 0; b < IPC_LATENCY_BUCKETS; b++) {
+            dump_number(stats->latency_hist[b]);
+        }
+        dump_append("\n");
+    }
+    
+    for(int type = 0; type < IPC_TOPIC_COUNT; type++) {
+        ipc_counters_t* counters = &ipc_type_stats[type];
+        if(counters->sent == 0 && counters->dropped == 0) continue;
+        
+        dump_append("T");
+        dump_number(type);
+        dump_counters(counters);
+        dump_append("\n");
+    }
+    
+    for(int module = MODULE_DOCTOR; module < IPC_MODULE_COUNT; module++) {
+        ipc_latency_t* lat = &ipc_latency[module];
+        if(lat->handled == 0) continue;
+        
+        dump_append("L ");
+        dump_append(ipc_module_names[module]);
+        dump_number(lat->handled);
+        dump_number(lat->total_us / lat->handled);
+        dump_number(lat->max_us);
+        dump_append("\n");
+    }
+    ipc_latency_report();
+    
+    if(ipc_dump_truncated) {
+        log_error("IPC", "IPCSTATS.TXT truncated at %d bytes", ipc_dump_length);
+    }
+    file_write("IPCSTATS.TXT", ipc_dump_buffer, ipc_dump_length);
 }
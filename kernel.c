@@ -19,6 +19,15 @@
 #define LPT1_STATUS 0x379
 #define LPT1_CONTROL 0x37A
 
+// SSE enable bits
+#define CPUID_EDX_FXSR (1 << 24)
+#define CPUID_EDX_SSE (1 << 25)
+#define CPUID_EDX_SSE2 (1 << 26)
+#define CR0_MP (1 << 1)
+#define CR0_EM (1 << 2)
+#define CR4_OSFXSR (1 << 9)
+#define CR4_OSXMMEXCPT (1 << 10)
+
 // Memory Management
 #define MEMORY_POOL_SIZE 0x100000
 #define MAX_MEMORY_BLOCKS 1024
@@ -40,7 +49,7 @@ typedef struct {
 // Interrupt Handling
 #define MAX_INTERRUPTS 256
 
-typedef struct {
+typedef struct interrupt_frame {
     uint32_t eip;
     uint32_t cs;
     uint32_t eflags;
@@ -77,7 +86,9 @@ typedef struct {
     uint32_t cpu_time;
     void (*entry_point)(void*);
     void* parameter;
+    uint32_t wake_time;    // Tick a sleeping task is due, 0 if not sleeping
     uint32_t registers[8]; // EAX, EBX, ECX, EDX, ESI, EDI, EBP, ESP
+    uint8_t fpu_state[512] __attribute__((aligned(16))); // FXSAVE area
 } task_t;
 
 // System Tables
@@ -99,6 +110,12 @@ interrupt_manager_t interrupt_manager;
 task_t task_table[MAX_TASKS];
 uint32_t current_task = 0;
 system_status_t system_status;
+uint8_t scheduler_started = 0; // Tasks may block; interrupts are live
+uint32_t keyboard_waiter = 0;   // Task id + 1 blocked until a key arrives
+
+// Set once SSE is usable; tasks then carry their own x87/SSE registers
+uint8_t sse_enabled = 0;
+static uint8_t fpu_initial_state[512] __attribute__((aligned(16)));
 
 // Hardware Initialization
 void init_pic() {
@@ -137,6 +154,40 @@ void init_keyboard() {
     outb(KEYBOARD_DATA, 0xF4);
 }
 
+// Turn on SSE when the CPU has SSE2 and FXSAVE: the FPU is native
+// (no EM), WAIT honours TS (MP), and the OS saves SSE state (OSFXSR) and
+// handles SIMD exceptions (OSXMMEXCPT). Without it SSE opcodes fault.
+void init_sse() {
+    uint32_t eax = 1, ebx, ecx = 0, edx;
+    asm volatile("cpuid" : "+a"(eax), "=b"(ebx), "+c"(ecx), "=d"(edx));
+    uint32_t needed = CPUID_EDX_FXSR | CPUID_EDX_SSE | CPUID_EDX_SSE2;
+    if((edx & needed) != needed) return;
+    
+    uint32_t cr0, cr4;
+    asm volatile("mov %%cr0, %0" : "=r"(cr0));
+    cr0 = (cr0 & ~CR0_EM) | CR0_MP;
+    asm volatile("mov %0, %%cr0" : : "r"(cr0));
+    asm volatile("mov %%cr4, %0" : "=r"(cr4));
+    cr4 |= CR4_OSFXSR | CR4_OSXMMEXCPT;
+    asm volatile("mov %0, %%cr4" : : "r"(cr4));
+    
+    // Every new task starts from a freshly initialised FPU
+    asm volatile("fninit; fxsave %0" : "=m"(fpu_initial_state));
+    sse_enabled = 1;
+}
+
+// Install a device IRQ handler and unmask the line (IRQ 8-15 via cascade)
+void register_irq_handler(uint8_t irq, isr_handler_t handler) {
+    interrupt_manager.handlers[0x20 + irq] = handler;
+    
+    if(irq < 8) {
+        outb(PIC1_DATA, inb(PIC1_DATA) & ~(1 << irq));
+    } else {
+        outb(PIC2_DATA, inb(PIC2_DATA) & ~(1 << (irq - 8)));
+        outb(PIC1_DATA, inb(PIC1_DATA) & ~0x04);
+    }
+}
+
 // Memory Management
 void init_memory_manager() {
     memory_manager.total_blocks = 0;
@@ -217,8 +268,11 @@ uint32_t create_task(const char* name, void (*entry)(void*), void* param, uint32
             task_table[i].priority = priority;
             task_table[i].time_slice = 100; // 1 second at 100Hz
             task_table[i].cpu_time = 0;
+            task_table[i].wake_time = 0;
             task_table[i].entry_point = entry;
             task_table[i].parameter = param;
+            memcpy(task_table[i].fpu_state, fpu_initial_state, 
+                   sizeof(fpu_initial_state));
             
             // Initialize stack
             uint32_t* stack = task_table[i].stack_base + TASK_STACK_SIZE / 4;
@@ -240,6 +294,15 @@ uint32_t create_task(const char* name, void (*entry)(void*), void* param, uint32
     return 0xFFFFFFFF;
 }
 
+// Every task switch goes through here so SSE registers follow their task
+static void task_switch_to(uint32_t task_id) {
+    if(sse_enabled) {
+        asm volatile("fxsave %0" : "=m"(task_table[current_task].fpu_state));
+        asm volatile("fxrstor %0" : : "m"(task_table[task_id].fpu_state));
+    }
+    switch_task(task_id);
+}
+
 void schedule() {
     // Round-robin scheduler with priority
     uint32_t next_task = current_task;
@@ -247,17 +310,74 @@ void schedule() {
     do {
         next_task = (next_task + 1) % MAX_TASKS;
         if(task_table[next_task].state == TASK_READY) {
-            switch_task(next_task);
+            task_switch_to(next_task);
             return;
         }
     } while(next_task != current_task);
 }
 
+// Block the running task until task_wake() makes it ready again
+void task_block() {
+    task_table[current_task].state = TASK_BLOCKED;
+    schedule();
+    
+    // No other task was ready, so schedule() returned without switching
+    if(task_table[current_task].state == TASK_BLOCKED) {
+        task_table[current_task].state = TASK_RUNNING;
+    }
+}
+
+void task_wake(uint32_t task_id) {
+    if(task_id >= MAX_TASKS || task_table[task_id].state != TASK_BLOCKED) {
+        return;
+    }
+    task_table[task_id].state = TASK_READY;
+    
+    // Preempt lower priority work so the event is handled immediately
+    if(task_table[task_id].priority > task_table[current_task].priority) {
+        task_table[current_task].state = TASK_READY;
+        task_switch_to(task_id);
+    }
+}
+
+// Block the running task for at least the given number of timer ticks
+void task_sleep(uint32_t ticks) {
+    asm volatile("cli");
+    task_table[current_task].wake_time = system_status.system_time + ticks;
+    if(task_table[current_task].wake_time == 0) {
+        task_table[current_task].wake_time = 1;
+    }
+    
+    while(task_table[current_task].wake_time != 0) {
+        task_block();
+        if(task_table[current_task].wake_time != 0) asm volatile("sti; hlt; cli");
+    }
+    asm volatile("sti");
+}
+
+// Entry functions that finish call this instead of returning
+void task_exit() {
+    asm volatile("cli");
+    task_table[current_task].state = TASK_TERMINATED;
+    schedule(); // The idle task is always ready
+}
+
 // Interrupt Handlers
 void isr_timer(interrupt_frame_t* frame) {
     system_status.system_time++;
     system_status.uptime_seconds = system_status.system_time / 100;
     
+    // Wake sleepers that are due
+    for(uint32_t i = 0; i < MAX_TASKS; i++) {
+        if(task_table[i].wake_time != 0 &&
+           (int32_t)(system_status.system_time - task_table[i].wake_time) >= 0) {
+            task_table[i].wake_time = 0;
+            if(task_table[i].state == TASK_BLOCKED) {
+                task_table[i].state = TASK_READY;
+            }
+        }
+    }
+    
     // Update task time slices
     if(task_table[current_task].state == TASK_RUNNING) {
         if(--task_table[current_task].time_slice == 0) {
@@ -279,6 +399,12 @@ void isr_keyboard(interrupt_frame_t* frame) {
     // Forward to active module
     
     outb(PIC1_COMMAND, 0x20);
+    
+    if(keyboard_waiter) {
+        uint32_t task = keyboard_waiter - 1;
+        keyboard_waiter = 0;
+        task_wake(task);
+    }
 }
 
 // System Calls
@@ -316,14 +442,22 @@ void syscall_handler(interrupt_frame_t* frame) {
 
 // Main Kernel Entry Point
 void kernel_main() {
+    boot_timer_start();
+    
     // Initialize hardware
     init_pic();
     init_pit();
     init_keyboard();
+    init_sse();
     
     // Initialize managers
     init_memory_manager();
     init_task_manager();
+    disk_init();
+    fs_init();
+    db_init();
+    db_boot_queue();
+    ipc_init();
     
     // Load modules
     load_module("DOCTOR.BIN", 0x20000);
@@ -332,7 +466,19 @@ void kernel_main() {
     load_module("RECEPTION.BIN", 0x50000);
     load_module("WAREHOUSE.BIN", 0x60000);
     
+    // IPC service tasks sleep on their queues and preempt the UI on arrival
+    create_task("IPC_DOCTOR", ipc_service_task, (void*)MODULE_DOCTOR, 2);
+    create_task("IPC_PHARMACY", ipc_service_task, (void*)MODULE_MEDICATION, 2);
+    create_task("IPC_CASHIER", ipc_service_task, (void*)MODULE_CASHIER, 2);
+    create_task("IPC_RECEPTION", ipc_service_task, (void*)MODULE_RECEPTION, 2);
+    create_task("IPC_WAREHOUSE", ipc_service_task, (void*)MODULE_WAREHOUSE, 2);
+    
+    // Table reads all go out at once; modules block per table until ready
+    create_task("DB_LOADER", db_loader_task, NULL, 1);
+    create_task("SNAPSHOT", snapshot_task, NULL, 0);
+    
     // Start scheduler
+    scheduler_started = 1;
     enable_interrupts();
     
     // System ready
@@ -0,0 +1,56 @@
+#include "pos_system.h"
+
+// Lookups into the master data image generated by tools/mkmaster. The
+// image is const and lives in .rodata; a lookup is two hashes and one
+// compare, whatever the number of records.
+
+// FNV-1a with a seeded basis and a final mix. tools/mkmaster builds the
+// tables with the same function.
+uint32_t master_hash(const char* code, uint32_t seed) {
+    uint32_t hash = 2166136261u ^ (seed * 0x9E3779B1u);
+    while(*code) {
+        hash ^= (uint8_t)*code++;
+        hash *= 16777619u;
+    }
+    hash ^= hash >> 15;
+    hash *= 0x2C1B3C6Du;
+    hash ^= hash >> 12;
+    return hash;
+}
+
+const void* master_lookup(const master_index_t* index, const char* code) {
+    if(index->count == 0) return NULL;
+    
+    uint32_t bucket = master_hash(code, 0) % index->bucket_count;
+    uint32_t slot = master_hash(code, index->seeds[bucket]) % index->count;
+    
+    const char* record = (const char*)index->records +
+                         slot * index->record_size;
+    return strcmp(record, code) == 0 ? record : NULL;
+}
+
+// Rows in master file order, for listings and numbered choices
+const void* master_row(const master_index_t* index, uint32_t row) {
+    if(row >= index->count) return NULL;
+    return (const char*)index->records +
+           index->order[row] * index->record_size;
+}
+
+const medication_master_t* find_medication(const char* code) {
+    return (const medication_master_t*)master_lookup(&master_medications, code);
+}
+
+const insurance_provider_t* find_insurance(const char* code) {
+    return (const insurance_provider_t*)master_lookup(&master_insurance, code);
+}
+
+// Insurance types are numbered from 1 in master/insurance.csv row order
+const char* get_insurance_name(uint8_t insurance_type) {
+    const insurance_provider_t* provider =
+        master_row(&master_insurance, insurance_type - 1);
+    return provider ? provider->provider_name : "Unknown";
+}
+
+const equipment_type_t* find_equipment_type(const char* code) {
+    return (const equipment_type_t*)master_lookup(&master_equipment_types, code);
+}
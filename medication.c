@@ -1,30 +1,8 @@
 #include "pos_system.h"
 
-#define MAX_MEDICATIONS 2000
 #define MAX_INVENTORY_ITEMS 5000
 #define MAX_PHARMACISTS 20
 
-typedef struct {
-    char code[16];
-    char name[64];
-    char generic_name[64];
-    char manufacturer[64];
-    char drug_class[32];
-    char schedule; // I-V
-    char form[32]; // Tablet, Capsule, Syrup, etc.
-    char strength[32];
-    char unit[16];
-    float unit_price;
-    float wholesale_price;
-    uint16_t min_stock;
-    uint16_t max_stock;
-    uint8_t requires_prescription;
-    char storage_conditions[64];
-    uint32_t shelf_life_days;
-    char barcode[20];
-    char ndc_number[20];
-} medication_master_t;
-
 typedef struct {
     uint32_t inventory_id;
     char medication_code[16];
@@ -65,11 +43,35 @@ typedef struct {
 } dispense_record_t;
 
 // Databases
-medication_master_t medication_db[MAX_MEDICATIONS];
-inventory_item_t inventory_db[MAX_INVENTORY_ITEMS];
-dispense_record_t dispense_db[10000];
+medication_master_t* medication_db = NULL; // Build-time image, see master.c
+inventory_item_t inventory_db_store[MAX_INVENTORY_ITEMS];
+inventory_item_t* inventory_db = inventory_db_store;
+dispense_record_t dispense_db_store[10000];
+dispense_record_t* dispense_db = dispense_db_store;
 pharmacist_session_t current_pharmacist;
 
+// Table files
+// The medication list is static master data built into the kernel image
+// from master/medications.csv, so there is nothing to load or save
+void load_medication_database() {
+    medication_db = (medication_master_t*)master_medications.records;
+}
+
+void save_medication_database() {
+}
+
+void load_inventory_database() {
+    inventory_db = db_register_table(DB_TABLE_INVENTORY, "INVENTRY.DAT",
+                                     inventory_db_store,
+                                     sizeof(inventory_item_t),
+                                     MAX_INVENTORY_ITEMS);
+    dispense_db = db_register_table(DB_TABLE_DISPENSE, "DISPENSE.DAT",
+                                    dispense_db_store,
+                                    sizeof(dispense_record_t), 10000);
+    db_load_table(DB_TABLE_INVENTORY);
+    db_load_table(DB_TABLE_DISPENSE);
+}
+
 // Inventory management
 void check_inventory() {
     clear_screen();
@@ -88,7 +90,7 @@ void check_inventory() {
            inventory_db[i].available_quantity < 
            get_min_stock(inventory_db[i].medication_code)) {
             
-            medication_master_t* med = 
+            const medication_master_t* med = 
                 find_medication(inventory_db[i].medication_code);
             
             print("%-6s %-20s %-12s %-8d %-8d %s\n",
@@ -122,7 +124,7 @@ void check_inventory() {
                 days_difference(current_date, inventory_db[i].expiration_date);
             
             if(days_to_expire <= 30 && days_to_expire > 0) {
-                medication_master_t* med = 
+                const medication_master_t* med = 
                     find_medication(inventory_db[i].medication_code);
                 
                 char exp_date[11];
@@ -164,7 +166,9 @@ void process_prescription(uint32_t prescription_id) {
     print("Patient: %s %s (ID: %d)\n", 
           patient->first_name, patient->last_name, patient->patient_id);
     print("Doctor: %s\n", get_doctor_name(pres->doctor_id));
-    print("Diagnosis: %s\n\n", pres->diagnosis);
+    char diagnosis[128];
+    text_field(pres->text_ref, 0, diagnosis, sizeof(diagnosis));
+    print("Diagnosis: %s\n\n", diagnosis);
     
     // Process each medication
     float total_amount = 0;
@@ -188,10 +192,12 @@ void process_prescription(uint32_t prescription_id) {
             print("   Status: [AVAILABLE] Stock: %d\n", available);
             
             // Calculate price
-            medication_master_t* med = find_medication(item->medication_code);
+            const medication_master_t* med =
+                find_medication(item->medication_code);
             item->unit_price = med->unit_price;
             item->total = item->unit_price * item->quantity;
             total_amount += item->total;
+            db_mark_dirty(DB_TABLE_PRESCRIPTION_ITEM, item);
             
             print("   Price: $%.2f x %d = $%.2f\n", 
                   item->unit_price, item->quantity, item->total);
@@ -237,6 +243,7 @@ void process_prescription(uint32_t prescription_id) {
     dispense->discount = calculate_discount(pres->patient_id, total_amount);
     dispense->tax = calculate_tax(total_amount - dispense->discount);
     dispense->net_amount = total_amount - dispense->discount + dispense->tax;
+    db_mark_dirty(DB_TABLE_DISPENSE, dispense);
     
     print("\n========================================\n");
     print("TOTAL AMOUNT:     $%.2f\n", total_amount);
@@ -250,6 +257,7 @@ void process_prescription(uint32_t prescription_id) {
     
     // Update prescription status
     pres->status = 2; // Sent to cashier
+    db_mark_dirty(DB_TABLE_PRESCRIPTION, pres);
     
     log_activity("Prescription processed", 
                 "Prescription ID: %08X, Amount: $%.2f",
@@ -289,6 +297,7 @@ void dispense_medication(uint32_t dispense_id) {
                 // Update inventory
                 inventory_db[j].available_quantity -= take;
                 remaining -= take;
+                db_mark_dirty(DB_TABLE_INVENTORY, &inventory_db[j]);
                 
                 // Record transaction
                 record_inventory_transaction(
@@ -322,11 +331,14 @@ void dispense_medication(uint32_t dispense_id) {
         
         item->dispensed = 1;
         item->dispense_date = get_system_time();
+        db_mark_dirty(DB_TABLE_PRESCRIPTION_ITEM, item);
     }
     
     // Update records
     dispense->status = 2; // Dispensed
     pres->status = 3; // Dispensed
+    db_mark_dirty(DB_TABLE_DISPENSE, dispense);
+    db_mark_dirty(DB_TABLE_PRESCRIPTION, pres);
     
     // Print receipt
     print_dispense_receipt(dispense_id);
@@ -367,7 +379,7 @@ void receive_supply() {
         print("Medication Code: ");
         read_input(med_code, 16);
         
-        medication_master_t* med = find_medication(med_code);
+        const medication_master_t* med = find_medication(med_code);
         if(med == NULL) {
             print("Medication not in master. Add first.\n");
             continue;
@@ -408,6 +420,7 @@ void receive_supply() {
                 inventory_db[i].selling_price = med->unit_price;
                 inventory_db[i].status = 1; // Active
                 
+                db_log_change(DB_TABLE_INVENTORY, &inventory_db[i]);
                 total_value += price * quantity;
                 item_count++;
                 break;
@@ -419,6 +432,9 @@ void receive_supply() {
         if(another != 'Y' && another != 'y') break;
     }
     
+    // All received items reach the log in one group commit
+    db_commit();
+    
     // Print GRN (Goods Received Note)
     print_goods_received_note(invoice_number, supplier, item_count, total_value);
     
@@ -439,9 +455,13 @@ void medication_main() {
     while(1) {
         clear_screen();
         print_header("PHARMACY MANAGEMENT");
+        boot_first_menu();
         
-        // Check for new prescriptions (IPC messages)
-        check_ipc_messages();
+        // Prescriptions sent by doctors while the pharmacist was busy
+        uint32_t prescription_id;
+        while(ipc_take_work(MODULE_MEDICATION, &prescription_id)) {
+            process_prescription(prescription_id);
+        }
         
         print_time_date();
         print_inventory_summary();
@@ -455,7 +475,8 @@ void medication_main() {
         print("7. Logout\n");
         print("\nSelection: ");
         
-        char choice = getchar();
+        // 0 when a prescription arrives first; the loop then handles it
+        char choice = ipc_menu_key(MODULE_MEDICATION);
         switch(choice) {
             case '1':
                 process_prescription_menu();
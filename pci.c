@@ -0,0 +1,88 @@
+#include "pos_system.h"
+
+// PCI configuration mechanism #1
+#define PCI_CONFIG_ADDRESS 0xCF8
+#define PCI_CONFIG_DATA 0xCFC
+
+static uint32_t pci_address(pci_device_t* dev, uint8_t offset) {
+    return 0x80000000 | ((uint32_t)dev->bus << 16) | 
+           ((uint32_t)dev->slot << 11) | ((uint32_t)dev->function << 8) |
+           (offset & 0xFC);
+}
+
+uint32_t pci_read_config(pci_device_t* dev, uint8_t offset) {
+    outl(PCI_CONFIG_ADDRESS, pci_address(dev, offset));
+    return inl(PCI_CONFIG_DATA);
+}
+
+void pci_write_config(pci_device_t* dev, uint8_t offset, uint32_t value) {
+    outl(PCI_CONFIG_ADDRESS, pci_address(dev, offset));
+    outl(PCI_CONFIG_DATA, value);
+}
+
+// Brute-force scan of every bus/slot/function for a class match
+uint8_t pci_find_class(uint8_t class_code, uint8_t subclass, pci_device_t* dev) {
+    for(uint32_t bus = 0; bus < 256; bus++) {
+        for(uint8_t slot = 0; slot < 32; slot++) {
+            for(uint8_t function = 0; function < 8; function++) {
+                dev->bus = bus;
+                dev->slot = slot;
+                dev->function = function;
+                
+                uint32_t id = pci_read_config(dev, 0x00);
+                if((id & 0xFFFF) == 0xFFFF) {
+                    if(function == 0) break;
+                    continue;
+                }
+                
+                uint32_t class_reg = pci_read_config(dev, 0x08);
+                if((class_reg >> 24) == class_code &&
+                   ((class_reg >> 16) & 0xFF) == subclass) {
+                    dev->vendor_id = id & 0xFFFF;
+                    dev->device_id = id >> 16;
+                    dev->prog_if = (class_reg >> 8) & 0xFF;
+                    dev->irq = pci_read_config(dev, 0x3C) & 0xFF;
+                    return 1;
+                }
+            }
+        }
+    }
+    return 0;
+}
+
+uint8_t pci_find_device(uint16_t vendor_id, uint16_t device_id, pci_device_t* dev) {
+    for(uint32_t bus = 0; bus < 256; bus++) {
+        for(uint8_t slot = 0; slot < 32; slot++) {
+            for(uint8_t function = 0; function < 8; function++) {
+                dev->bus = bus;
+                dev->slot = slot;
+                dev->function = function;
+                
+                uint32_t id = pci_read_config(dev, 0x00);
+                if((id & 0xFFFF) == 0xFFFF) {
+                    if(function == 0) break;
+                    continue;
+                }
+                
+                if((id & 0xFFFF) == vendor_id && (id >> 16) == device_id) {
+                    uint32_t class_reg = pci_read_config(dev, 0x08);
+                    dev->vendor_id = vendor_id;
+                    dev->device_id = device_id;
+                    dev->prog_if = (class_reg >> 8) & 0xFF;
+                    dev->irq = pci_read_config(dev, 0x3C) & 0xFF;
+                    return 1;
+                }
+            }
+        }
+    }
+    return 0;
+}
+
+uint32_t pci_bar(pci_device_t* dev, uint8_t index) {
+    return pci_read_config(dev, 0x10 + index * 4);
+}
+
+void pci_enable_bus_master(pci_device_t* dev) {
+    uint32_t command = pci_read_config(dev, 0x04);
+    pci_write_config(dev, 0x04, command | 0x07); // I/O, memory, bus master
+}
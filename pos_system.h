@@ -20,10 +20,71 @@ static inline void outb(uint16_t port, uint8_t val) {
     asm volatile("outb %0, %1" : : "a"(val), "Nd"(port));
 }
 
+static inline void insw(uint16_t port, void* buffer, uint32_t count) {
+    asm volatile("rep insw" : "+D"(buffer), "+c"(count) : "d"(port) : "memory");
+}
+
+static inline void outsw(uint16_t port, const void* buffer, uint32_t count) {
+    asm volatile("rep outsw" : "+S"(buffer), "+c"(count) : "d"(port) : "memory");
+}
+
+static inline uint16_t inw(uint16_t port) {
+    uint16_t ret;
+    asm volatile("inw %1, %0" : "=a"(ret) : "Nd"(port));
+    return ret;
+}
+
+static inline void outw(uint16_t port, uint16_t val) {
+    asm volatile("outw %0, %1" : : "a"(val), "Nd"(port));
+}
+
+static inline uint32_t inl(uint16_t port) {
+    uint32_t ret;
+    asm volatile("inl %1, %0" : "=a"(ret) : "Nd"(port));
+    return ret;
+}
+
+static inline void outl(uint16_t port, uint32_t val) {
+    asm volatile("outl %0, %1" : : "a"(val), "Nd"(port));
+}
+
 static inline void io_wait() {
     outb(0x80, 0);
 }
 
+// CPU Identification and Timing
+static inline void cpuid(uint32_t leaf, uint32_t* eax, uint32_t* ebx,
+                         uint32_t* ecx, uint32_t* edx) {
+    asm volatile("cpuid"
+                 : "=a"(*eax), "=b"(*ebx), "=c"(*ecx), "=d"(*edx)
+                 : "a"(leaf), "c"(0));
+}
+
+static inline uint64_t rdtsc() {
+    uint32_t lo, hi;
+    asm volatile("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+static inline uint64_t rdmsr(uint32_t msr) {
+    uint32_t lo, hi;
+    asm volatile("rdmsr" : "=a"(lo), "=d"(hi) : "c"(msr));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+static inline void wrmsr(uint32_t msr, uint64_t value) {
+    asm volatile("wrmsr" : : "c"(msr), "a"((uint32_t)value),
+                 "d"((uint32_t)(value >> 32)));
+}
+
+// Write back and empty every cache level, for cold-cache measurements
+static inline void wbinvd() {
+    asm volatile("wbinvd" : : : "memory");
+}
+
+#define CPUID_ECX_SSE42 (1 << 20)
+extern uint8_t sse_enabled; // Set by init_sse() at boot
+
 // Memory Operations
 void* memcpy(void* dest, const void* src, uint32_t n);
 void* memset(void* s, int c, uint32_t n);
@@ -35,6 +96,7 @@ char* strcpy(char* dest, const char* src);
 char* strcat(char* dest, const char* src);
 int strcmp(const char* s1, const char* s2);
 char* strstr(const char* haystack, const char* needle);
+void string_benchmark();
 
 // VGA Text Mode
 extern uint8_t vga_cursor_x;
@@ -51,6 +113,7 @@ void vga_scroll();
 extern char keyboard_buffer[KEYBOARD_BUFFER_SIZE];
 extern uint32_t keyboard_buffer_read;
 extern uint32_t keyboard_buffer_write;
+extern uint32_t keyboard_waiter;
 void keyboard_init();
 char keyboard_read_char();
 char* keyboard_read_line(char* buffer, uint32_t max_len);
@@ -69,15 +132,368 @@ void file_read(const char* filename, void* buffer, uint32_t size);
 void file_write(const char* filename, void* data, uint32_t size);
 void file_delete(const char* filename);
 uint32_t file_size(const char* filename);
+uint32_t file_map_sectors(const char* filename, uint32_t* lbas, uint32_t max);
+
+typedef struct {
+    uint8_t type;                // 12, 16 or 32
+    uint8_t sectors_per_cluster;
+    uint8_t fat_count;
+    uint32_t fat_start;
+    uint32_t fat_sectors;
+    uint32_t root_start;         // Fixed root directory (FAT12/16)
+    uint32_t root_sectors;
+    uint32_t root_cluster;       // Root directory chain (FAT32)
+    uint32_t data_start;
+    uint32_t cluster_count;
+    uint32_t last_cluster;
+    uint32_t eoc;                // Entries at or above this end a chain
+} fat_volume_t;
+
+typedef struct {
+    uint32_t allocations;
+    uint32_t fragmented;      // Allocations that could not be contiguous
+    uint32_t sectors_written;
+} fat_stats_t;
+
+extern fat_volume_t fat_volume;
+extern fat_stats_t fat_stats;
+extern uint32_t fat_free_count;
+void fat_init();
+void fat_flush();
+uint32_t* allocate_clusters(uint32_t count);
+uint32_t allocate_contiguous(uint32_t count);
+uint32_t allocate_cluster();
+void fat_free_chain(uint32_t cluster);
+uint32_t fat_contiguous_length(uint32_t cluster);
+uint8_t fat_cluster_valid(uint32_t cluster);
+uint32_t cluster_to_sector(uint32_t cluster);
+uint8_t file_preallocate(const char* filename, uint32_t size);
 uint8_t file_exists(const char* filename);
+void fs_init();
+
+typedef struct {
+    uint32_t lookups;
+    uint32_t compares; // Full name comparisons after a tag match
+} dir_stats_t;
+
+extern dir_stats_t dir_stats;
+void dir_init();
+void convert_to_fat_name(const char* filename, char* fat_name);
+uint32_t find_file_cluster(const char* fat_name);
+uint8_t create_directory_entry(const char* fat_name, uint32_t cluster, uint32_t size);
+uint32_t remove_directory_entry(const char* fat_name);
+void save_prescription_file(uint32_t prescription_id, char* text);
+uint32_t read_fat_entry(uint32_t cluster);
+void write_fat_entry(uint32_t cluster, uint32_t value);
+
+// PCI
+typedef struct {
+    uint8_t bus;
+    uint8_t slot;
+    uint8_t function;
+    uint8_t prog_if;
+    uint16_t vendor_id;
+    uint16_t device_id;
+    uint8_t irq;
+} pci_device_t;
+
+uint32_t pci_read_config(pci_device_t* dev, uint8_t offset);
+void pci_write_config(pci_device_t* dev, uint8_t offset, uint32_t value);
+uint8_t pci_find_class(uint8_t class_code, uint8_t subclass, pci_device_t* dev);
+uint8_t pci_find_device(uint16_t vendor_id, uint16_t device_id, pci_device_t* dev);
+uint32_t pci_bar(pci_device_t* dev, uint8_t index);
+void pci_enable_bus_master(pci_device_t* dev);
+
+// Disk and Block Cache
+#define DISK_MAX_SECTORS 256
+
+typedef struct {
+    uint32_t commands;
+    uint32_t sectors;
+    uint32_t errors;
+    uint32_t max_in_flight; // Deepest command queue seen (AHCI NCQ)
+} disk_stats_t;
+
+#define DISK_BATCH_MAX 32
+
+typedef struct {
+    uint32_t lba;
+    uint32_t count;
+    void* buffer;
+    uint8_t write;
+    uint8_t status; // 1 = completed successfully
+    volatile uint8_t pending;
+    uint8_t tag; // Backend command slot while pending
+} disk_request_t;
+
+// submit_batch, submit and wait are optional; the block layer falls back
+// to synchronous read/write for backends without them
+typedef struct {
+    const char* name;
+    uint8_t (*read)(uint32_t lba, uint32_t count, void* buffer);
+    uint8_t (*write)(uint32_t lba, uint32_t count, const void* buffer);
+    uint8_t (*submit_batch)(disk_request_t* requests, uint32_t count);
+    uint8_t (*submit)(disk_request_t* request);
+    uint8_t (*wait)(disk_request_t* request);
+} disk_backend_t;
+
+extern disk_stats_t disk_stats;
+extern disk_backend_t* disk_backend;
+void disk_init();
+void storage_lock();
+void storage_unlock();
+uint8_t disk_submit_batch(disk_request_t* requests, uint32_t count);
+uint8_t disk_submit(disk_request_t* request);
+uint8_t disk_wait(disk_request_t* request);
+void disk_benchmark();
+disk_backend_t* virtio_blk_init();
+disk_backend_t* ahci_init();
+uint8_t ata_pio_read(uint32_t lba, uint32_t count, void* buffer);
+uint8_t ata_pio_write(uint32_t lba, uint32_t count, const void* buffer);
+disk_backend_t* ide_dma_init();
+void disk_read_sector(uint32_t lba, void* buffer);
+void disk_write_sector(uint32_t lba, void* buffer);
+uint8_t disk_read_sectors(uint32_t lba, uint32_t count, void* buffer);
+uint8_t disk_write_sectors(uint32_t lba, uint32_t count, const void* buffer);
+
+typedef struct {
+    uint32_t hits;
+    uint32_t misses;
+    uint32_t writebacks;
+    uint32_t evictions;
+} bcache_stats_t;
+
+extern bcache_stats_t bcache_stats;
+void bcache_init();
+uint8_t* bcache_get(uint32_t lba);
+uint8_t bcache_read(uint32_t lba, void* buffer);
+uint8_t bcache_write(uint32_t lba, const void* buffer);
+void bcache_mark_dirty(uint32_t lba);
+void bcache_pin(uint32_t lba);
+void bcache_unpin(uint32_t lba);
+void bcache_flush();
+void bcache_flush_range(uint32_t lba, uint32_t count);
+void bcache_invalidate_range(uint32_t lba, uint32_t count);
 
 // Database Functions
+typedef enum {
+    DB_TABLE_PATIENT,
+    DB_TABLE_PRESCRIPTION,
+    DB_TABLE_PRESCRIPTION_ITEM,
+    DB_TABLE_MEDICATION,     // Unused, now built-in master data
+    DB_TABLE_INVENTORY,
+    DB_TABLE_DISPENSE,
+    DB_TABLE_TRANSACTION,
+    DB_TABLE_TRANSACTION_ITEM,
+    DB_TABLE_INSURANCE,
+    DB_TABLE_APPOINTMENT,
+    DB_TABLE_DEPARTMENT,
+    DB_TABLE_SCHEDULE,
+    DB_TABLE_EQUIPMENT_TYPE, // Unused, now built-in master data
+    DB_TABLE_EQUIPMENT_ITEM,
+    DB_TABLE_MAINTENANCE,
+    DB_TABLE_TEXT,
+    DB_TABLE_PATIENT_INDEX,
+    DB_TABLE_COUNT
+} db_table_id_t;
+
+void db_init();
+void* db_register_table(db_table_id_t id, const char* filename, void* fallback,
+                        uint32_t record_size, uint32_t record_count);
+void db_load_table(db_table_id_t id);
+uint32_t db_save_table(db_table_id_t id);
+void db_mark_dirty(db_table_id_t id, const void* record);
+void db_apply_record(db_table_id_t id, uint32_t index, const void* data,
+                     uint32_t length);
+uint8_t db_log_change(db_table_id_t id, const void* record);
+uint8_t db_commit();
+uint8_t db_checkpoint();
+void db_wait_table(db_table_id_t id);
+void db_set_ready_handler(db_table_id_t id, void (*handler)());
+void db_tables_restored();
+void db_set_converter(db_table_id_t id, uint32_t old_size,
+                      uint8_t (*convert)(void* old_record, void* record),
+                      void (*release)(void* record));
+void db_boot_queue();
+void db_loader_task(void* param);
+void db_wait_all();
+uint32_t db_page_count();
+uint8_t* db_page_address(uint32_t page, uint32_t* bytes);
+uint8_t db_snapshot_test_clear(uint32_t page);
+void db_snapshot_mark(uint32_t page);
+void db_mark_page(uint32_t page);
+uint32_t db_snapshot_pending();
+
+typedef struct {
+    uint32_t first_page;
+    uint32_t pages;
+    uint32_t record_size;
+    uint32_t record_count;
+} db_page_layout_t;
+
+void db_page_layout(db_table_id_t id, db_page_layout_t* layout);
+
+// Shadow-page snapshots, kept as deduplicated backup generations
+typedef struct {
+    uint32_t slots_written;
+    uint32_t pages_shared; // Changed pages stored as a reference to a slot
+    uint32_t expired;
+} snap_stats_t;
+
+extern snap_stats_t snap_stats;
+uint8_t snapshot_take();
+uint8_t snapshot_restore(uint32_t generation, uint8_t apply);
+void snapshot_restore_benchmark();
+void snapshot_task(void* param);
+void save_databases();
+
+// Write-ahead log
+typedef struct {
+    uint32_t records;
+    uint32_t commits;
+    uint32_t sectors_written;
+    uint32_t checkpoints;
+} wal_stats_t;
+
+extern wal_stats_t wal_stats;
+uint8_t wal_init();
+uint8_t wal_append(db_table_id_t id, uint32_t index, const void* data,
+                   uint32_t length);
+uint8_t wal_commit();
+uint32_t wal_replay_table(db_table_id_t id);
+uint32_t wal_table_mask();
+void wal_reset();
+
+// Static master data, built into .rodata by tools/mkmaster from
+// master/*.csv. Records are keyed by their first field, the code.
+typedef struct {
+    char code[16];
+    char name[64];
+    char generic_name[64];
+    char manufacturer[64];
+    char drug_class[32];
+    char schedule; // I-V
+    char form[32]; // Tablet, Capsule, Syrup, etc.
+    char strength[32];
+    char unit[16];
+    float unit_price;
+    float wholesale_price;
+    uint16_t min_stock;
+    uint16_t max_stock;
+    uint8_t requires_prescription;
+    char storage_conditions[64];
+    uint32_t shelf_life_days;
+    char barcode[20];
+    char ndc_number[20];
+} medication_master_t;
+
+typedef struct {
+    char provider_code[8];
+    char provider_name[32];
+    float coverage_percentage;
+    float max_coverage_per_year;
+    float used_coverage;
+    uint8_t requires_preauth;
+    char contact[64];
+    char phone[20];
+} insurance_provider_t;
+
+typedef struct {
+    char equipment_code[16];
+    char name[64];
+    char category[32]; // Diagnostic, Therapeutic, Surgical, Monitoring
+    char manufacturer[64];
+    char model[64];
+    char serial_number_format[20];
+    uint16_t expected_life_years;
+    float purchase_price;
+    float current_value;
+    float depreciation_rate;
+    uint8_t requires_calibration;
+    uint16_t calibration_interval_days;
+    uint8_t requires_maintenance;
+    uint16_t maintenance_interval_days;
+    char storage_requirements[64];
+    uint16_t min_quantity;
+    uint16_t max_quantity;
+} equipment_type_t;
+
+// Minimal perfect hash: the code picks a bucket, the bucket's seed picks
+// the record. Unknown codes land on some record, so one compare confirms.
+typedef struct {
+    const void* records;    // In hash order
+    uint32_t record_size;
+    uint32_t count;
+    uint32_t bucket_count;
+    const uint16_t* seeds;  // One per bucket
+    const uint16_t* order;  // Record index of each CSV row, in file order
+} master_index_t;
+
+extern const master_index_t master_medications;
+extern const master_index_t master_insurance;
+extern const master_index_t master_equipment_types;
+uint32_t master_hash(const char* code, uint32_t seed);
+const void* master_lookup(const master_index_t* index, const char* code);
+const void* master_row(const master_index_t* index, uint32_t row);
+const medication_master_t* find_medication(const char* code);
+const insurance_provider_t* find_insurance(const char* code);
+const char* get_insurance_name(uint8_t insurance_type);
+const equipment_type_t* find_equipment_type(const char* code);
+
+// Trigram index for substring search over record slots
+typedef struct {
+    uint32_t queries;
+    uint32_t postings;   // Posting entries visited by queries
+    uint32_t candidates; // Slots handed back for verification
+} trigram_stats_t;
+
+extern trigram_stats_t trigram_stats;
+void trigram_reset();
+void trigram_add(uint32_t slot, const char** fields, uint8_t count);
+void trigram_remove(uint32_t slot, const char** fields, uint8_t count);
+uint32_t trigram_query(const char* term, uint32_t* candidates, uint32_t max);
+
+// Compressed clinical text, referenced from records by a uint32_t
+#define TEXT_MAX 1024 // All text fields of one record, terminators included
+
+typedef struct {
+    uint32_t raw_bytes;    // Written since boot, before compression
+    uint32_t packed_bytes;
+    uint32_t decodes;
+    uint32_t hot_hits;
+} text_stats_t;
+
+extern text_stats_t text_stats;
+uint32_t lz_compress(const uint8_t* src, uint32_t length, uint8_t* dst,
+                     uint32_t capacity);
+uint32_t lz_decompress(const uint8_t* src, uint32_t length, uint8_t* dst,
+                       uint32_t capacity);
+uint32_t text_store(uint32_t old_ref, const char** fields, uint8_t count);
+uint8_t text_field(uint32_t ref, uint8_t field, char* out, uint32_t capacity);
+void text_free(uint32_t ref);
+void load_text_database();
+
 void load_patient_database();
+void patient_index_insert(uint32_t patient_id, uint32_t slot);
+void patient_index_remove(uint32_t patient_id);
+void deactivate_patient(uint32_t patient_id);
+void patient_search_add(uint32_t slot);
+void patient_search_remove(uint32_t slot);
+const char* patient_last_name(uint32_t patient_id);
+void patient_layout_benchmark();
 void save_patient_database();
+void load_prescription_database();
 void load_medication_database();
 void save_medication_database();
+void load_inventory_database();
 void load_transaction_database();
 void save_transaction_database();
+void load_insurance_database();
+void load_appointment_database();
+void load_department_database();
+void load_schedule_database();
+void load_equipment_database();
+void load_maintenance_database();
 
 // Utility Functions
 int atoi(const char* str);
@@ -85,9 +501,48 @@ char* itoa(int value, char* str, int base);
 float string_to_float(const char* str);
 void float_to_string(float value, char* buffer, uint8_t decimals);
 uint16_t calculate_crc16(const void* data, uint32_t length);
+void crc32c_init();
+uint32_t crc32c_update(uint32_t crc, const void* data, uint32_t length);
+uint32_t calculate_crc32c(const void* data, uint32_t length);
+void crc32c_benchmark();
+uint32_t tsc_mhz();
+void boot_timer_start();
+void boot_first_menu();
 void encrypt_data(void* data, uint32_t length, const char* key);
 void decrypt_data(void* data, uint32_t length, const char* key);
 
+// Task Control
+extern uint32_t current_task;
+extern uint8_t scheduler_started; // Until set, drivers poll instead of block
+
+// Ends a cli section; boot code keeps interrupts off until kernel_main
+// enables them with the scheduler
+static inline void irq_enable() {
+    if(scheduler_started) asm volatile("sti");
+}
+void task_block();
+void task_wake(uint32_t task_id);
+void* kmalloc(uint32_t size, const char* owner);
+void task_sleep(uint32_t ticks);
+void task_exit();
+
+// IPC
+typedef enum {
+    MODULE_KERNEL = 0,
+    MODULE_DOCTOR,
+    MODULE_MEDICATION,
+    MODULE_CASHIER,
+    MODULE_RECEPTION,
+    MODULE_WAREHOUSE
+} module_id_t;
+
+// Work handed from a module's service task to its menu loop
+uint8_t ipc_take_work(module_id_t module, uint32_t* id);
+char ipc_menu_key(module_id_t module);
+typedef struct interrupt_frame interrupt_frame_t;
+typedef void (*isr_handler_t)(interrupt_frame_t*);
+void register_irq_handler(uint8_t irq, isr_handler_t handler);
+
 // System Functions
 void delay(uint32_t milliseconds);
 void beep(uint32_t frequency, uint32_t duration);
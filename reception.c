@@ -16,11 +16,29 @@ typedef struct {
     uint32_t checkin_time;
     uint32_t start_time;
     uint32_t end_time;
-    char notes[128];
+    uint32_t notes_ref; // Compressed in the clinical text store
     uint8_t new_patient;
     float consultation_fee;
 } appointment_t;
 
+// Layout before the notes moved to the text store; converted on load
+typedef struct {
+    uint32_t appointment_id;
+    uint32_t patient_id;
+    uint32_t doctor_id;
+    uint32_t date_time;
+    char department[32];
+    char reason[64];
+    uint8_t urgency;
+    char status[16];
+    uint32_t checkin_time;
+    uint32_t start_time;
+    uint32_t end_time;
+    char notes[128];
+    uint8_t new_patient;
+    float consultation_fee;
+} appointment_v1_t;
+
 typedef struct {
     char department_code[8];
     char department_name[32];
@@ -51,9 +69,12 @@ typedef struct {
 } receptionist_session_t;
 
 // Databases
-appointment_t appointment_db[MAX_APPOINTMENTS];
-department_t department_db[MAX_DEPARTMENTS];
-doctor_schedule_t schedule_db[MAX_DOCTOR_SCHEDULES];
+appointment_t appointment_db_store[MAX_APPOINTMENTS];
+appointment_t* appointment_db = appointment_db_store;
+department_t department_db_store[MAX_DEPARTMENTS];
+department_t* department_db = department_db_store;
+doctor_schedule_t schedule_db_store[MAX_DOCTOR_SCHEDULES];
+doctor_schedule_t* schedule_db = schedule_db_store;
 receptionist_session_t current_receptionist;
 
 // Queue management
@@ -62,6 +83,70 @@ uint32_t queue_front = 0;
 uint32_t queue_rear = 0;
 uint32_t queue_size = 0;
 
+// Table files
+static uint8_t appointment_convert(void* old_record, void* record) {
+    appointment_v1_t* old = (appointment_v1_t*)old_record;
+    appointment_t* appt = (appointment_t*)record;
+    
+    appt->appointment_id = old->appointment_id;
+    appt->patient_id = old->patient_id;
+    appt->doctor_id = old->doctor_id;
+    appt->date_time = old->date_time;
+    memcpy(appt->department, old->department, sizeof(appt->department));
+    memcpy(appt->reason, old->reason, sizeof(appt->reason));
+    appt->urgency = old->urgency;
+    memcpy(appt->status, old->status, sizeof(appt->status));
+    appt->checkin_time = old->checkin_time;
+    appt->start_time = old->start_time;
+    appt->end_time = old->end_time;
+    appt->new_patient = old->new_patient;
+    appt->consultation_fee = old->consultation_fee;
+    
+    old->notes[sizeof(old->notes) - 1] = 0;
+    if(old->notes[0]) {
+        const char* text[1] = { old->notes };
+        uint32_t ref = text_store(appt->notes_ref, text, 1);
+        if(ref == appt->notes_ref) return 0; // Store full
+        appt->notes_ref = ref;
+    } else {
+        text_free(appt->notes_ref);
+        appt->notes_ref = 0;
+    }
+    return 1;
+}
+
+static void appointment_release(void* record) {
+    appointment_t* appt = (appointment_t*)record;
+    text_free(appt->notes_ref);
+    appt->notes_ref = 0;
+}
+
+// The text store is loaded first: converting an old file stores into it
+void load_appointment_database() {
+    load_text_database();
+    appointment_db = db_register_table(DB_TABLE_APPOINTMENT, "APPOINTM.DAT",
+                                       appointment_db_store,
+                                       sizeof(appointment_t), MAX_APPOINTMENTS);
+    db_set_converter(DB_TABLE_APPOINTMENT, sizeof(appointment_v1_t),
+                     appointment_convert, appointment_release);
+    db_load_table(DB_TABLE_APPOINTMENT);
+}
+
+void load_department_database() {
+    department_db = db_register_table(DB_TABLE_DEPARTMENT, "DEPARTMT.DAT",
+                                      department_db_store, sizeof(department_t),
+                                      MAX_DEPARTMENTS);
+    db_load_table(DB_TABLE_DEPARTMENT);
+}
+
+void load_schedule_database() {
+    schedule_db = db_register_table(DB_TABLE_SCHEDULE, "SCHEDULE.DAT",
+                                    schedule_db_store,
+                                    sizeof(doctor_schedule_t),
+                                    MAX_DOCTOR_SCHEDULES);
+    db_load_table(DB_TABLE_SCHEDULE);
+}
+
 void new_patient_registration() {
     clear_screen();
     print_header("NEW PATIENT REGISTRATION");
@@ -85,6 +170,7 @@ void new_patient_registration() {
     patient->registration_date = get_system_time();
     patient->last_visit = patient->registration_date;
     patient->active = 1;
+    patient_index_insert(patient->patient_id, patient_index);
     
     print("New Patient ID: %d\n\n", patient->patient_id);
     
@@ -141,6 +227,8 @@ void new_patient_registration() {
     
     // Assign to a department (default: General Medicine)
     strcpy(patient->department_assigned, "GENERAL");
+    db_mark_dirty(DB_TABLE_PATIENT, patient);
+    patient_search_add(patient_index);
     
     // Print registration card
     print_registration_card(patient);
@@ -278,9 +366,13 @@ void schedule_appointment() {
     strcpy(appt->status, "SCHEDULED");
     appt->new_patient = is_new_patient(patient_id);
     appt->consultation_fee = calculate_consultation_fee(doctor_id, appt->new_patient);
+    text_free(appt->notes_ref); // Left over from the slot's last appointment
+    appt->notes_ref = 0;
     
     // Update department count
     dept->current_patients_today++;
+    db_mark_dirty(DB_TABLE_APPOINTMENT, appt);
+    db_mark_dirty(DB_TABLE_DEPARTMENT, dept);
     
     // Print appointment slip
     print_appointment_slip(appt);
@@ -351,6 +443,7 @@ void checkin_by_appointment() {
     if(confirm == 'Y' || confirm == 'y') {
         appt->checkin_time = get_system_time();
         strcpy(appt->status, "CHECKED-IN");
+        db_mark_dirty(DB_TABLE_APPOINTMENT, appt);
         
         // Add to queue
         add_to_queue(patient->patient_id);
@@ -379,14 +472,14 @@ void queue_management() {
         for(uint32_t i = 0; i < queue_size; i++) {
             uint32_t idx = (queue_front + i) % 100;
             uint32_t patient_id = waiting_queue[idx];
-            patient_record_t* patient = find_patient(patient_id);
+            const char* last_name = patient_last_name(patient_id);
             
-            if(patient) {
+            if(last_name) {
                 appointment_t* appt = find_appointment_by_patient_today(patient_id);
                 
                 print("%3d. %-20s ID: %d", 
                       i+1, 
-                      patient->last_name,
+                      last_name,
                       patient_id);
                 
                 if(appt) {
@@ -453,6 +546,7 @@ void call_next_patient() {
         // Update appointment status
         appt->start_time = get_system_time();
         strcpy(appt->status, "IN-PROGRESS");
+        db_mark_dirty(DB_TABLE_APPOINTMENT, appt);
     }
     
     // Remove from queue
@@ -486,6 +580,7 @@ void reception_main() {
     while(1) {
         clear_screen();
         print_header("RECEPTION SYSTEM");
+        boot_first_menu();
         
         print_time_date();
         print_queue_status();
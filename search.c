@@ -0,0 +1,196 @@
+#include "pos_system.h"
+
+// Trigram inverted index for substring search. Every three-byte window of
+// an indexed field is hashed to a bucket whose posting list holds the
+// record slots containing it. A term can only occur in records found in
+// the posting list of each of its trigrams, so a query intersects those
+// lists and the caller verifies just the survivors. Hash collisions only
+// add candidates, never lose them.
+#define TRIGRAM_BUCKETS 4096
+#define TRIGRAM_BUCKET_BITS 12
+#define TRIGRAM_MAX_SLOTS 1024   // Record slots, must cover MAX_PATIENTS
+#define TRIGRAM_CHUNKS 8192
+#define TRIGRAM_CHUNK_SLOTS 14   // Fills a 64-byte chunk
+#define TRIGRAM_MAX_TERMS 128    // Distinct trigrams per record or query
+#define TRIGRAM_NONE 0xFFFFFFFF
+
+// Posting lists are chains of chunks; only the head chunk is partly full
+typedef struct {
+    uint32_t next;
+    uint16_t count;
+    uint16_t reserved;
+    uint32_t slots[TRIGRAM_CHUNK_SLOTS];
+} trigram_chunk_t;
+
+trigram_chunk_t trigram_chunks[TRIGRAM_CHUNKS];
+uint32_t trigram_heads[TRIGRAM_BUCKETS];
+uint32_t trigram_lengths[TRIGRAM_BUCKETS];
+uint32_t trigram_free = TRIGRAM_NONE;
+uint32_t trigram_unused = 0;  // Chunks never handed out start here
+uint8_t trigram_valid = 0;     // Built and never overflowed
+
+// Intersection state: a slot survives list n if it survived list n - 1
+uint32_t trigram_marks[TRIGRAM_MAX_SLOTS];
+uint32_t trigram_query_serial = 0;
+trigram_stats_t trigram_stats;
+
+static uint32_t trigram_bucket(const uint8_t* p) {
+    uint32_t value = (p[0] << 16) | (p[1] << 8) | p[2];
+    return (value * 2654435761u) >> (32 - TRIGRAM_BUCKET_BITS);
+}
+
+// Distinct buckets of every trigram in the fields
+static uint32_t collect_buckets(const char** fields, uint8_t count,
+                                uint16_t* buckets) {
+    uint32_t n = 0;
+    for(uint8_t f = 0; f < count; f++) {
+        const uint8_t* text = (const uint8_t*)fields[f];
+        uint32_t length = strlen(fields[f]);
+        for(uint32_t i = 0; i + 3 <= length; i++) {
+            uint16_t bucket = trigram_bucket(text + i);
+            uint32_t j = 0;
+            while(j < n && buckets[j] != bucket) j++;
+            if(j == n && n < TRIGRAM_MAX_TERMS) buckets[n++] = bucket;
+        }
+    }
+    return n;
+}
+
+static uint32_t alloc_chunk() {
+    uint32_t chunk;
+    if(trigram_free != TRIGRAM_NONE) {
+        chunk = trigram_free;
+        trigram_free = trigram_chunks[chunk].next;
+    } else if(trigram_unused < TRIGRAM_CHUNKS) {
+        chunk = trigram_unused++;
+    } else {
+        return TRIGRAM_NONE;
+    }
+    trigram_chunks[chunk].count = 0;
+    return chunk;
+}
+
+void trigram_reset() {
+    for(uint32_t i = 0; i < TRIGRAM_BUCKETS; i++) {
+        trigram_heads[i] = TRIGRAM_NONE;
+        trigram_lengths[i] = 0;
+    }
+    trigram_free = TRIGRAM_NONE;
+    trigram_unused = 0;
+    trigram_valid = 1;
+}
+
+void trigram_add(uint32_t slot, const char** fields, uint8_t count) {
+    if(!trigram_valid) return;
+    
+    uint16_t buckets[TRIGRAM_MAX_TERMS];
+    uint32_t n = collect_buckets(fields, count, buckets);
+    
+    for(uint32_t i = 0; i < n; i++) {
+        uint32_t head = trigram_heads[buckets[i]];
+        if(head == TRIGRAM_NONE ||
+           trigram_chunks[head].count == TRIGRAM_CHUNK_SLOTS) {
+            uint32_t chunk = alloc_chunk();
+            if(chunk == TRIGRAM_NONE) {
+                // Queries would miss this record; callers fall back to a
+                // full scan until the index is rebuilt
+                log_error("Search", "Trigram index full");
+                trigram_valid = 0;
+                return;
+            }
+            trigram_chunks[chunk].next = head;
+            trigram_heads[buckets[i]] = chunk;
+            head = chunk;
+        }
+        trigram_chunk_t* chunk = &trigram_chunks[head];
+        chunk->slots[chunk->count++] = slot;
+        trigram_lengths[buckets[i]]++;
+    }
+}
+
+// Must be given the same field values the record was added with
+void trigram_remove(uint32_t slot, const char** fields, uint8_t count) {
+    if(!trigram_valid) return;
+    
+    uint16_t buckets[TRIGRAM_MAX_TERMS];
+    uint32_t n = collect_buckets(fields, count, buckets);
+    
+    for(uint32_t i = 0; i < n; i++) {
+        uint32_t head = trigram_heads[buckets[i]];
+        for(uint32_t c = head; c != TRIGRAM_NONE; c = trigram_chunks[c].next) {
+            trigram_chunk_t* chunk = &trigram_chunks[c];
+            uint32_t k = 0;
+            while(k < chunk->count && chunk->slots[k] != slot) k++;
+            if(k == chunk->count) continue;
+            
+            // Fill the hole from the head so only the head is partial
+            trigram_chunk_t* first = &trigram_chunks[head];
+            chunk->slots[k] = first->slots[--first->count];
+            trigram_lengths[buckets[i]]--;
+            if(first->count == 0) {
+                trigram_heads[buckets[i]] = first->next;
+                first->next = trigram_free;
+                trigram_free = head;
+            }
+            break;
+        }
+    }
+}
+
+// Candidate slots for records that may contain term, in slot order; max
+// should cover every slot. Returns TRIGRAM_NONE when the index cannot
+// narrow the search (term shorter than a trigram, index not built or
+// overflowed) and the caller must scan.
+uint32_t trigram_query(const char* term, uint32_t* candidates, uint32_t max) {
+    if(strlen(term) < 3 || !trigram_valid) return TRIGRAM_NONE;
+    
+    uint16_t buckets[TRIGRAM_MAX_TERMS];
+    uint32_t n = collect_buckets(&term, 1, buckets);
+    
+    // Shortest lists first keeps the surviving set small
+    for(uint32_t i = 1; i < n; i++) {
+        uint16_t bucket = buckets[i];
+        uint32_t j = i;
+        while(j > 0 &&
+              trigram_lengths[buckets[j - 1]] > trigram_lengths[bucket]) {
+            buckets[j] = buckets[j - 1];
+            j--;
+        }
+        buckets[j] = bucket;
+    }
+    
+    // Marks carry the query serial in the high bits and the number of
+    // lists survived in the low byte, so they never need clearing
+    trigram_query_serial = (trigram_query_serial + 1) & 0xFFFFFF;
+    if(trigram_query_serial == 0) {
+        memset(trigram_marks, 0, sizeof(trigram_marks));
+        trigram_query_serial = 1;
+    }
+    uint32_t serial = trigram_query_serial << 8;
+    uint32_t found = 0;
+    trigram_stats.queries++;
+    
+    for(uint32_t i = 0; i < n; i++) {
+        for(uint32_t c = trigram_heads[buckets[i]]; c != TRIGRAM_NONE;
+            c = trigram_chunks[c].next) {
+            trigram_chunk_t* chunk = &trigram_chunks[c];
+            for(uint32_t k = 0; k < chunk->count; k++) {
+                uint32_t slot = chunk->slots[k];
+                if(slot >= TRIGRAM_MAX_SLOTS) continue;
+                
+                if(i > 0 && trigram_marks[slot] != (serial | i)) continue;
+                trigram_marks[slot] = serial | (i + 1);
+                trigram_stats.postings++;
+            }
+        }
+    }
+    
+    // Survivors of every list, collected by slot rather than in posting
+    // order so callers can stop at a limit without losing earlier records
+    for(uint32_t slot = 0; slot < TRIGRAM_MAX_SLOTS && found < max; slot++) {
+        if(trigram_marks[slot] == (serial | n)) candidates[found++] = slot;
+    }
+    
+    trigram_stats.candidates += found;
+    return found;
+}
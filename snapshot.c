@@ -0,0 +1,748 @@
+#include "pos_system.h"
+
+// Shadow-page snapshots of every table page, kept as a short history of
+// deduplicated incremental backups. Each generation is a root sector plus
+// a page map; pages point at content-addressed 4KB slots shared by every
+// page and generation with the same contents. A new generation writes
+// only slots for contents no retained generation has, writes its map to a
+// map area no live root uses, and commits when its root sector is written.
+#define SNAP_FILENAME "SNAPSHOT.DB"
+#define SNAP_MAGIC 0x50414E53 // "SNAP"
+#define SNAP_PAGE_SIZE 4096
+#define SNAP_PAGE_SECTORS (SNAP_PAGE_SIZE / 512)
+#define SNAP_MAX_PAGES 16384
+#define SNAP_MAX_SLOTS (SNAP_MAX_PAGES * 2)
+#define SNAP_INDEX_SIZE (SNAP_MAX_SLOTS * 2) // Power of two, load <= 0.5
+#define SNAP_SPARE_PAGES 256 // Map room for tables added later
+#define SNAP_MAX_TABLES 24   // Table slots in a root, fixed on disk
+
+// [Backup] in config.ini: BackupInterval and KeepBackups. The FAT layer
+// only has a root directory, so BackupPath is not used.
+#define SNAP_INTERVAL_SECONDS 3600
+#define SNAP_KEEP 7
+
+// Pages still changing after this many copy rounds are taken together
+// with interrupts off, through a staging area of this many pages
+#define SNAP_MAX_ROUNDS 8
+#define SNAP_STAGE_PAGES 32
+
+typedef struct {
+    uint32_t checksum; // CRC32C of the rest of the root
+    uint32_t magic;
+    uint32_t generation;
+    uint32_t map;        // Map area holding this generation's pages
+    uint32_t map_pages;  // Map area size, fixed for the file
+    uint32_t slot_count; // Also fixed for the file
+    uint32_t page_count; // Pages in this generation's map
+    uint32_t pages_written;
+    uint32_t table_count;
+    db_page_layout_t tables[SNAP_MAX_TABLES]; // By table id, when taken
+} snap_root_t;
+
+// Slots are numbered from 1; 0 means the page has never been captured
+typedef struct {
+    uint32_t slot;
+    uint32_t crc;
+} snap_entry_t;
+
+typedef struct {
+    uint8_t valid;
+    uint32_t generation;
+    uint32_t page_count;
+    db_page_layout_t tables[SNAP_MAX_TABLES];
+} snap_generation_t;
+
+snap_entry_t snap_map[SNAP_MAX_PAGES];  // Newest committed generation
+snap_entry_t snap_next[SNAP_MAX_PAGES] __attribute__((aligned(512)));
+snap_generation_t snap_generations[SNAP_KEEP]; // By root and map area
+db_page_layout_t snap_tables[SNAP_MAX_TABLES]; // Current page layout
+uint32_t snap_next_tables = 0; // Table ids load_map() brought into snap_next
+
+// Slot bookkeeping: references from all retained maps, content CRC, and
+// an open-addressed CRC -> slot index over every slot holding data
+uint32_t snap_refs[SNAP_MAX_SLOTS + 1];
+uint32_t snap_slot_crc[SNAP_MAX_SLOTS + 1];
+uint32_t snap_slot_busy[(SNAP_MAX_SLOTS + 1 + 31) / 32]; // Taken this round
+uint16_t snap_index[SNAP_INDEX_SIZE];
+
+uint8_t snap_bounce[SNAP_PAGE_SIZE] __attribute__((aligned(512)));
+uint8_t snap_verify[SNAP_PAGE_SIZE] __attribute__((aligned(512)));
+uint32_t snap_verified_slot = 0; // Slot whose contents are in snap_verify
+uint8_t* snap_stage = NULL;
+
+uint32_t snap_lba = 0;      // File start; the file is one contiguous run
+uint32_t snap_pages = 0;
+uint32_t snap_map_pages = 0;
+uint32_t snap_slots = 0;
+uint32_t snap_map_sectors = 0;
+uint32_t snap_generation = 0; // Newest committed generation
+uint32_t snap_hand = 1;
+uint8_t snap_ready = 0;
+uint8_t snap_busy = 0;        // A snapshot or restore owns the buffers
+snap_stats_t snap_stats;
+
+// File layout: SNAP_KEEP roots, SNAP_KEEP map areas, slots
+static uint32_t map_lba(uint32_t map) {
+    return snap_lba + SNAP_KEEP + map * snap_map_sectors;
+}
+
+static uint32_t slot_lba(uint32_t slot) {
+    return snap_lba + SNAP_KEEP + SNAP_KEEP * snap_map_sectors +
+           (slot - 1) * SNAP_PAGE_SECTORS;
+}
+
+static uint32_t root_crc(snap_root_t* root) {
+    return calculate_crc32c(&root->magic, sizeof(snap_root_t) - sizeof(uint32_t));
+}
+
+static uint32_t page_crc(const uint8_t* data) {
+    return calculate_crc32c(data, SNAP_PAGE_SIZE);
+}
+
+// Slots, maps and roots go straight to disk, so any cached copy of those
+// sectors is dropped first as wal_io() does
+static uint8_t write_sectors(uint32_t lba, uint32_t count, const void* data) {
+    storage_lock();
+    bcache_invalidate_range(lba, count);
+    uint8_t ok = disk_write_sectors(lba, count, data);
+    storage_unlock();
+    return ok;
+}
+
+static uint8_t slot_busy(uint32_t slot) {
+    return (snap_slot_busy[slot / 32] >> (slot % 32)) & 1;
+}
+
+static uint8_t acquire() {
+    asm volatile("cli");
+    uint8_t ok = !snap_busy;
+    snap_busy = 1;
+    asm volatile("sti");
+    return ok;
+}
+
+// Index of every slot that holds data: referenced by a retained map or
+// written by the generation being built
+static void rebuild_index() {
+    memset(snap_index, 0, sizeof(snap_index));
+    for(uint32_t slot = 1; slot <= snap_slots; slot++) {
+        if(snap_refs[slot] == 0 && !slot_busy(slot)) continue;
+        
+        uint32_t i = snap_slot_crc[slot] & (SNAP_INDEX_SIZE - 1);
+        while(snap_index[i] != 0) i = (i + 1) & (SNAP_INDEX_SIZE - 1);
+        snap_index[i] = slot;
+    }
+}
+
+static void index_insert(uint32_t slot) {
+    uint32_t i = snap_slot_crc[slot] & (SNAP_INDEX_SIZE - 1);
+    while(snap_index[i] != 0) i = (i + 1) & (SNAP_INDEX_SIZE - 1);
+    snap_index[i] = slot;
+}
+
+// A slot with the same contents, confirmed byte for byte since CRCs can
+// collide; the last slot read stays cached, which covers runs of
+// identical pages such as empty ones
+static uint32_t find_duplicate(const uint8_t* buffer, uint32_t crc) {
+    uint32_t i = crc & (SNAP_INDEX_SIZE - 1);
+    while(snap_index[i] != 0) {
+        uint32_t slot = snap_index[i];
+        uint8_t live = snap_refs[slot] != 0 || slot_busy(slot);
+        if(live && snap_slot_crc[slot] == crc) {
+            if(snap_verified_slot != slot) {
+                if(!disk_read_sectors(slot_lba(slot), SNAP_PAGE_SECTORS,
+                                      snap_verify)) {
+                    return 0;
+                }
+                snap_verified_slot = slot;
+            }
+            if(memcmp(snap_verify, buffer, SNAP_PAGE_SIZE) == 0) return slot;
+        }
+        i = (i + 1) & (SNAP_INDEX_SIZE - 1);
+    }
+    return 0;
+}
+
+// Add delta to the reference count of every slot a generation's map
+// uses. The map is streamed through snap_verify, so a snapshot being
+// built in snap_next is left alone.
+static uint8_t count_map(uint32_t map, int32_t delta) {
+    snap_entry_t* entries = (snap_entry_t*)snap_verify;
+    uint32_t per_read = SNAP_PAGE_SIZE / sizeof(snap_entry_t);
+    uint32_t pages = snap_generations[map].page_count;
+    snap_verified_slot = 0;
+    
+    for(uint32_t first = 0; first < pages; first += per_read) {
+        uint32_t count = pages - first < per_read ? pages - first : per_read;
+        uint32_t sectors = (count * sizeof(snap_entry_t) + 511) / 512;
+        if(!disk_read_sectors(map_lba(map) + first * sizeof(snap_entry_t) / 512,
+                              sectors, entries)) {
+            return 0;
+        }
+        
+        for(uint32_t i = 0; i < count; i++) {
+            uint32_t slot = entries[i].slot;
+            if(slot == 0 || slot > snap_slots) continue;
+            snap_refs[slot] += delta;
+            snap_slot_crc[slot] = entries[i].crc;
+        }
+    }
+    return 1;
+}
+
+// A table's pages carry over from a generation only if it was laid out
+// the same way then; tables added or resized since are not in it
+static uint8_t table_matches(uint32_t map, uint32_t id) {
+    db_page_layout_t* old = &snap_generations[map].tables[id];
+    db_page_layout_t* now = &snap_tables[id];
+    return now->pages != 0 && old->pages == now->pages &&
+           old->record_size == now->record_size &&
+           old->record_count == now->record_count;
+}
+
+// Read a generation's map into snap_next in the current page numbering,
+// streamed through snap_verify; pages of tables it does not match are
+// left empty and the tables it does are recorded in snap_next_tables
+static uint8_t load_map(uint32_t map) {
+    snap_generation_t* gen = &snap_generations[map];
+    snap_entry_t* entries = (snap_entry_t*)snap_verify;
+    uint32_t per_read = SNAP_PAGE_SIZE / sizeof(snap_entry_t);
+    snap_verified_slot = 0;
+    
+    memset(snap_next, 0, snap_map_pages * sizeof(snap_entry_t));
+    snap_next_tables = 0;
+    for(uint32_t id = 0; id < DB_TABLE_COUNT; id++) {
+        if(table_matches(map, id)) snap_next_tables |= 1u << id;
+    }
+    
+    for(uint32_t first = 0; first < gen->page_count; first += per_read) {
+        uint32_t count = gen->page_count - first < per_read
+                         ? gen->page_count - first : per_read;
+        uint32_t sectors = (count * sizeof(snap_entry_t) + 511) / 512;
+        if(!disk_read_sectors(map_lba(map) + first * sizeof(snap_entry_t) / 512,
+                              sectors, entries)) {
+            return 0;
+        }
+        
+        for(uint32_t id = 0; id < DB_TABLE_COUNT; id++) {
+            if(!(snap_next_tables & (1u << id))) continue;
+            
+            db_page_layout_t* old = &gen->tables[id];
+            for(uint32_t i = 0; i < count; i++) {
+                uint32_t page = first + i;
+                if(page < old->first_page ||
+                   page >= old->first_page + old->pages) {
+                    continue;
+                }
+                snap_next[snap_tables[id].first_page + page - old->first_page] =
+                    entries[i];
+            }
+        }
+    }
+    return 1;
+}
+
+// Drop the oldest generation other than the newest. Its root is
+// invalidated first so a crash can never leave a root pointing at reused
+// slots; freeing is then only reference counting, no data is touched.
+static uint8_t expire_oldest() {
+    int32_t oldest = -1;
+    for(uint32_t i = 0; i < SNAP_KEEP; i++) {
+        if(!snap_generations[i].valid ||
+           snap_generations[i].generation == snap_generation) {
+            continue;
+        }
+        if(oldest < 0 || snap_generations[i].generation <
+                         snap_generations[oldest].generation) {
+            oldest = i;
+        }
+    }
+    if(oldest < 0) return 0;
+    
+    uint8_t sector[512];
+    memset(sector, 0, sizeof(sector));
+    if(!write_sectors(snap_lba + oldest, 1, sector)) return 0;
+    snap_generations[oldest].valid = 0;
+    count_map(oldest, -1);
+    
+    snap_stats.expired++;
+    log_activity("Snapshot", "Generation %d expired",
+                 snap_generations[oldest].generation);
+    return 1;
+}
+
+// Next-fit over free slots; when there are none, older generations are
+// given up one at a time before the snapshot fails
+static uint32_t alloc_slot() {
+    while(1) {
+        for(uint32_t scanned = 0; scanned < snap_slots; scanned++) {
+            uint32_t slot = snap_hand;
+            snap_hand = snap_hand % snap_slots + 1;
+            
+            if(snap_refs[slot] == 0 && !slot_busy(slot)) {
+                snap_slot_busy[slot / 32] |= 1u << (slot % 32);
+                return slot;
+            }
+        }
+        if(!expire_oldest()) return 0;
+    }
+}
+
+// Copy one page out of its table, zero-padding a partial last page
+static void capture_page(uint32_t page, uint8_t* buffer) {
+    uint32_t bytes;
+    uint8_t* data = db_page_address(page, &bytes);
+    memcpy(buffer, data, bytes);
+    if(bytes < SNAP_PAGE_SIZE) memset(buffer + bytes, 0, SNAP_PAGE_SIZE - bytes);
+}
+
+// Put a captured page in the generation being built: unchanged pages keep
+// their slot, known contents share an existing one, anything else gets a
+// fresh slot
+static uint8_t store_page(uint32_t page, const uint8_t* buffer) {
+    uint32_t crc = page_crc(buffer);
+    if(snap_map[page].slot != 0 && snap_map[page].crc == crc) {
+        snap_next[page] = snap_map[page];
+        return 1;
+    }
+    
+    // Shared slots are held like new ones, so expiring an old generation
+    // part way through cannot free them
+    uint32_t slot = find_duplicate(buffer, crc);
+    if(slot != 0) {
+        snap_slot_busy[slot / 32] |= 1u << (slot % 32);
+        snap_stats.pages_shared++;
+    } else {
+        slot = alloc_slot();
+        if(slot == 0) return 0;
+        if(!write_sectors(slot_lba(slot), SNAP_PAGE_SECTORS, buffer)) {
+            return 0;
+        }
+        if(slot == snap_verified_slot) snap_verified_slot = 0;
+        snap_slot_crc[slot] = crc;
+        index_insert(slot);
+        snap_stats.slots_written++;
+    }
+    
+    snap_next[page].slot = slot;
+    snap_next[page].crc = crc;
+    return 1;
+}
+
+// One pass over the pages marked since they were last taken; modules keep
+// running, so pages may be marked again behind it
+static int32_t copy_round() {
+    int32_t taken = 0;
+    
+    for(uint32_t page = 0; page < snap_pages; page++) {
+        asm volatile("cli");
+        if(!db_snapshot_test_clear(page)) {
+            asm volatile("sti");
+            continue;
+        }
+        capture_page(page, snap_bounce);
+        asm volatile("sti");
+        
+        if(!store_page(page, snap_bounce)) {
+            db_snapshot_mark(page);
+            return -1;
+        }
+        taken++;
+    }
+    return taken;
+}
+
+// Take the last few changed pages at one instant; 0 if there were more
+// than the staging area holds
+static int32_t final_round() {
+    uint32_t pages[SNAP_STAGE_PAGES];
+    uint32_t count = 0;
+    
+    asm volatile("cli");
+    if(db_snapshot_pending() > SNAP_STAGE_PAGES) {
+        asm volatile("sti");
+        return 0;
+    }
+    for(uint32_t page = 0; page < snap_pages; page++) {
+        if(db_snapshot_test_clear(page)) {
+            capture_page(page, snap_stage + count * SNAP_PAGE_SIZE);
+            pages[count++] = page;
+        }
+    }
+    asm volatile("sti");
+    
+    for(uint32_t i = 0; i < count; i++) {
+        if(!store_page(pages[i], snap_stage + i * SNAP_PAGE_SIZE)) {
+            for(uint32_t j = i; j < count; j++) db_snapshot_mark(pages[j]);
+            return -1;
+        }
+    }
+    return count + 1;
+}
+
+// Write the map to a free area, then the root; the generation exists once
+// the root sector is on disk
+static uint8_t commit(uint32_t pages_taken) {
+    int32_t area = -1;
+    for(uint32_t i = 0; i < SNAP_KEEP && area < 0; i++) {
+        if(!snap_generations[i].valid) area = i;
+    }
+    if(area < 0) {
+        if(!expire_oldest()) return 0;
+        for(uint32_t i = 0; i < SNAP_KEEP && area < 0; i++) {
+            if(!snap_generations[i].valid) area = i;
+        }
+    }
+    
+    if(!write_sectors(map_lba(area), snap_map_sectors, snap_next)) return 0;
+    
+    uint8_t sector[512];
+    memset(sector, 0, sizeof(sector));
+    snap_root_t* root = (snap_root_t*)sector;
+    root->magic = SNAP_MAGIC;
+    root->generation = snap_generation + 1;
+    root->map = area;
+    root->map_pages = snap_map_pages;
+    root->slot_count = snap_slots;
+    root->page_count = snap_pages;
+    root->pages_written = pages_taken;
+    root->table_count = DB_TABLE_COUNT;
+    memcpy(root->tables, snap_tables, sizeof(snap_tables));
+    root->checksum = root_crc(root);
+    if(!write_sectors(snap_lba + area, 1, sector)) return 0;
+    
+    snap_generation++;
+    snap_generations[area].valid = 1;
+    snap_generations[area].generation = snap_generation;
+    snap_generations[area].page_count = snap_pages;
+    memcpy(snap_generations[area].tables, snap_tables, sizeof(snap_tables));
+    
+    for(uint32_t page = 0; page < snap_pages; page++) {
+        if(snap_next[page].slot != 0) snap_refs[snap_next[page].slot]++;
+    }
+    memcpy(snap_map, snap_next, snap_pages * sizeof(snap_entry_t));
+    return 1;
+}
+
+static uint8_t root_valid(snap_root_t* root, uint32_t area) {
+    return root->magic == SNAP_MAGIC && root->checksum == root_crc(root) &&
+           root->map == area && root->page_count <= root->map_pages &&
+           root->map_pages <= SNAP_MAX_PAGES &&
+           root->slot_count <= SNAP_MAX_SLOTS &&
+           root->table_count <= SNAP_MAX_TABLES;
+}
+
+// The map areas and slots stay where the newest generation put them
+// while the tables still fit, so adding a table keeps the history;
+// otherwise the file is laid out again with room to spare
+static void choose_geometry() {
+    uint32_t newest = 0;
+    snap_map_pages = 0;
+    snap_slots = 0;
+    
+    snap_root_t* root = (snap_root_t*)snap_bounce;
+    if(file_map_sectors(SNAP_FILENAME, &snap_lba, 1) == 1) {
+        for(uint32_t i = 0; i < SNAP_KEEP; i++) {
+            if(!disk_read_sectors(snap_lba + i, 1, snap_bounce) ||
+               !root_valid(root, i) || root->generation <= newest) {
+                continue;
+            }
+            newest = root->generation;
+            snap_map_pages = root->map_pages;
+            snap_slots = root->slot_count;
+        }
+    }
+    
+    if(snap_map_pages >= snap_pages && snap_slots >= snap_pages * 2) return;
+    if(newest != 0) {
+        log_activity("Snapshot", "Tables outgrew %s, older generations dropped",
+                     SNAP_FILENAME);
+    }
+    snap_map_pages = snap_pages + SNAP_SPARE_PAGES;
+    if(snap_map_pages > SNAP_MAX_PAGES) snap_map_pages = SNAP_MAX_PAGES;
+    snap_slots = snap_map_pages * 2; // Room for a full rewrite beside the rest
+}
+
+// Rebuild slot references from every valid root, then compare the newest
+// generation with the tables; only pages that differ are marked
+static uint8_t snapshot_mount() {
+    snap_pages = db_page_count();
+    if(snap_pages == 0 || snap_pages > SNAP_MAX_PAGES ||
+       DB_TABLE_COUNT > SNAP_MAX_TABLES) {
+        log_error("Snapshot", "%d table pages, cannot snapshot", snap_pages);
+        return 0;
+    }
+    memset(snap_tables, 0, sizeof(snap_tables));
+    for(uint32_t id = 0; id < DB_TABLE_COUNT; id++) {
+        db_page_layout(id, &snap_tables[id]);
+    }
+    
+    choose_geometry();
+    snap_map_sectors = (snap_map_pages * sizeof(snap_entry_t) + 511) / 512;
+    
+    uint32_t sectors = SNAP_KEEP + SNAP_KEEP * snap_map_sectors +
+                       snap_slots * SNAP_PAGE_SECTORS;
+    if(!file_preallocate(SNAP_FILENAME, sectors * 512) ||
+       file_map_sectors(SNAP_FILENAME, &snap_lba, 1) < 1) {
+        log_error("Snapshot", "Cannot reserve %d KB for %s", sectors / 2,
+                  SNAP_FILENAME);
+        return 0;
+    }
+    
+    snap_stage = (uint8_t*)kmalloc(SNAP_STAGE_PAGES * SNAP_PAGE_SIZE, "SNAPSHOT");
+    if(snap_stage == NULL) {
+        log_error("Snapshot", "No memory for the staging area");
+        return 0;
+    }
+    
+    memset(snap_refs, 0, sizeof(snap_refs));
+    memset(snap_slot_busy, 0, sizeof(snap_slot_busy));
+    memset(snap_map, 0, sizeof(snap_map));
+    memset(&snap_stats, 0, sizeof(snap_stats));
+    snap_generation = 0;
+    
+    // Roots one sector at a time through snap_bounce; count_map() streams
+    // through snap_verify, so the root stays put while its map is counted
+    int32_t newest = -1;
+    snap_root_t* root = (snap_root_t*)snap_bounce;
+    for(uint32_t i = 0; i < SNAP_KEEP; i++) {
+        snap_generations[i].valid = 0;
+        if(!disk_read_sectors(snap_lba + i, 1, snap_bounce)) continue;
+        if(!root_valid(root, i) || root->map_pages != snap_map_pages ||
+           root->slot_count != snap_slots) {
+            continue;
+        }
+        
+        snap_generations[i].generation = root->generation;
+        snap_generations[i].page_count = root->page_count;
+        memset(snap_generations[i].tables, 0, sizeof(snap_tables));
+        memcpy(snap_generations[i].tables, root->tables,
+               root->table_count * sizeof(db_page_layout_t));
+        if(!count_map(i, 1)) continue;
+        
+        snap_generations[i].valid = 1;
+        if(root->generation > snap_generation) {
+            snap_generation = root->generation;
+            newest = i;
+        }
+    }
+    if(newest >= 0 && load_map(newest)) {
+        memcpy(snap_map, snap_next, snap_pages * sizeof(snap_entry_t));
+        for(uint32_t id = 0; id < DB_TABLE_COUNT; id++) {
+            if(snap_tables[id].pages != 0 &&
+               !(snap_next_tables & (1u << id))) {
+                log_activity("Snapshot", "Table %d laid out anew since "
+                             "generation %d, taken in full", id,
+                             snap_generation);
+            }
+        }
+    }
+    rebuild_index();
+    
+    uint32_t changed = 0;
+    for(uint32_t page = 0; page < snap_pages; page++) {
+        asm volatile("cli");
+        db_snapshot_test_clear(page);
+        capture_page(page, snap_bounce);
+        asm volatile("sti");
+        
+        if(snap_map[page].slot == 0 || snap_map[page].crc != page_crc(snap_bounce)) {
+            db_snapshot_mark(page);
+            changed++;
+        }
+    }
+    
+    log_activity("Snapshot", "Generation %d, %d of %d pages changed since",
+                 snap_generation, changed, snap_pages);
+    snap_ready = 1;
+    return 1;
+}
+
+// Consistent image of every table without stopping the modules: copy
+// rounds run until few enough pages are still changing, those are taken
+// in one interrupts-off step, and the root write makes the result visible
+uint8_t snapshot_take() {
+    if(!snap_ready || !acquire()) return 0;
+    
+    uint32_t mhz = tsc_mhz();
+    uint64_t start = rdtsc();
+    uint32_t slots_before = snap_stats.slots_written;
+    uint32_t shared_before = snap_stats.pages_shared;
+    
+    memcpy(snap_next, snap_map, snap_pages * sizeof(snap_entry_t));
+    memset(snap_slot_busy, 0, sizeof(snap_slot_busy));
+    
+    int32_t taken = 0;
+    int32_t result = 0;
+    uint32_t rounds = 0;
+    while(result == 0) {
+        result = final_round();
+        if(result != 0) break;
+        
+        if(++rounds > SNAP_MAX_ROUNDS) {
+            result = -1;
+            break;
+        }
+        int32_t round = copy_round();
+        if(round < 0) {
+            result = -1;
+            break;
+        }
+        taken += round;
+    }
+    if(result > 0) taken += result - 1;
+    
+    // With nothing changed since the last generation there is no commit
+    uint8_t changed = taken > 0 || snap_generation == 0;
+    uint8_t ok = 1;
+    if(result < 0 || (changed && !commit(taken))) {
+        // Everything this attempt took has to go into the next one
+        for(uint32_t page = 0; page < snap_pages; page++) {
+            if(snap_next[page].slot != snap_map[page].slot) {
+                db_snapshot_mark(page);
+            }
+        }
+        log_error("Snapshot", "Generation %d abandoned after %d rounds",
+                  snap_generation + 1, rounds);
+        ok = 0;
+    } else if(changed) {
+        log_activity("Snapshot",
+                     "Generation %d: %d pages, %d KB written, %d shared, %d us",
+                     snap_generation, taken,
+                     (snap_stats.slots_written - slots_before) * 4,
+                     snap_stats.pages_shared - shared_before,
+                     (uint32_t)(rdtsc() - start) / mhz);
+    }
+    
+    // Slots written for an abandoned attempt, or superseded within this
+    // one, are unreferenced again
+    memset(snap_slot_busy, 0, sizeof(snap_slot_busy));
+    rebuild_index();
+    snap_busy = 0;
+    return ok;
+}
+
+// Bring a page of the generation in snap_next into snap_bounce, checked
+// against its CRC. Shared slots repeat back to back (empty pages), so
+// the last verified slot is kept in snap_verify and read only once.
+static uint8_t restore_page(uint32_t page, uint32_t* reads) {
+    uint32_t slot = snap_next[page].slot;
+    if(slot == 0) {
+        memset(snap_bounce, 0, SNAP_PAGE_SIZE);
+    } else if(slot != snap_verified_slot) {
+        if(!disk_read_sectors(slot_lba(slot), SNAP_PAGE_SECTORS, snap_bounce) ||
+           page_crc(snap_bounce) != snap_next[page].crc) {
+            return 0;
+        }
+        memcpy(snap_verify, snap_bounce, SNAP_PAGE_SIZE);
+        snap_verified_slot = slot;
+        (*reads)++;
+    } else {
+        memcpy(snap_bounce, snap_verify, SNAP_PAGE_SIZE);
+    }
+    return 1;
+}
+
+// Whether the generation in snap_next holds this page's table
+static uint8_t page_in_next(uint32_t page) {
+    for(uint32_t id = 0; id < DB_TABLE_COUNT; id++) {
+        db_page_layout_t* table = &snap_tables[id];
+        if(page >= table->first_page &&
+           page < table->first_page + table->pages) {
+            return (snap_next_tables >> id) & 1;
+        }
+    }
+    return 0;
+}
+
+// Read a generation back and check every page against its CRC; with
+// apply set and every page good, a second pass replaces the live tables,
+// which are then checkpointed so the log cannot replay newer changes over
+// them. Ready handlers run again so indexes and caches match the
+// restored tables. A damaged generation leaves the tables untouched, and
+// tables laid out differently since it was taken are never touched.
+uint8_t snapshot_restore(uint32_t generation, uint8_t apply) {
+    if(!snap_ready || !acquire()) return 0;
+    
+    int32_t area = -1;
+    for(uint32_t i = 0; i < SNAP_KEEP; i++) {
+        if(snap_generations[i].valid &&
+           (generation == 0 ? snap_generations[i].generation == snap_generation
+                            : snap_generations[i].generation == generation)) {
+            area = i;
+        }
+    }
+    if(area < 0 || !load_map(area)) {
+        log_error("Snapshot", "Generation %d not available", generation);
+        snap_busy = 0;
+        return 0;
+    }
+    
+    uint32_t mhz = tsc_mhz();
+    uint64_t start = rdtsc();
+    uint32_t reads = 0;
+    uint32_t errors = 0;
+    uint32_t pages = 0;
+    uint32_t applied = 0;
+    snap_verified_slot = 0;
+    
+    for(uint32_t page = 0; page < snap_pages; page++) {
+        if(!page_in_next(page)) continue;
+        if(!restore_page(page, &reads)) errors++;
+        pages++;
+    }
+    
+    if(apply && errors == 0) {
+        snap_verified_slot = 0;
+        for(uint32_t page = 0; page < snap_pages; page++) {
+            if(!page_in_next(page)) continue;
+            
+            // Verified above; a read failing now is a disk error mid-apply
+            if(!restore_page(page, &reads)) {
+                errors++;
+                continue;
+            }
+            
+            uint32_t bytes;
+            uint8_t* data = db_page_address(page, &bytes);
+            asm volatile("cli");
+            memcpy(data, snap_bounce, bytes);
+            db_mark_page(page);
+            asm volatile("sti");
+            applied++;
+        }
+    } else if(apply) {
+        log_error("Snapshot", "Generation %d damaged, tables left as they are",
+                  snap_generations[area].generation);
+    }
+    
+    uint32_t usecs = (uint32_t)(rdtsc() - start) / mhz;
+    uint32_t ms = usecs / 1000 + 1;
+    log_activity("Snapshot",
+                 "Restore of generation %d: %d pages, %d slot reads, %d KB/s, %d errors",
+                 snap_generations[area].generation, pages, reads,
+                 reads * 4 * 1000 / ms, errors);
+    snap_busy = 0;
+    
+    if(applied > 0) db_tables_restored();
+    if(apply && errors == 0) db_checkpoint();
+    return errors == 0;
+}
+
+// Dry-run restore of the newest generation, timed
+void snapshot_restore_benchmark() {
+    snapshot_restore(0, 0);
+}
+
+void snapshot_task(void* param) {
+    (void)param;
+    
+    // Pages are compared against tables, so they must all be in memory
+    db_wait_all();
+    if(!snapshot_mount()) task_exit();
+    
+    while(1) {
+        snapshot_take();
+        task_sleep(SNAP_INTERVAL_SECONDS * 100);
+    }
+}
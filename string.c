@@ -0,0 +1,258 @@
+#include "pos_system.h"
+
+// Memory and string primitives. strlen, strcmp and strstr carry every
+// record scan, so each has an SSE2 kernel that tests 16 bytes per compare,
+// used once the kernel has enabled SSE (init_sse) and the byte loops
+// otherwise. The SSE2 kernels never read beyond the page holding a
+// string's terminator, so over-reading cannot fault. Interrupt handlers
+// must not call them: only task switches save the SSE registers.
+#define STRING_PAGE_SIZE 4096
+
+typedef char v16qi __attribute__((vector_size(16), may_alias));
+typedef char v16qi_u __attribute__((vector_size(16), may_alias, aligned(1)));
+
+#define SSE2 __attribute__((target("sse2")))
+
+// Memory Operations
+void* memcpy(void* dest, const void* src, uint32_t n) {
+    uint8_t* d = (uint8_t*)dest;
+    const uint8_t* s = (const uint8_t*)src;
+    while(n--) *d++ = *s++;
+    return dest;
+}
+
+void* memset(void* s, int c, uint32_t n) {
+    uint8_t* p = (uint8_t*)s;
+    while(n--) *p++ = (uint8_t)c;
+    return s;
+}
+
+int memcmp(const void* s1, const void* s2, uint32_t n) {
+    const uint8_t* a = (const uint8_t*)s1;
+    const uint8_t* b = (const uint8_t*)s2;
+    for(uint32_t i = 0; i < n; i++) {
+        if(a[i] != b[i]) return a[i] - b[i];
+    }
+    return 0;
+}
+
+// Byte-at-a-time string kernels
+static uint32_t strlen_byte(const char* s) {
+    const char* p = s;
+    while(*p) p++;
+    return p - s;
+}
+
+static int strcmp_byte(const char* s1, const char* s2) {
+    while(*s1 && *s1 == *s2) {
+        s1++;
+        s2++;
+    }
+    return (uint8_t)*s1 - (uint8_t)*s2;
+}
+
+static char* strstr_byte(const char* haystack, const char* needle) {
+    if(!*needle) return (char*)haystack;
+    
+    for(; *haystack; haystack++) {
+        const char* h = haystack;
+        const char* n = needle;
+        while(*n && *h == *n) {
+            h++;
+            n++;
+        }
+        if(!*n) return (char*)haystack;
+    }
+    return NULL;
+}
+
+// SSE2 kernels: pcmpeqb compares 16 bytes at once and pmovmskb turns the
+// result into a bit per byte
+static inline SSE2 uint32_t byte_mask(v16qi a, v16qi b) {
+    return __builtin_ia32_pmovmskb128(a == b);
+}
+
+static inline SSE2 v16qi splat(char c) {
+    return (v16qi){c, c, c, c, c, c, c, c, c, c, c, c, c, c, c, c};
+}
+
+// Aligned blocks from the one holding s; bits before s are shifted out
+static SSE2 uint32_t strlen_sse2(const char* s) {
+    const v16qi zero = splat(0);
+    const char* block = (const char*)((uint32_t)s & ~15);
+    uint32_t mask = byte_mask(*(const v16qi*)block, zero) >> ((uint32_t)s & 15);
+    if(mask) return __builtin_ctz(mask);
+    
+    for(;;) {
+        block += 16;
+        mask = byte_mask(*(const v16qi*)block, zero);
+        if(mask) return block - s + __builtin_ctz(mask);
+    }
+}
+
+// Unaligned 16-byte loads of both strings while neither can cross into
+// the next page; the first byte that differs or ends s1 decides
+static SSE2 int strcmp_sse2(const char* s1, const char* s2) {
+    const v16qi zero = splat(0);
+    
+    for(;;) {
+        if(((uint32_t)s1 & (STRING_PAGE_SIZE - 1)) > STRING_PAGE_SIZE - 16 ||
+           ((uint32_t)s2 & (STRING_PAGE_SIZE - 1)) > STRING_PAGE_SIZE - 16) {
+            if(*s1 != *s2 || !*s1) return (uint8_t)*s1 - (uint8_t)*s2;
+            s1++;
+            s2++;
+            continue;
+        }
+        
+        v16qi a = *(const v16qi_u*)s1;
+        v16qi b = *(const v16qi_u*)s2;
+        uint32_t stop = (byte_mask(a, b) ^ 0xFFFF) | byte_mask(a, zero);
+        if(stop) {
+            uint32_t i = __builtin_ctz(stop);
+            return (uint8_t)s1[i] - (uint8_t)s2[i];
+        }
+        s1 += 16;
+        s2 += 16;
+    }
+}
+
+// First-and-last-byte filter: a block of 16 candidate positions is kept
+// only where the needle's first byte and its last byte, needle_len - 1
+// further on, both match; survivors are checked with memcmp. Loads stay
+// within the haystack, the tail is scanned bytewise.
+static SSE2 char* strstr_sse2(const char* haystack, const char* needle) {
+    uint32_t needle_len = strlen_sse2(needle);
+    if(needle_len == 0) return (char*)haystack;
+    
+    uint32_t length = strlen_sse2(haystack);
+    if(needle_len > length) return NULL;
+    
+    const v16qi first = splat(needle[0]);
+    const v16qi last = splat(needle[needle_len - 1]);
+    uint32_t i = 0;
+    
+    for(; i + needle_len + 15 <= length; i += 16) {
+        v16qi block_first = *(const v16qi_u*)(haystack + i);
+        v16qi block_last = *(const v16qi_u*)(haystack + i + needle_len - 1);
+        uint32_t mask = byte_mask(block_first, first) &
+                        byte_mask(block_last, last);
+        while(mask) {
+            uint32_t pos = i + __builtin_ctz(mask);
+            if(needle_len <= 2 ||
+               memcmp(haystack + pos + 1, needle + 1, needle_len - 2) == 0) {
+                return (char*)haystack + pos;
+            }
+            mask &= mask - 1;
+        }
+    }
+    
+    for(; i + needle_len <= length; i++) {
+        if(haystack[i] == needle[0] &&
+           memcmp(haystack + i, needle, needle_len) == 0) {
+            return (char*)haystack + i;
+        }
+    }
+    return NULL;
+}
+
+// String Operations
+uint32_t strlen(const char* s) {
+    if(sse_enabled) return strlen_sse2(s);
+    return strlen_byte(s);
+}
+
+char* strcpy(char* dest, const char* src) {
+    char* d = dest;
+    while((*d++ = *src++));
+    return dest;
+}
+
+char* strcat(char* dest, const char* src) {
+    strcpy(dest + strlen(dest), src);
+    return dest;
+}
+
+int strcmp(const char* s1, const char* s2) {
+    if(sse_enabled) return strcmp_sse2(s1, s2);
+    return strcmp_byte(s1, s2);
+}
+
+char* strstr(const char* haystack, const char* needle) {
+    if(sse_enabled) return strstr_sse2(haystack, needle);
+    return strstr_byte(haystack, needle);
+}
+
+// Cycles per call of both paths over name-like strings of 4 to 63 bytes:
+// strlen of each, strcmp against a copy that differs in the last byte,
+// and strstr for a term that is absent, so every position is tried
+#define STRING_BENCH_COUNT 256
+#define STRING_BENCH_WIDTH 64
+#define STRING_BENCH_ROUNDS 16
+
+static char string_bench_text[STRING_BENCH_COUNT][STRING_BENCH_WIDTH];
+static char string_bench_copy[STRING_BENCH_COUNT][STRING_BENCH_WIDTH];
+
+void string_benchmark() {
+    uint32_t seed = 12345;
+    for(uint32_t i = 0; i < STRING_BENCH_COUNT; i++) {
+        uint32_t length = 4 + i % (STRING_BENCH_WIDTH - 4);
+        for(uint32_t j = 0; j < length; j++) {
+            seed = seed * 1103515245 + 12345;
+            string_bench_text[i][j] = 'A' + (seed >> 16) % 26;
+        }
+        string_bench_text[i][length] = '\0';
+        strcpy(string_bench_copy[i], string_bench_text[i]);
+        string_bench_copy[i][length - 1] = '#';
+    }
+    
+    uint32_t calls = STRING_BENCH_COUNT * STRING_BENCH_ROUNDS;
+    uint32_t cycles[3][2] = {{0, 0}, {0, 0}, {0, 0}};
+    uint32_t checks[3][2] = {{0, 0}, {0, 0}, {0, 0}};
+    
+    for(int path = 0; path < 2; path++) {
+        if(path == 1 && !sse_enabled) break;
+        
+        uint64_t start = rdtsc();
+        for(int round = 0; round < STRING_BENCH_ROUNDS; round++) {
+            for(uint32_t i = 0; i < STRING_BENCH_COUNT; i++) {
+                checks[0][path] += path ? strlen_sse2(string_bench_text[i])
+                                        : strlen_byte(string_bench_text[i]);
+            }
+        }
+        cycles[0][path] = (uint32_t)(rdtsc() - start) / calls;
+        
+        start = rdtsc();
+        for(int round = 0; round < STRING_BENCH_ROUNDS; round++) {
+            for(uint32_t i = 0; i < STRING_BENCH_COUNT; i++) {
+                int order = path ? strcmp_sse2(string_bench_text[i],
+                                               string_bench_copy[i])
+                                 : strcmp_byte(string_bench_text[i],
+                                               string_bench_copy[i]);
+                checks[1][path] += order > 0;
+            }
+        }
+        cycles[1][path] = (uint32_t)(rdtsc() - start) / calls;
+        
+        start = rdtsc();
+        for(int round = 0; round < STRING_BENCH_ROUNDS; round++) {
+            for(uint32_t i = 0; i < STRING_BENCH_COUNT; i++) {
+                char* found = path ? strstr_sse2(string_bench_text[i], "QZ#")
+                                   : strstr_byte(string_bench_text[i], "QZ#");
+                checks[2][path] += found != NULL;
+            }
+        }
+        cycles[2][path] = (uint32_t)(rdtsc() - start) / calls;
+    }
+    
+    log_activity("String benchmark",
+                "Cycles per call, byte/SSE2: strlen %d/%d, strcmp %d/%d, "
+                "strstr %d/%d",
+                cycles[0][0], cycles[0][1], cycles[1][0], cycles[1][1],
+                cycles[2][0], cycles[2][1]);
+    
+    if(sse_enabled && (checks[0][0] != checks[0][1] ||
+                       checks[1][0] != checks[1][1] ||
+                       checks[2][0] != checks[2][1])) {
+        log_error("String benchmark", "SSE2 and byte results differ");
+    }
+}
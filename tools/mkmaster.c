@@ -0,0 +1,439 @@
+// Build-time generator for the static master data image.
+//
+//   mkmaster <master directory> <output.c>
+//
+// Reads medications.csv, insurance.csv and equipment_types.csv, builds a
+// minimal perfect hash over each table's codes and writes the records in
+// hash order as const C data for the .rodata.master section. Runs on the
+// build host, so unlike the kernel sources it uses the C library.
+#include <errno.h>
+#include <float.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MAX_ROWS 65535    // Row numbers are stored as uint16_t
+#define MAX_COLUMNS 32
+#define MAX_LINE 4096
+#define MAX_SEED 65535
+#define BUCKET_LOAD 4     // Average codes per bucket
+
+typedef struct {
+    const char* name;
+    char kind;     // 's' string, 'c' character, 'u' unsigned, 'f' float
+    uint32_t size; // Array size for strings, terminator included; bytes
+                   // for unsigned numbers
+} field_t;
+
+typedef struct {
+    const char* file;
+    const char* type;
+    const char* prefix;
+    const field_t* fields; // The first field is the key
+} table_t;
+
+typedef struct {
+    char* values[MAX_COLUMNS];
+} row_t;
+
+static const field_t medication_fields[] = {
+    { "code", 's', 16 },
+    { "name", 's', 64 },
+    { "generic_name", 's', 64 },
+    { "manufacturer", 's', 64 },
+    { "drug_class", 's', 32 },
+    { "schedule", 'c', 1 },
+    { "form", 's', 32 },
+    { "strength", 's', 32 },
+    { "unit", 's', 16 },
+    { "unit_price", 'f', 0 },
+    { "wholesale_price", 'f', 0 },
+    { "min_stock", 'u', 2 },
+    { "max_stock", 'u', 2 },
+    { "requires_prescription", 'u', 1 },
+    { "storage_conditions", 's', 64 },
+    { "shelf_life_days", 'u', 4 },
+    { "barcode", 's', 20 },
+    { "ndc_number", 's', 20 },
+    { NULL, 0, 0 }
+};
+
+static const field_t insurance_fields[] = {
+    { "provider_code", 's', 8 },
+    { "provider_name", 's', 32 },
+    { "coverage_percentage", 'f', 0 },
+    { "max_coverage_per_year", 'f', 0 },
+    { "requires_preauth", 'u', 1 },
+    { "contact", 's', 64 },
+    { "phone", 's', 20 },
+    { NULL, 0, 0 }
+};
+
+static const field_t equipment_fields[] = {
+    { "equipment_code", 's', 16 },
+    { "name", 's', 64 },
+    { "category", 's', 32 },
+    { "manufacturer", 's', 64 },
+    { "model", 's', 64 },
+    { "serial_number_format", 's', 20 },
+    { "expected_life_years", 'u', 2 },
+    { "purchase_price", 'f', 0 },
+    { "current_value", 'f', 0 },
+    { "depreciation_rate", 'f', 0 },
+    { "requires_calibration", 'u', 1 },
+    { "calibration_interval_days", 'u', 2 },
+    { "requires_maintenance", 'u', 1 },
+    { "maintenance_interval_days", 'u', 2 },
+    { "storage_requirements", 's', 64 },
+    { "min_quantity", 'u', 2 },
+    { "max_quantity", 'u', 2 },
+    { NULL, 0, 0 }
+};
+
+static const table_t tables[] = {
+    { "medications.csv", "medication_master_t", "medications",
+      medication_fields },
+    { "insurance.csv", "insurance_provider_t", "insurance",
+      insurance_fields },
+    { "equipment_types.csv", "equipment_type_t", "equipment_types",
+      equipment_fields },
+};
+
+// Must match master_hash() in master.c
+static uint32_t master_hash(const char* code, uint32_t seed) {
+    uint32_t hash = 2166136261u ^ (seed * 0x9E3779B1u);
+    while(*code) {
+        hash ^= (uint8_t)*code++;
+        hash *= 16777619u;
+    }
+    hash ^= hash >> 15;
+    hash *= 0x2C1B3C6Du;
+    hash ^= hash >> 12;
+    return hash;
+}
+
+static void fail(const char* file, uint32_t line, const char* message) {
+    if(line) {
+        fprintf(stderr, "mkmaster: %s:%u: %s\n", file, line, message);
+    } else {
+        fprintf(stderr, "mkmaster: %s: %s\n", file, message);
+    }
+    exit(1);
+}
+
+// Numbers go into the generated C in canonical form, so a CSV value
+// such as "010" cannot turn into an octal literal or "08" into an error
+static char* parse_number(const field_t* field, const char* value,
+                          const char* file, uint32_t line_number) {
+    char text[64];
+    char* end;
+    errno = 0;
+    
+    if(field->kind == 'u') {
+        unsigned long max = field->size == 1 ? 0xFF :
+                            field->size == 2 ? 0xFFFF : 0xFFFFFFFFul;
+        unsigned long number = strtoul(value, &end, 10);
+        if(value[0] < '0' || value[0] > '9' || *end != 0) {
+            fail(file, line_number, "not an unsigned whole number");
+        }
+        if(errno == ERANGE || number > max) {
+            fail(file, line_number, "number too large for its field");
+        }
+        snprintf(text, sizeof(text), "%lu", number);
+    } else {
+        double number = strtod(value, &end);
+        if(value[0] == 0 || *end != 0) fail(file, line_number, "not a number");
+        if(errno == ERANGE || !(number >= -FLT_MAX && number <= FLT_MAX)) {
+            fail(file, line_number, "number out of range for a float");
+        }
+        snprintf(text, sizeof(text), "%.9g", number);
+    }
+    return strdup(text);
+}
+
+// Split one line in place. Fields may be double quoted, with "" for a
+// literal quote; quoted fields may contain commas.
+static uint32_t split_csv(char* line, char** fields, const char* file,
+                          uint32_t line_number) {
+    uint32_t count = 0;
+    char* p = line;
+    while(1) {
+        if(count == MAX_COLUMNS) fail(file, line_number, "too many columns");
+        
+        char* out = p;
+        fields[count++] = out;
+        if(*p == '"') {
+            p++;
+            while(1) {
+                if(*p == 0) fail(file, line_number, "unterminated quote");
+                if(*p == '"' && p[1] == '"') {
+                    *out++ = '"';
+                    p += 2;
+                } else if(*p == '"') {
+                    p++;
+                    break;
+                } else {
+                    *out++ = *p++;
+                }
+            }
+            if(*p != ',' && *p != 0) {
+                fail(file, line_number, "text after closing quote");
+            }
+        } else {
+            while(*p != ',' && *p != 0) *out++ = *p++;
+        }
+        
+        uint8_t last = (*p == 0);
+        *out = 0;
+        if(last) break;
+        p++;
+    }
+    return count;
+}
+
+static uint32_t read_table(const char* path, const table_t* table,
+                           int32_t* column_field, uint32_t* column_count,
+                           row_t* rows) {
+    FILE* in = fopen(path, "r");
+    if(!in) fail(path, 0, "cannot open");
+    
+    char line[MAX_LINE];
+    uint32_t line_number = 0;
+    uint32_t row_count = 0;
+    uint8_t have_header = 0;
+    
+    while(fgets(line, sizeof(line), in)) {
+        line_number++;
+        line[strcspn(line, "\r\n")] = 0;
+        if(line[0] == 0 || line[0] == '#') continue;
+        
+        char* fields[MAX_COLUMNS];
+        uint32_t count = split_csv(line, fields, path, line_number);
+        
+        if(!have_header) {
+            // Header names the record fields; columns may come in any
+            // order and fields left out are zero
+            uint8_t has_key = 0;
+            for(uint32_t c = 0; c < count; c++) {
+                column_field[c] = -1;
+                for(int32_t f = 0; table->fields[f].name; f++) {
+                    if(strcmp(fields[c], table->fields[f].name) == 0) {
+                        column_field[c] = f;
+                    }
+                }
+                if(column_field[c] < 0) fail(path, line_number, "unknown column");
+                if(column_field[c] == 0) has_key = 1;
+            }
+            if(!has_key) fail(path, line_number, "no key column");
+            *column_count = count;
+            have_header = 1;
+            continue;
+        }
+        
+        if(count != *column_count) {
+            fail(path, line_number, "column count differs from header");
+        }
+        if(row_count == MAX_ROWS) fail(path, line_number, "too many rows");
+        
+        row_t* row = &rows[row_count++];
+        for(uint32_t c = 0; c < count; c++) {
+            const field_t* field = &table->fields[column_field[c]];
+            uint32_t length = strlen(fields[c]);
+            
+            if(field->kind == 's' && length >= field->size) {
+                fail(path, line_number, "string too long for its field");
+            }
+            if(field->kind == 'c' && length > 1) {
+                fail(path, line_number, "more than one character");
+            }
+            if(column_field[c] == 0 && length == 0) {
+                fail(path, line_number, "empty code");
+            }
+            if(field->kind == 'u' || field->kind == 'f') {
+                row->values[c] = parse_number(field, fields[c], path,
+                                              line_number);
+            } else {
+                row->values[c] = strdup(fields[c]);
+            }
+        }
+    }
+    
+    fclose(in);
+    if(!have_header) fail(path, 0, "no header");
+    if(row_count == 0) fail(path, 0, "no rows");
+    return row_count;
+}
+
+// Hash and displace: each bucket gets the first seed that sends all of
+// its codes to free, distinct slots. Big buckets go first while most
+// slots are still free.
+static void build_hash(const char* path, row_t* rows, uint32_t key_column,
+                       uint32_t count, uint32_t bucket_count,
+                       uint16_t* seeds, uint16_t* slot_row) {
+    uint32_t* bucket_of = calloc(count, sizeof(uint32_t));
+    uint32_t* bucket_size = calloc(bucket_count, sizeof(uint32_t));
+    uint8_t* taken = calloc(count, 1);
+    uint32_t* members = calloc(count, sizeof(uint32_t));
+    uint32_t* slots = calloc(count, sizeof(uint32_t));
+    
+    for(uint32_t r = 0; r < count; r++) {
+        const char* code = rows[r].values[key_column];
+        for(uint32_t s = 0; s < r; s++) {
+            if(strcmp(rows[s].values[key_column], code) == 0) {
+                fprintf(stderr, "mkmaster: %s: duplicate code %s\n", path, code);
+                exit(1);
+            }
+        }
+        bucket_of[r] = master_hash(code, 0) % bucket_count;
+        bucket_size[bucket_of[r]]++;
+    }
+    
+    for(uint32_t b = 0; b < bucket_count; b++) seeds[b] = 0;
+    
+    for(uint32_t size = count; size > 0; size--) {
+        for(uint32_t b = 0; b < bucket_count; b++) {
+            if(bucket_size[b] != size) continue;
+            
+            uint32_t n = 0;
+            for(uint32_t r = 0; r < count; r++) {
+                if(bucket_of[r] == b) members[n++] = r;
+            }
+            
+            uint32_t seed;
+            for(seed = 1; seed <= MAX_SEED; seed++) {
+                uint32_t placed = 0;
+                for(; placed < n; placed++) {
+                    uint32_t slot = master_hash(rows[members[placed]].values[key_column],
+                                                seed) % count;
+                    if(taken[slot]) break;
+                    taken[slot] = 1;
+                    slots[placed] = slot;
+                }
+                if(placed == n) break;
+                
+                // Undo the partial placement and try the next seed
+                for(uint32_t i = 0; i < placed; i++) taken[slots[i]] = 0;
+            }
+            if(seed > MAX_SEED) fail(path, 0, "no seed places a bucket");
+            
+            seeds[b] = seed;
+            for(uint32_t i = 0; i < n; i++) slot_row[slots[i]] = members[i];
+        }
+    }
+    
+    free(bucket_of);
+    free(bucket_size);
+    free(taken);
+    free(members);
+    free(slots);
+}
+
+static void write_string(FILE* out, const char* value) {
+    fputc('"', out);
+    for(; *value; value++) {
+        if(*value == '"' || *value == '\\') fputc('\\', out);
+        fputc(*value, out);
+    }
+    fputc('"', out);
+}
+
+static void write_table(FILE* out, const char* directory, const table_t* table) {
+    char path[1024];
+    snprintf(path, sizeof(path), "%s/%s", directory, table->file);
+    
+    static row_t rows[MAX_ROWS];
+    int32_t column_field[MAX_COLUMNS];
+    uint32_t column_count = 0;
+    uint32_t count = read_table(path, table, column_field, &column_count, rows);
+    
+    uint32_t key_column = 0;
+    for(uint32_t c = 0; c < column_count; c++) {
+        if(column_field[c] == 0) key_column = c;
+    }
+    
+    uint32_t bucket_count = (count + BUCKET_LOAD - 1) / BUCKET_LOAD;
+    uint16_t* seeds = calloc(bucket_count, sizeof(uint16_t));
+    uint16_t* slot_row = calloc(count, sizeof(uint16_t));
+    build_hash(path, rows, key_column, count, bucket_count, seeds, slot_row);
+    
+    fprintf(out, "// %s: %u records, %u buckets\n", table->file, count,
+            bucket_count);
+    fprintf(out, "static const %s %s_records[%u] MASTER_SECTION = {\n",
+            table->type, table->prefix, count);
+    for(uint32_t slot = 0; slot < count; slot++) {
+        row_t* row = &rows[slot_row[slot]];
+        fprintf(out, "    {");
+        for(uint32_t c = 0; c < column_count; c++) {
+            const field_t* field = &table->fields[column_field[c]];
+            fprintf(out, "%s .%s = ", c ? "," : "", field->name);
+            if(field->kind == 's') {
+                write_string(out, row->values[c]);
+            } else if(field->kind == 'c') {
+                char value = row->values[c][0];
+                if(value == 0) {
+                    fprintf(out, "0");
+                } else if(value == '\'' || value == '\\') {
+                    fprintf(out, "'\\%c'", value);
+                } else {
+                    fprintf(out, "'%c'", value);
+                }
+            } else {
+                fprintf(out, "%s", row->values[c]);
+            }
+        }
+        fprintf(out, " },\n");
+    }
+    fprintf(out, "};\n\n");
+    
+    fprintf(out, "static const uint16_t %s_seeds[%u] MASTER_SECTION = {",
+            table->prefix, bucket_count);
+    for(uint32_t b = 0; b < bucket_count; b++) {
+        fprintf(out, "%s%u,", b % 12 ? " " : "\n    ", seeds[b]);
+    }
+    fprintf(out, "\n};\n\n");
+    
+    uint16_t* order = calloc(count, sizeof(uint16_t));
+    for(uint32_t slot = 0; slot < count; slot++) order[slot_row[slot]] = slot;
+    
+    fprintf(out, "static const uint16_t %s_order[%u] MASTER_SECTION = {",
+            table->prefix, count);
+    for(uint32_t r = 0; r < count; r++) {
+        fprintf(out, "%s%u,", r % 12 ? " " : "\n    ", order[r]);
+    }
+    fprintf(out, "\n};\n\n");
+    
+    fprintf(out, "const master_index_t master_%s = {\n", table->prefix);
+    fprintf(out, "    %s_records, sizeof(%s), %u, %u,\n", table->prefix,
+            table->type, count, bucket_count);
+    fprintf(out, "    %s_seeds, %s_order\n};\n\n", table->prefix, table->prefix);
+    
+    for(uint32_t r = 0; r < count; r++) {
+        for(uint32_t c = 0; c < column_count; c++) free(rows[r].values[c]);
+    }
+    free(seeds);
+    free(slot_row);
+    free(order);
+}
+
+int main(int argc, char** argv) {
+    if(argc != 3) {
+        fprintf(stderr, "usage: mkmaster <master directory> <output.c>\n");
+        return 1;
+    }
+    
+    FILE* out = fopen(argv[2], "w");
+    if(!out) fail(argv[2], 0, "cannot create");
+    
+    fprintf(out, "// Generated by tools/mkmaster from %s/*.csv, do not edit\n",
+            argv[1]);
+    fprintf(out, "#include \"pos_system.h\"\n\n");
+    fprintf(out, "#define MASTER_SECTION __attribute__((section(\".rodata.master\")))\n\n");
+    
+    for(uint32_t t = 0; t < sizeof(tables) / sizeof(tables[0]); t++) {
+        write_table(out, argv[1], &tables[t]);
+    }
+    
+    if(fclose(out) != 0) fail(argv[2], 0, "write failed");
+    return 0;
+}
@@ -134,11 +134,79 @@ void format_date(uint32_t timestamp, char* buffer) {
 }
 
 // File System Functions (Simple FAT12-like)
-void file_read(const char* filename, void* buffer, uint32_t size) {
+
+// Disk LBA of each sector of a file, for callers that rewrite a file in
+// place; returns the number of sectors mapped (0 if the file is missing)
+uint32_t file_map_sectors(const char* filename, uint32_t* lbas, uint32_t max) {
+    char fat_name[12];
+    convert_to_fat_name(filename, fat_name);
+    
+    storage_lock();
+    uint32_t cluster = find_file_cluster(fat_name);
+    uint32_t count = 0;
+    while(fat_cluster_valid(cluster) && count < max) {
+        uint32_t sector = cluster_to_sector(cluster);
+        for(uint32_t i = 0; i < fat_volume.sectors_per_cluster && count < max; i++) {
+            lbas[count++] = sector + i;
+        }
+        cluster = read_fat_entry(cluster);
+    }
+    storage_unlock();
+    return count;
+}
+
+// Reserve one contiguous run for a file so it can be streamed with large
+// commands and rewritten in place; keeps an existing run if it fits
+static uint8_t preallocate_file(const char* filename, uint32_t size) {
+    char fat_name[12];
+    convert_to_fat_name(filename, fat_name);
+    
+    uint32_t cluster_bytes = fat_volume.sectors_per_cluster * 512;
+    uint32_t clusters_needed = (size + cluster_bytes - 1) / cluster_bytes;
+    
+    uint32_t old_cluster = find_file_cluster(fat_name);
+    if(old_cluster != 0 && 
+       fat_contiguous_length(old_cluster) >= clusters_needed) {
+        uint8_t ok = create_directory_entry(fat_name, old_cluster, size);
+        bcache_flush();
+        return ok;
+    }
+    
+    uint32_t first = allocate_contiguous(clusters_needed);
+    if(first == 0) {
+        log_error("File preallocate", "%s: no contiguous run of %d clusters",
+                  filename, clusters_needed);
+        return 0;
+    }
+    
+    // New chain, then the entry, then release the old one
+    fat_flush();
+    if(!create_directory_entry(fat_name, first, size)) {
+        fat_free_chain(first);
+        fat_flush();
+        return 0;
+    }
+    bcache_flush();
+    
+    if(old_cluster != 0) {
+        fat_free_chain(old_cluster);
+        fat_flush();
+    }
+    return 1;
+}
+
+uint8_t file_preallocate(const char* filename, uint32_t size) {
+    storage_lock();
+    uint8_t ok = preallocate_file(filename, size);
+    storage_unlock();
+    return ok;
+}
+
+static void read_file(const char* filename, void* buffer, uint32_t size) {
     // Read from disk using BIOS or direct disk access
     // Simplified implementation
     
-    // Convert filename to FAT12 format
+    // Convert filename to FAT 8.3 format
     char fat_name[12];
     convert_to_fat_name(filename, fat_name);
     
@@ -150,23 +218,74 @@ void file_read(const char* filename, void* buffer, uint32_t size) {
         return;
     }
     
-    // Read cluster chain
+    uint32_t commands_before = disk_stats.commands;
+    uint64_t start = rdtsc();
+    uint32_t per_cluster = fat_volume.sectors_per_cluster;
+    uint32_t cluster_bytes = per_cluster * 512;
+    
+    // Read cluster chain, one command per contiguous run of whole clusters;
+    // the block layer splits runs to what the backend can take
+    uint8_t* dest = (uint8_t*)buffer;
     uint32_t bytes_read = 0;
-    while(cluster < 0xFF8 && bytes_read < size) {
-        uint32_t sector = cluster_to_sector(cluster);
-        disk_read_sector(sector, buffer + bytes_read);
-        bytes_read += 512;
+    while(fat_cluster_valid(cluster) && bytes_read < size) {
+        uint32_t run_start = cluster;
+        uint32_t run_length = 1;
+        uint32_t whole_clusters = (size - bytes_read) / cluster_bytes;
+        
         cluster = read_fat_entry(cluster);
+        while(cluster == run_start + run_length && 
+              run_length < whole_clusters) {
+            run_length++;
+            cluster = read_fat_entry(cluster);
+        }
+        
+        uint32_t sector = cluster_to_sector(run_start);
+        if(whole_clusters == 0) {
+            // Last cluster: whole sectors directly, the partial one cached
+            uint32_t remaining = size - bytes_read;
+            uint32_t whole_sectors = remaining / 512;
+            if(whole_sectors > 0) {
+                bcache_flush_range(sector, whole_sectors);
+                disk_read_sectors(sector, whole_sectors, dest + bytes_read);
+            }
+            if(remaining % 512) {
+                uint8_t tail[512];
+                bcache_read(sector + whole_sectors, tail);
+                memcpy(dest + bytes_read + whole_sectors * 512, tail, 
+                       remaining % 512);
+            }
+            bytes_read = size;
+        } else {
+            bcache_flush_range(sector, run_length * per_cluster);
+            disk_read_sectors(sector, run_length * per_cluster, dest + bytes_read);
+            bytes_read += run_length * cluster_bytes;
+        }
+    }
+    
+    if(size >= 65536) {
+        log_activity("File load", "%s: %d KB, %d commands, %d us",
+                    filename, size / 1024,
+                    disk_stats.commands - commands_before,
+                    (uint32_t)(rdtsc() - start) / tsc_mhz());
     }
 }
 
-void file_write(const char* filename, void* data, uint32_t size) {
+void file_read(const char* filename, void* buffer, uint32_t size) {
+    storage_lock();
+    read_file(filename, buffer, size);
+    storage_unlock();
+}
+
+static void write_file(const char* filename, void* data, uint32_t size) {
     // Write to disk
     char fat_name[12];
     convert_to_fat_name(filename, fat_name);
     
-    // Find free clusters
-    uint32_t clusters_needed = (size + 511) / 512;
+    uint32_t per_cluster = fat_volume.sectors_per_cluster;
+    uint32_t cluster_bytes = per_cluster * 512;
+    
+    // Find free clusters; the chain comes back already linked
+    uint32_t clusters_needed = (size + cluster_bytes - 1) / cluster_bytes;
     uint32_t* cluster_chain = allocate_clusters(clusters_needed);
     
     if(cluster_chain == NULL) {
@@ -174,25 +293,69 @@ void file_write(const char* filename, void* data, uint32_t size) {
         return;
     }
     
-    // Write directory entry
-    create_directory_entry(fat_name, cluster_chain[0], size);
-    
-    // Write data
-    for(uint32_t i = 0; i < clusters_needed; i++) {
-        uint32_t sector = cluster_to_sector(cluster_chain[i]);
-        disk_write_sector(sector, data + (i * 512));
+    // Write data, one command per contiguous run of whole clusters
+    uint8_t* src = (uint8_t*)data;
+    uint32_t whole_clusters = size / cluster_bytes;
+    uint32_t run_start = 0;
+    while(run_start < whole_clusters) {
+        uint32_t run_length = 1;
+        while(run_start + run_length < whole_clusters &&
+              cluster_chain[run_start + run_length] == 
+              cluster_chain[run_start] + run_length) {
+            run_length++;
+        }
+        
+        uint32_t sector = cluster_to_sector(cluster_chain[run_start]);
+        bcache_invalidate_range(sector, run_length * per_cluster);
+        disk_write_sectors(sector, run_length * per_cluster, 
+                           src + run_start * cluster_bytes);
+        run_start += run_length;
     }
     
-    // Update FAT
-    for(uint32_t i = 0; i < clusters_needed; i++) {
-        if(i == clusters_needed - 1) {
-            write_fat_entry(cluster_chain[i], 0xFFF);
-        } else {
-            write_fat_entry(cluster_chain[i], cluster_chain[i+1]);
+    uint32_t remaining = size % cluster_bytes;
+    if(remaining) {
+        // Last cluster: whole sectors directly, the partial one zero-padded
+        uint32_t sector = cluster_to_sector(cluster_chain[whole_clusters]);
+        uint8_t* tail_src = src + whole_clusters * cluster_bytes;
+        uint32_t whole_sectors = remaining / 512;
+        if(whole_sectors > 0) {
+            bcache_invalidate_range(sector, whole_sectors);
+            disk_write_sectors(sector, whole_sectors, tail_src);
         }
+        if(remaining % 512) {
+            uint8_t tail[512];
+            memset(tail, 0, sizeof(tail));
+            memcpy(tail, tail_src + whole_sectors * 512, remaining % 512);
+            bcache_write(sector + whole_sectors, tail);
+        }
+    }
+    
+    // Crash-safe order: data, the new chain, the directory entry that
+    // points at it, and only then release the previous contents
+    bcache_flush();
+    fat_flush();
+    
+    uint32_t old_cluster = find_file_cluster(fat_name);
+    if(!create_directory_entry(fat_name, cluster_chain[0], size)) {
+        // The data has nowhere to live; give its clusters back
+        fat_free_chain(cluster_chain[0]);
+        fat_flush();
+        return;
+    }
+    bcache_flush();
+    
+    if(old_cluster != 0) {
+        fat_free_chain(old_cluster);
+        fat_flush();
     }
 }
 
+void file_write(const char* filename, void* data, uint32_t size) {
+    storage_lock();
+    write_file(filename, data, size);
+    storage_unlock();
+}
+
 // Mathematical Functions
 float string_to_float(const char* str) {
     float result = 0.0;
@@ -257,6 +420,92 @@ uint16_t calculate_crc16(const void* data, uint32_t length) {
     return crc;
 }
 
+// CRC32C (Castagnoli), reflected polynomial 0x82F63B78
+static uint32_t crc32c_table[8][256];
+static uint8_t crc32c_use_sse42 = 0;
+
+void crc32c_init() {
+    for(uint32_t i = 0; i < 256; i++) {
+        uint32_t crc = i;
+        for(uint8_t j = 0; j < 8; j++) {
+            crc = (crc & 1) ? (crc >> 1) ^ 0x82F63B78 : crc >> 1;
+        }
+        crc32c_table[0][i] = crc;
+    }
+    
+    // Slicing-by-8: table[k] advances a byte through k further zero bytes
+    for(uint32_t i = 0; i < 256; i++) {
+        for(uint8_t k = 1; k < 8; k++) {
+            uint32_t prev = crc32c_table[k - 1][i];
+            crc32c_table[k][i] = (prev >> 8) ^ crc32c_table[0][prev & 0xFF];
+        }
+    }
+    
+    uint32_t eax, ebx, ecx, edx;
+    cpuid(1, &eax, &ebx, &ecx, &edx);
+    crc32c_use_sse42 = (ecx & CPUID_ECX_SSE42) ? 1 : 0;
+}
+
+static uint32_t crc32c_sw(uint32_t crc, const uint8_t* bytes, uint32_t length) {
+    while(length && ((uint32_t)bytes & 3)) {
+        crc = (crc >> 8) ^ crc32c_table[0][(crc ^ *bytes++) & 0xFF];
+        length--;
+    }
+    
+    while(length >= 8) {
+        uint32_t lo = *(const uint32_t*)bytes ^ crc;
+        uint32_t hi = *(const uint32_t*)(bytes + 4);
+        crc = crc32c_table[7][lo & 0xFF] ^
+              crc32c_table[6][(lo >> 8) & 0xFF] ^
+              crc32c_table[5][(lo >> 16) & 0xFF] ^
+              crc32c_table[4][lo >> 24] ^
+              crc32c_table[3][hi & 0xFF] ^
+              crc32c_table[2][(hi >> 8) & 0xFF] ^
+              crc32c_table[1][(hi >> 16) & 0xFF] ^
+              crc32c_table[0][hi >> 24];
+        bytes += 8;
+        length -= 8;
+    }
+    
+    while(length--) {
+        crc = (crc >> 8) ^ crc32c_table[0][(crc ^ *bytes++) & 0xFF];
+    }
+    
+    return crc;
+}
+
+static uint32_t crc32c_hw(uint32_t crc, const uint8_t* bytes, uint32_t length) {
+    while(length && ((uint32_t)bytes & 3)) {
+        asm("crc32b %1, %0" : "+r"(crc) : "qm"(*bytes));
+        bytes++;
+        length--;
+    }
+    
+    while(length >= 4) {
+        asm("crc32l %1, %0" : "+r"(crc) : "rm"(*(const uint32_t*)bytes));
+        bytes += 4;
+        length -= 4;
+    }
+    
+    while(length--) {
+        asm("crc32b %1, %0" : "+r"(crc) : "qm"(*bytes));
+        bytes++;
+    }
+    
+    return crc;
+}
+
+uint32_t crc32c_update(uint32_t crc, const void* data, uint32_t length) {
+    if(crc32c_use_sse42) {
+        return crc32c_hw(crc, (const uint8_t*)data, length);
+    }
+    return crc32c_sw(crc, (const uint8_t*)data, length);
+}
+
+uint32_t calculate_crc32c(const void* data, uint32_t length) {
+    return ~crc32c_update(0xFFFFFFFF, data, length);
+}
+
 // Data Encryption (Simple XOR for demonstration)
 void encrypt_data(void* data, uint32_t length, const char* key) {
     uint8_t* bytes = (uint8_t*)data;
@@ -272,6 +521,80 @@ void decrypt_data(void* data, uint32_t length, const char* key) {
     encrypt_data(data, length, key);
 }
 
+// TSC frequency, calibrated once against the PIT-driven delay()
+uint32_t tsc_mhz() {
+    static uint32_t mhz = 0;
+    
+    if(mhz == 0) {
+        uint64_t start = rdtsc();
+        delay(10);
+        uint32_t cycles = (uint32_t)(rdtsc() - start);
+        mhz = cycles / 10000;
+        if(mhz == 0) mhz = 1;
+    }
+    
+    return mhz;
+}
+
+// Time to first menu: kernel entry until a module first draws its menu
+uint64_t boot_start_tsc = 0;
+uint8_t boot_menu_shown = 0;
+
+void boot_timer_start() {
+    boot_start_tsc = rdtsc();
+}
+
+void boot_first_menu() {
+    if(boot_menu_shown) return;
+    boot_menu_shown = 1;
+    
+    uint32_t ms = (uint32_t)((rdtsc() - boot_start_tsc) >> 10) / tsc_mhz() *
+                  1024 / 1000;
+    log_activity("Boot", "First menu after %d ms", ms);
+}
+
+// Throughput of both CRC32C paths over a 64KB buffer, in MB/s
+#define CRC_BENCH_SIZE 65536
+#define CRC_BENCH_ROUNDS 16
+
+static uint8_t crc_bench_buffer[CRC_BENCH_SIZE];
+
+void crc32c_benchmark() {
+    for(uint32_t i = 0; i < CRC_BENCH_SIZE; i++) {
+        crc_bench_buffer[i] = (uint8_t)(i * 31 + 7);
+    }
+    
+    uint32_t mhz = tsc_mhz();
+    uint32_t checks[2] = {0, 0};
+    uint32_t rates[2] = {0, 0};
+    
+    for(int path = 0; path < 2; path++) {
+        if(path == 1 && !crc32c_use_sse42) break;
+        
+        uint32_t crc = 0xFFFFFFFF;
+        uint64_t start = rdtsc();
+        for(int round = 0; round < CRC_BENCH_ROUNDS; round++) {
+            crc = path ? crc32c_hw(crc, crc_bench_buffer, CRC_BENCH_SIZE)
+                       : crc32c_sw(crc, crc_bench_buffer, CRC_BENCH_SIZE);
+        }
+        uint32_t cycles = (uint32_t)(rdtsc() - start);
+        uint32_t usecs = cycles / mhz;
+        
+        checks[path] = crc;
+        rates[path] = usecs ? (CRC_BENCH_SIZE * CRC_BENCH_ROUNDS) / usecs : 0;
+    }
+    
+    log_activity("CRC32C benchmark",
+                "Table: %d.%02d GB/s, SSE4.2: %d.%02d GB/s",
+                rates[0] / 1000, (rates[0] % 1000) / 10,
+                rates[1] / 1000, (rates[1] % 1000) / 10);
+    
+    if(crc32c_use_sse42 && checks[0] != checks[1]) {
+        log_error("CRC32C benchmark", "Path mismatch: %08X != %08X",
+                  checks[0], checks[1]);
+    }
+}
+
 // System Monitoring
 void system_monitor() {
     // Display system status
@@ -325,6 +648,38 @@ void system_monitor() {
             system_status.error_count);
     vga_print_at(0, 22, error_buf);
     
+    // Block cache effectiveness
+    char cache_buf[80];
+    uint32_t lookups = bcache_stats.hits + bcache_stats.misses;
+    sprintf(cache_buf, "Block cache: %d hits, %d misses (%d%%), %d writebacks",
+            bcache_stats.hits, bcache_stats.misses,
+            lookups ? bcache_stats.hits * 100 / lookups : 0,
+            bcache_stats.writebacks);
+    vga_print_at(0, 23, cache_buf);
+    
     vga_print_at(0, 24, "Press any key to continue...");
     keyboard_read_char();
+    
+    // Second page: IPC queue health
+    ipc_monitor_page();
+    vga_print_at(0, 23, "U = restore the newest backup over every table");
+    vga_print_at(0, 24, "D = dump IPCSTATS.TXT  Benchmarks: B disk, C CRC, R restore, P patients, S str");
+    char key = keyboard_read_char();
+    if(key == 'D' || key == 'd') {
+        ipc_dump_stats();
+    } else if(key == 'B' || key == 'b') {
+        disk_benchmark();
+    } else if(key == 'C' || key == 'c') {
+        crc32c_benchmark();
+    } else if(key == 'R' || key == 'r') {
+        snapshot_restore_benchmark();
+    } else if(key == 'P' || key == 'p') {
+        patient_layout_benchmark();
+    } else if(key == 'S' || key == 's') {
+        string_benchmark();
+    } else if(key == 'U' || key == 'u') {
+        vga_print_at(0, 24, "Changes since the backup are lost. Restore? (Y/N)                              ");
+        key = keyboard_read_char();
+        if(key == 'Y' || key == 'y') snapshot_restore(0, 1);
+    }
 }
@@ -0,0 +1,282 @@
+#include "pos_system.h"
+
+// Legacy virtio-blk over PCI (QEMU -drive if=virtio)
+#define VIRTIO_VENDOR_ID 0x1AF4
+#define VIRTIO_BLK_DEVICE_ID 0x1001
+
+// Legacy I/O BAR0 register layout
+#define VIRTIO_DEVICE_FEATURES 0x00
+#define VIRTIO_GUEST_FEATURES 0x04
+#define VIRTIO_QUEUE_ADDRESS 0x08
+#define VIRTIO_QUEUE_SIZE 0x0C
+#define VIRTIO_QUEUE_SELECT 0x0E
+#define VIRTIO_QUEUE_NOTIFY 0x10
+#define VIRTIO_DEVICE_STATUS 0x12
+#define VIRTIO_ISR_STATUS 0x13
+#define VIRTIO_BLK_CAPACITY 0x14
+
+#define VIRTIO_STATUS_ACKNOWLEDGE 0x01
+#define VIRTIO_STATUS_DRIVER 0x02
+#define VIRTIO_STATUS_DRIVER_OK 0x04
+#define VIRTIO_STATUS_FAILED 0x80
+
+#define VIRTQ_DESC_F_NEXT 0x01
+#define VIRTQ_DESC_F_WRITE 0x02
+
+#define VIRTIO_BLK_T_IN 0
+#define VIRTIO_BLK_T_OUT 1
+#define VIRTIO_BLK_T_FLUSH 4
+#define VIRTIO_BLK_S_OK 0
+
+// Ring lives in the driver part of the Device I/O Buffer (0x3C0000+)
+#define VIRTQ_BASE 0x3C0000
+#define VIRTQ_REGION_SIZE 0x4000
+#define VIRTQ_MAX_SIZE 256
+#define VIRTQ_ALIGN 4096
+
+typedef struct {
+    uint32_t address_low;
+    uint32_t address_high;
+    uint32_t length;
+    uint16_t flags;
+    uint16_t next;
+} __attribute__((packed)) virtq_desc_t;
+
+typedef struct {
+    uint16_t flags;
+    uint16_t index;
+    uint16_t ring[];
+} __attribute__((packed)) virtq_avail_t;
+
+typedef struct {
+    uint32_t id;
+    uint32_t length;
+} __attribute__((packed)) virtq_used_elem_t;
+
+typedef struct {
+    uint16_t flags;
+    volatile uint16_t index;
+    virtq_used_elem_t ring[];
+} __attribute__((packed)) virtq_used_t;
+
+typedef struct {
+    uint32_t type;
+    uint32_t reserved;
+    uint32_t sector_low;
+    uint32_t sector_high;
+} __attribute__((packed)) virtio_blk_header_t;
+
+typedef struct {
+    uint16_t io_base;
+    uint16_t queue_size;
+    uint16_t last_used;
+    uint32_t capacity; // Sectors; low word is plenty for our images
+    virtq_desc_t* desc;
+    virtq_avail_t* avail;
+    virtq_used_t* used;
+    uint32_t waiter;
+    uint8_t irq;
+} virtio_blk_t;
+
+// Three descriptors per request: header, data, status
+virtio_blk_header_t vblk_headers[DISK_BATCH_MAX];
+volatile uint8_t vblk_status[DISK_BATCH_MAX];
+virtio_blk_t vblk;
+
+void isr_virtio_blk(interrupt_frame_t* frame) {
+    (void)frame;
+    
+    // Reading ISR status acknowledges the interrupt
+    inb(vblk.io_base + VIRTIO_ISR_STATUS);
+    
+    if(vblk.irq >= 8) outb(0xA0, 0x20);
+    outb(0x20, 0x20);
+    
+    task_wake(vblk.waiter);
+}
+
+static void vblk_wait(uint16_t target) {
+    // Boot-time I/O runs before the scheduler: poll with interrupts off
+    if(!scheduler_started) {
+        while(vblk.used->index != target);
+        inb(vblk.io_base + VIRTIO_ISR_STATUS);
+        return;
+    }
+    
+    while(1) {
+        asm volatile("cli");
+        if(vblk.used->index == target) break;
+        
+        vblk.waiter = current_task;
+        task_block();
+        
+        if(vblk.used->index != target) asm volatile("sti; hlt");
+    }
+    asm volatile("sti");
+    vblk.waiter = 0xFFFFFFFF;
+}
+
+static void vblk_add_request(uint32_t slot, uint32_t type, uint32_t lba,
+                             void* buffer, uint32_t bytes) {
+    uint16_t head = slot * 3;
+    
+    vblk_headers[slot].type = type;
+    vblk_headers[slot].reserved = 0;
+    vblk_headers[slot].sector_low = lba;
+    vblk_headers[slot].sector_high = 0;
+    vblk_status[slot] = 0xFF;
+    
+    vblk.desc[head].address_low = (uint32_t)&vblk_headers[slot];
+    vblk.desc[head].address_high = 0;
+    vblk.desc[head].length = sizeof(virtio_blk_header_t);
+    vblk.desc[head].flags = VIRTQ_DESC_F_NEXT;
+    vblk.desc[head].next = head + 1;
+    
+    uint16_t status_desc = head + 1;
+    if(bytes > 0) {
+        vblk.desc[head + 1].address_low = (uint32_t)buffer;
+        vblk.desc[head + 1].address_high = 0;
+        vblk.desc[head + 1].length = bytes;
+        vblk.desc[head + 1].flags = VIRTQ_DESC_F_NEXT |
+            (type == VIRTIO_BLK_T_IN ? VIRTQ_DESC_F_WRITE : 0);
+        vblk.desc[head + 1].next = head + 2;
+        status_desc = head + 2;
+    } else {
+        vblk.desc[head].next = status_desc;
+    }
+    
+    vblk.desc[status_desc].address_low = (uint32_t)&vblk_status[slot];
+    vblk.desc[status_desc].address_high = 0;
+    vblk.desc[status_desc].length = 1;
+    vblk.desc[status_desc].flags = VIRTQ_DESC_F_WRITE;
+    vblk.desc[status_desc].next = 0;
+    
+    vblk.avail->ring[(vblk.avail->index + slot) % vblk.queue_size] = head;
+}
+
+// Publish the whole batch with one index update and one notify
+static void vblk_kick(uint32_t count) {
+    asm volatile("" : : : "memory");
+    vblk.avail->index += count;
+    asm volatile("" : : : "memory");
+    outw(vblk.io_base + VIRTIO_QUEUE_NOTIFY, 0);
+    
+    vblk.last_used += count;
+    vblk_wait(vblk.last_used);
+}
+
+static uint8_t vblk_submit_batch(disk_request_t* requests, uint32_t count) {
+    uint8_t ok = 1;
+    
+    while(count > 0) {
+        uint32_t batch = count > DISK_BATCH_MAX ? DISK_BATCH_MAX : count;
+        
+        for(uint32_t i = 0; i < batch; i++) {
+            vblk_add_request(i,
+                             requests[i].write ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN,
+                             requests[i].lba, requests[i].buffer,
+                             requests[i].count * 512);
+            disk_stats.sectors += requests[i].count;
+        }
+        disk_stats.commands += batch;
+        
+        vblk_kick(batch);
+        
+        for(uint32_t i = 0; i < batch; i++) {
+            requests[i].status = vblk_status[i] == VIRTIO_BLK_S_OK;
+            if(!requests[i].status) {
+                log_error("virtio-blk", "Request failed, LBA: %d, Status: %d",
+                          requests[i].lba, vblk_status[i]);
+                disk_stats.errors++;
+                ok = 0;
+            }
+        }
+        
+        requests += batch;
+        count -= batch;
+    }
+    
+    return ok;
+}
+
+static uint8_t vblk_read(uint32_t lba, uint32_t count, void* buffer) {
+    disk_request_t request = {.lba = lba, .count = count, .buffer = buffer};
+    return vblk_submit_batch(&request, 1);
+}
+
+static uint8_t vblk_write(uint32_t lba, uint32_t count, const void* buffer) {
+    disk_request_t request = {.lba = lba, .count = count,
+                              .buffer = (void*)buffer, .write = 1};
+    if(!vblk_submit_batch(&request, 1)) return 0;
+    
+    // Same durability guarantee as the ATA CACHE FLUSH
+    vblk_add_request(0, VIRTIO_BLK_T_FLUSH, 0, NULL, 0);
+    vblk_kick(1);
+    return vblk_status[0] == VIRTIO_BLK_S_OK;
+}
+
+disk_backend_t virtio_blk_backend = {
+    "virtio-blk",
+    vblk_read,
+    vblk_write,
+    vblk_submit_batch,
+    NULL,
+    NULL
+};
+
+disk_backend_t* virtio_blk_init() {
+    pci_device_t dev;
+    
+    if(!pci_find_device(VIRTIO_VENDOR_ID, VIRTIO_BLK_DEVICE_ID, &dev)) {
+        return NULL;
+    }
+    
+    uint32_t bar0 = pci_bar(&dev, 0);
+    if(!(bar0 & 1)) return NULL;
+    vblk.io_base = bar0 & 0xFFFC;
+    vblk.irq = dev.irq;
+    vblk.waiter = 0xFFFFFFFF;
+    pci_enable_bus_master(&dev);
+    
+    outb(vblk.io_base + VIRTIO_DEVICE_STATUS, 0);
+    outb(vblk.io_base + VIRTIO_DEVICE_STATUS, VIRTIO_STATUS_ACKNOWLEDGE);
+    outb(vblk.io_base + VIRTIO_DEVICE_STATUS,
+         VIRTIO_STATUS_ACKNOWLEDGE | VIRTIO_STATUS_DRIVER);
+    
+    // No optional features needed for plain sector I/O
+    inl(vblk.io_base + VIRTIO_DEVICE_FEATURES);
+    outl(vblk.io_base + VIRTIO_GUEST_FEATURES, 0);
+    
+    outw(vblk.io_base + VIRTIO_QUEUE_SELECT, 0);
+    vblk.queue_size = inw(vblk.io_base + VIRTIO_QUEUE_SIZE);
+    if(vblk.queue_size < DISK_BATCH_MAX * 3 || vblk.queue_size > VIRTQ_MAX_SIZE) {
+        log_error("virtio-blk", "Unsupported queue size: %d", vblk.queue_size);
+        outb(vblk.io_base + VIRTIO_DEVICE_STATUS, VIRTIO_STATUS_FAILED);
+        return NULL;
+    }
+    
+    // Legacy layout: descriptors + avail ring, then used ring on the next page
+    uint32_t avail_offset = vblk.queue_size * sizeof(virtq_desc_t);
+    uint32_t used_offset = avail_offset + 6 + 2 * vblk.queue_size;
+    used_offset = (used_offset + VIRTQ_ALIGN - 1) & ~(VIRTQ_ALIGN - 1);
+    
+    memset((void*)VIRTQ_BASE, 0, VIRTQ_REGION_SIZE);
+    vblk.desc = (virtq_desc_t*)VIRTQ_BASE;
+    vblk.avail = (virtq_avail_t*)(VIRTQ_BASE + avail_offset);
+    vblk.used = (virtq_used_t*)(VIRTQ_BASE + used_offset);
+    vblk.last_used = 0;
+    
+    outl(vblk.io_base + VIRTIO_QUEUE_ADDRESS, VIRTQ_BASE / VIRTQ_ALIGN);
+    
+    vblk.capacity = inl(vblk.io_base + VIRTIO_BLK_CAPACITY);
+    
+    register_irq_handler(vblk.irq, isr_virtio_blk);
+    outb(vblk.io_base + VIRTIO_DEVICE_STATUS,
+         VIRTIO_STATUS_ACKNOWLEDGE | VIRTIO_STATUS_DRIVER |
+         VIRTIO_STATUS_DRIVER_OK);
+    
+    log_activity("virtio-blk", "Queue: %d entries, Capacity: %d sectors",
+                 vblk.queue_size, vblk.capacity);
+    
+    return &virtio_blk_backend;
+}
@@ -0,0 +1,235 @@
+#include "pos_system.h"
+
+// Redo log of record images, staged in the Transaction Buffer (0x300000)
+// and appended in place to a preallocated file
+#define WAL_FILENAME "DATABASE.LOG"
+#define WAL_BUFFER 0x300000
+#define WAL_SIZE 0x40000
+#define WAL_SECTORS (WAL_SIZE / 512)
+#define WAL_HEADER_MAGIC 0x474F4C57 // "WLOG"
+#define WAL_RECORD_MAGIC 0x43455257 // "WREC"
+
+typedef struct {
+    uint32_t checksum; // CRC32C of the rest of the header
+    uint32_t magic;
+    uint32_t generation;
+} wal_header_t;
+
+// Checksum first so it covers the header after it plus the record image
+typedef struct {
+    uint32_t checksum;
+    uint32_t magic;
+    uint32_t generation;
+    uint32_t lsn;
+    uint32_t index;
+    uint16_t length;
+    uint8_t table;
+    uint8_t reserved;
+} wal_record_t;
+
+uint32_t wal_lba[WAL_SECTORS];
+uint32_t wal_tail = 0;    // Next append offset
+uint32_t wal_synced = 0;  // Everything before this offset is on disk
+uint32_t wal_generation = 0;
+uint32_t wal_next_lsn = 1;
+uint8_t wal_ready = 0;
+wal_stats_t wal_stats;
+
+static uint8_t* wal_buffer() {
+    return (uint8_t*)WAL_BUFFER;
+}
+
+// Move log sectors, one command per physically contiguous run
+static uint8_t wal_io(uint32_t first, uint32_t count, uint8_t write) {
+    storage_lock();
+    uint8_t ok = 1;
+    while(count > 0 && ok) {
+        uint32_t run = 1;
+        while(run < count && wal_lba[first + run] == wal_lba[first] + run) {
+            run++;
+        }
+        
+        uint8_t* data = wal_buffer() + first * 512;
+        if(write) {
+            bcache_invalidate_range(wal_lba[first], run);
+            ok = disk_write_sectors(wal_lba[first], run, data);
+            wal_stats.sectors_written += run;
+        } else {
+            bcache_flush_range(wal_lba[first], run);
+            ok = disk_read_sectors(wal_lba[first], run, data);
+        }
+        
+        first += run;
+        count -= run;
+    }
+    storage_unlock();
+    return ok;
+}
+
+static uint32_t record_crc(wal_record_t* record) {
+    return calculate_crc32c((uint8_t*)record + sizeof(uint32_t),
+                            sizeof(wal_record_t) - sizeof(uint32_t) + 
+                            record->length);
+}
+
+static void write_header() {
+    wal_header_t* header = (wal_header_t*)wal_buffer();
+    memset(header, 0, 512);
+    header->magic = WAL_HEADER_MAGIC;
+    header->generation = wal_generation;
+    header->checksum = calculate_crc32c(&header->magic, 
+                                        sizeof(wal_header_t) - sizeof(uint32_t));
+    wal_io(0, 1, 1);
+}
+
+// Walk the records of the current generation; stops at the first torn,
+// stale or out-of-sequence one
+static uint32_t scan_records() {
+    uint32_t offset = 512;
+    wal_next_lsn = 1;
+    
+    while(offset + sizeof(wal_record_t) <= WAL_SIZE) {
+        wal_record_t* record = (wal_record_t*)(wal_buffer() + offset);
+        if(record->magic != WAL_RECORD_MAGIC ||
+           record->generation != wal_generation ||
+           record->lsn != wal_next_lsn ||
+           offset + sizeof(wal_record_t) + record->length > WAL_SIZE ||
+           record->checksum != record_crc(record)) {
+            break;
+        }
+        
+        offset += (sizeof(wal_record_t) + record->length + 3) & ~3;
+        wal_next_lsn++;
+    }
+    
+    return offset;
+}
+
+uint8_t wal_init() {
+    memset(&wal_stats, 0, sizeof(wal_stats));
+    wal_ready = 0;
+    
+    if(file_map_sectors(WAL_FILENAME, wal_lba, WAL_SECTORS) < WAL_SECTORS) {
+        // Preallocate once so appends never touch the FAT, and zero it so
+        // records left in recycled clusters cannot be mistaken for ours
+        if(!file_preallocate(WAL_FILENAME, WAL_SIZE) ||
+           file_map_sectors(WAL_FILENAME, wal_lba, WAL_SECTORS) < WAL_SECTORS) {
+            log_error("WAL", "Cannot allocate %s", WAL_FILENAME);
+            return 0;
+        }
+        memset(wal_buffer(), 0, WAL_SIZE);
+        wal_io(0, WAL_SECTORS, 1);
+    }
+    
+    if(!wal_io(0, WAL_SECTORS, 0)) {
+        log_error("WAL", "Cannot read %s", WAL_FILENAME);
+        return 0;
+    }
+    
+    wal_header_t* header = (wal_header_t*)wal_buffer();
+    if(header->magic != WAL_HEADER_MAGIC ||
+       header->checksum != calculate_crc32c(&header->magic,
+                                  sizeof(wal_header_t) - sizeof(uint32_t))) {
+        wal_generation = 1;
+        write_header();
+        wal_tail = 512;
+    } else {
+        wal_generation = header->generation;
+        wal_tail = scan_records();
+    }
+    
+    wal_synced = wal_tail;
+    wal_ready = 1;
+    
+    log_activity("WAL", "Generation %d, %d records pending replay",
+                 wal_generation, wal_next_lsn - 1);
+    return 1;
+}
+
+// Stage a record image; nothing reaches disk until wal_commit()
+uint8_t wal_append(db_table_id_t id, uint32_t index, const void* data,
+                   uint32_t length) {
+    if(!wal_ready) return 0;
+    
+    uint32_t size = (sizeof(wal_record_t) + length + 3) & ~3;
+    if(wal_tail + size > WAL_SIZE) return 0;
+    
+    wal_record_t* record = (wal_record_t*)(wal_buffer() + wal_tail);
+    record->magic = WAL_RECORD_MAGIC;
+    record->generation = wal_generation;
+    record->lsn = wal_next_lsn++;
+    record->index = index;
+    record->length = length;
+    record->table = id;
+    record->reserved = 0;
+    memcpy(record + 1, data, length);
+    record->checksum = record_crc(record);
+    
+    // Zero the alignment padding so the on-disk image is deterministic
+    memset((uint8_t*)(record + 1) + length, 0, 
+           size - sizeof(wal_record_t) - length);
+    
+    wal_tail += size;
+    wal_stats.records++;
+    return 1;
+}
+
+// Group commit: every record staged since the last commit goes out in
+// one write of the sectors between the synced point and the tail
+uint8_t wal_commit() {
+    if(!wal_ready) return 0;
+    if(wal_tail == wal_synced) return 1;
+    
+    uint32_t first = wal_synced / 512;
+    uint32_t last = (wal_tail - 1) / 512;
+    if(!wal_io(first, last - first + 1, 1)) {
+        log_error("WAL", "Commit failed at offset %d", wal_synced);
+        return 0;
+    }
+    
+    wal_synced = wal_tail;
+    wal_stats.commits++;
+    return 1;
+}
+
+// Reapply logged images for a table that was just loaded from its file
+uint32_t wal_replay_table(db_table_id_t id) {
+    if(!wal_ready) return 0;
+    
+    uint32_t applied = 0;
+    uint32_t offset = 512;
+    while(offset < wal_synced) {
+        wal_record_t* record = (wal_record_t*)(wal_buffer() + offset);
+        if(record->table == id) {
+            db_apply_record(id, record->index, record + 1, record->length);
+            applied++;
+        }
+        offset += (sizeof(wal_record_t) + record->length + 3) & ~3;
+    }
+    return applied;
+}
+
+// Tables that still have records in the log
+uint32_t wal_table_mask() {
+    uint32_t mask = 0;
+    uint32_t offset = 512;
+    while(offset < wal_tail) {
+        wal_record_t* record = (wal_record_t*)(wal_buffer() + offset);
+        mask |= 1 << record->table;
+        offset += (sizeof(wal_record_t) + record->length + 3) & ~3;
+    }
+    return mask;
+}
+
+// After a checkpoint the table files hold everything; a new generation
+// makes the old records unreachable without rewriting the log
+void wal_reset() {
+    if(!wal_ready) return;
+    
+    wal_generation++;
+    write_header();
+    wal_tail = 512;
+    wal_synced = 512;
+    wal_next_lsn = 1;
+    wal_stats.checkpoints++;
+}
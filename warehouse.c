@@ -1,30 +1,9 @@
 #include "pos_system.h"
 
-#define MAX_EQUIPMENT_TYPES 500
 #define MAX_EQUIPMENT_ITEMS 5000
 #define MAX_MAINTENANCE_RECORDS 2000
 #define MAX_SUPPLIERS 100
 
-typedef struct {
-    char equipment_code[16];
-    char name[64];
-    char category[32]; // Diagnostic, Therapeutic, Surgical, Monitoring
-    char manufacturer[64];
-    char model[64];
-    char serial_number_format[20];
-    uint16_t expected_life_years;
-    float purchase_price;
-    float current_value;
-    float depreciation_rate;
-    uint8_t requires_calibration;
-    uint16_t calibration_interval_days;
-    uint8_t requires_maintenance;
-    uint16_t maintenance_interval_days;
-    char storage_requirements[64];
-    uint16_t min_quantity;
-    uint16_t max_quantity;
-} equipment_type_t;
-
 typedef struct {
     uint32_t item_id;
     char equipment_code[16];
@@ -75,11 +54,33 @@ typedef struct {
 } equipment_transaction_t;
 
 // Databases
-equipment_type_t equipment_type_db[MAX_EQUIPMENT_TYPES];
-equipment_item_t equipment_item_db[MAX_EQUIPMENT_ITEMS];
-maintenance_record_t maintenance_db[MAX_MAINTENANCE_RECORDS];
+equipment_type_t* equipment_type_db = NULL; // Build-time image, see master.c
+equipment_item_t equipment_item_db_store[MAX_EQUIPMENT_ITEMS];
+equipment_item_t* equipment_item_db = equipment_item_db_store;
+maintenance_record_t maintenance_db_store[MAX_MAINTENANCE_RECORDS];
+maintenance_record_t* maintenance_db = maintenance_db_store;
 equipment_transaction_t transaction_db[MAX_EQUIPMENT_ITEMS * 10]; // 10 transactions per item avg
 
+// Table files
+// Equipment types are master data from master/equipment_types.csv
+void load_equipment_database() {
+    equipment_type_db = (equipment_type_t*)master_equipment_types.records;
+    equipment_item_db = db_register_table(DB_TABLE_EQUIPMENT_ITEM,
+                                          "EQUIPMNT.DAT",
+                                          equipment_item_db_store,
+                                          sizeof(equipment_item_t),
+                                          MAX_EQUIPMENT_ITEMS);
+    db_load_table(DB_TABLE_EQUIPMENT_ITEM);
+}
+
+void load_maintenance_database() {
+    maintenance_db = db_register_table(DB_TABLE_MAINTENANCE, "MAINTAIN.DAT",
+                                       maintenance_db_store,
+                                       sizeof(maintenance_record_t),
+                                       MAX_MAINTENANCE_RECORDS);
+    db_load_table(DB_TABLE_MAINTENANCE);
+}
+
 void equipment_checkout() {
     clear_screen();
     print_header("EQUIPMENT CHECK-OUT");
@@ -99,7 +100,7 @@ void equipment_checkout() {
             if(strstr(equipment_item_db[i].equipment_code, search) != NULL ||
                strstr(equipment_item_db[i].serial_number, search) != NULL) {
                 
-                equipment_type_t* type = 
+                const equipment_type_t* type = 
                     find_equipment_type(equipment_item_db[i].equipment_code);
                 
                 if(type && strstr(type->name, search) != NULL) {
@@ -122,7 +123,7 @@ void equipment_checkout() {
     
     for(uint32_t i = 0; i < result_count; i++) {
         uint32_t idx = results[i];
-        equipment_type_t* type = 
+        const equipment_type_t* type = 
             find_equipment_type(equipment_item_db[idx].equipment_code);
         
         print("%4d %-16s %-20s %-12s %s\n",
@@ -193,6 +194,7 @@ void equipment_checkout() {
     // Update equipment status
     strcpy(item->status, "IN-USE");
     strcpy(item->location, department);
+    db_mark_dirty(DB_TABLE_EQUIPMENT_ITEM, item);
     
     // Print checkout slip
     print_checkout_slip(trans);
@@ -239,7 +241,7 @@ void equipment_checkin() {
     }
     
     print("\n=== EQUIPMENT DETAILS ===\n");
-    equipment_type_t* type = find_equipment_type(item->equipment_code);
+    const equipment_type_t* type = find_equipment_type(item->equipment_code);
     
     print("Equipment: %s\n", type->name);
     print("Serial: %s\n", item->serial_number);
@@ -268,6 +270,7 @@ void equipment_checkin() {
     
     // Check if maintenance needed based on usage
     check_maintenance_needed(item);
+    db_mark_dirty(DB_TABLE_EQUIPMENT_ITEM, item);
     
     // Print check-in confirmation
     print_checkin_confirmation(trans);
@@ -311,7 +314,7 @@ void schedule_maintenance() {
         
         for(uint32_t i = 0; i < due_count; i++) {
             uint32_t idx = due_items[i];
-            equipment_type_t* type = 
+            const equipment_type_t* type = 
                 find_equipment_type(equipment_item_db[idx].equipment_code);
             
             char due_date[11];
@@ -361,7 +364,7 @@ void schedule_preventive_maintenance() {
         return;
     }
     
-    equipment_type_t* type = find_equipment_type(item->equipment_code);
+    const equipment_type_t* type = find_equipment_type(item->equipment_code);
     
     print("\nEquipment: %s\n", type->name);
     print("Serial: %s\n", item->serial_number);
@@ -402,6 +405,8 @@ void schedule_preventive_maintenance() {
     // Update equipment record
     item->next_maintenance = record->next_maintenance_date;
     item->maintenance_due = 0;
+    db_mark_dirty(DB_TABLE_EQUIPMENT_ITEM, item);
+    db_mark_dirty(DB_TABLE_MAINTENANCE, record);
     
     // Print work order
     print_maintenance_work_order(record);
@@ -432,14 +437,17 @@ void inventory_report() {
     // Group by category
     // Simplified - in real system would use proper grouping
     
-    for(uint32_t i = 0; i < MAX_EQUIPMENT_TYPES; i++) {
-        if(strlen(equipment_type_db[i].equipment_code) > 0) {
+    // Types in master/equipment_types.csv order, not hash order
+    for(uint32_t i = 0; i < master_equipment_types.count; i++) {
+        const equipment_type_t* type = 
+            master_row(&master_equipment_types, i);
+        if(type && strlen(type->equipment_code) > 0) {
             uint32_t count = 0;
             float value = 0;
             
             for(uint32_t j = 0; j < MAX_EQUIPMENT_ITEMS; j++) {
                 if(strcmp(equipment_item_db[j].equipment_code, 
-                         equipment_type_db[i].equipment_code) == 0) {
+                         type->equipment_code) == 0) {
                     count++;
                     value += equipment_item_db[j].current_value;
                 }
@@ -447,7 +455,7 @@ void inventory_report() {
             
             if(count > 0) {
                 print("%-20s %8d $%11.2f\n",
-                      equipment_type_db[i].category,
+                      type->category,
                       count, value);
                 
                 total_items += count;
@@ -529,6 +537,7 @@ void warehouse_main() {
     while(1) {
         clear_screen();
         print_header("EQUIPMENT WAREHOUSE MANAGEMENT");
+        boot_first_menu();
         
         print_time_date();
         print_warehouse_alerts();